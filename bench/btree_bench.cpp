@@ -0,0 +1,652 @@
+// Benchmarks of Set against std::set, absl::btree_set and a sorted
+// std::vector
+//
+// Every operation is measured for int32, int64 and std::string keys (24
+// characters, longer than the small string buffer), for several B and
+// for sequential, uniform and Zipfian key orders. PackedSet runs on
+// uint64 keys next to Set and std::set, and memory/uint64/... gives
+// the bytes each of them allocates per key. Names read
+// op/key/container/order/size, e.g. find/int64/Set_B16/zipf/1000000, so
+// --benchmark_filter picks any slice of them. Sizes go from 1K to 100M,
+// --max_size=N drops the larger ones:
+//
+//   btree_bench --max_size=1000000 --benchmark_filter='find/int64/.*'
+//
+// Stored keys are 0, 2, 4, ... in key order, so every odd number falls
+// between two of them. Orders give the sequence of keys an operation is
+// called with:
+//  - sequential: increasing
+//  - uniform: a random permutation for insert and erase, independent
+//    uniform draws for lookups
+//  - zipf: skewed draws with exponent 0.99 like YCSB, the popular keys are
+//    scattered over the key range. Inserts and erases repeat keys.
+#include "tree.h"
+#include "packed_tree.h"
+
+#include <benchmark/benchmark.h>
+
+#ifdef BTREE_BENCH_ABSL
+#include <absl/container/btree_set.h>
+#endif
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <random>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace {
+
+enum class order {
+    sequential,
+    uniform,
+    zipf,
+};
+
+const char* order_name(order o) {
+    switch (o) {
+    case order::sequential:
+        return "sequential";
+    case order::uniform:
+        return "uniform";
+    default:
+        return "zipf";
+    }
+}
+
+// Lookups cycle through this many precomputed keys
+constexpr size_t probe_count = 1 << 20;
+// Sorted vector inserts and erases are O(n) each, larger sizes would
+// take hours
+constexpr size_t vector_write_limit = 100000;
+
+template<typename T>
+struct key_traits;
+
+template<>
+struct key_traits<int32_t> {
+    static constexpr const char* name = "int32";
+
+    static int32_t make(uint64_t v) {
+        return static_cast<int32_t>(v);
+    }
+};
+
+template<>
+struct key_traits<int64_t> {
+    static constexpr const char* name = "int64";
+
+    static int64_t make(uint64_t v) {
+        return static_cast<int64_t>(v);
+    }
+};
+
+template<>
+struct key_traits<uint64_t> {
+    static constexpr const char* name = "uint64";
+
+    static uint64_t make(uint64_t v) {
+        return v;
+    }
+};
+
+template<>
+struct key_traits<std::string> {
+    static constexpr const char* name = "string";
+
+    // Zero padded, so the string order is the numeric one
+    static std::string make(uint64_t v) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "user/%019llu", static_cast<unsigned long long>(v));
+        return buf;
+    }
+};
+
+// Zipfian ranks in [0, n), rank 0 is the most frequent. The method of Gray
+// et al., "Quickly generating billion-record synthetic databases", as
+// used by YCSB.
+class zipf_generator {
+public:
+    zipf_generator(uint64_t n, double theta = 0.99)
+        : n(n)
+        , theta(theta)
+        , zetan(zeta(n, theta))
+        , alpha(1 / (1 - theta))
+        , eta((1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / zetan)) {}
+
+    template<typename Rng>
+    uint64_t operator()(Rng &rng) {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zetan;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, theta)) {
+            return 1;
+        }
+        uint64_t r = static_cast<uint64_t>(n * std::pow(eta * u - eta + 1, alpha));
+        return r < n ? r : n - 1;
+    }
+
+private:
+    uint64_t n;
+    double theta;
+    double zetan;
+    double alpha;
+    double eta;
+
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; i++) {
+            sum += 1 / std::pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+};
+
+// Indices of count stored keys in the given order, distinct marks the
+// sequences which visit every key once
+std::vector<uint64_t> indices(order o, uint64_t n, size_t count, bool distinct) {
+    std::mt19937_64 rng(n * 31 + static_cast<uint64_t>(o));
+    std::vector<uint64_t> res(count);
+    switch (o) {
+    case order::sequential:
+        for (size_t i = 0; i < count; i++) {
+            res[i] = i % n;
+        }
+        break;
+    case order::uniform:
+        if (distinct) {
+            for (size_t i = 0; i < count; i++) {
+                res[i] = i;
+            }
+            std::shuffle(res.begin(), res.end(), rng);
+        } else {
+            std::uniform_int_distribution<uint64_t> d(0, n - 1);
+            for (uint64_t &x : res) {
+                x = d(rng);
+            }
+        }
+        break;
+    case order::zipf: {
+        // Ranks are scattered by multiplying with a prime larger than n
+        zipf_generator z(n);
+        constexpr uint64_t prime = (uint64_t(1) << 61) - 1;
+        for (uint64_t &x : res) {
+            x = static_cast<uint64_t>(static_cast<unsigned __int128>(z(rng)) * prime % n);
+        }
+        break;
+    }
+    }
+    return res;
+}
+
+// Keys 2 * i, or the keys 2 * i + 1 right after them with gap set
+template<typename T>
+std::vector<T> keys_at(const std::vector<uint64_t> &idx, bool gap = false) {
+    std::vector<T> res;
+    res.reserve(idx.size());
+    for (uint64_t i : idx) {
+        res.push_back(key_traits<T>::make(2 * i + gap));
+    }
+    return res;
+}
+
+template<typename T>
+std::vector<T> sorted_keys(uint64_t n) {
+    return keys_at<T>(indices(order::sequential, n, n, true));
+}
+
+// Bytes held by the containers with counting_allocator, the benchmarks
+// run on one thread
+size_t allocated_bytes = 0;
+
+template<typename T>
+struct counting_allocator {
+    using value_type = T;
+
+    counting_allocator() {}
+
+    template<typename U>
+    counting_allocator(const counting_allocator<U>&) {}
+
+    T* allocate(size_t n) {
+        allocated_bytes += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n) {
+        allocated_bytes -= n * sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template<typename U>
+    bool operator==(const counting_allocator<U>&) const {
+        return true;
+    }
+
+    template<typename U>
+    bool operator!=(const counting_allocator<U>&) const {
+        return false;
+    }
+};
+
+// Keeps the last container built, so that the lookups at one size share
+// it instead of building it again for every run. Only one is kept at a
+// time, large ones don't fit into memory together.
+class built_cache {
+public:
+    template<typename C, typename Build>
+    static const C &get(uint64_t n, Build build) {
+        static const char tag = 0;
+        if (current_tag != &tag || current_n != n) {
+            current.reset();
+            current = std::make_shared<C>(build());
+            current_tag = &tag;
+            current_n = n;
+        }
+        return *static_cast<const C*>(current.get());
+    }
+
+private:
+    static inline std::shared_ptr<void> current;
+    static inline const void* current_tag = nullptr;
+    static inline uint64_t current_n = 0;
+};
+
+// Any container with the interface of std::set
+template<typename Container>
+struct tree_adapter {
+    using key_type = typename Container::value_type;
+
+    static constexpr bool fast_writes = true;
+
+    Container c;
+
+    tree_adapter() {}
+
+    explicit tree_adapter(const std::vector<key_type> &sorted)
+        : c(sorted.begin(), sorted.end()) {}
+
+    void insert(const key_type &key) {
+        c.insert(key);
+    }
+
+    void erase(const key_type &key) {
+        c.erase(key);
+    }
+
+    bool contains(const key_type &key) const {
+        return c.find(key) != c.end();
+    }
+
+    const key_type* lower_bound(const key_type &key) const {
+        auto it = c.lower_bound(key);
+        return it == c.end() ? nullptr : &*it;
+    }
+
+    template<typename F>
+    void for_each(F f) const {
+        for (const key_type &key : c) {
+            f(key);
+        }
+    }
+};
+
+// PackedSet gives its keys by value, there is nothing to point to
+template<typename Container>
+struct packed_adapter {
+    using key_type = typename Container::value_type;
+
+    static constexpr bool fast_writes = true;
+
+    Container c;
+
+    packed_adapter() {}
+
+    explicit packed_adapter(const std::vector<key_type> &sorted)
+        : c(sorted.begin(), sorted.end()) {}
+
+    void insert(key_type key) {
+        c.insert(key);
+    }
+
+    void erase(key_type key) {
+        c.erase(key);
+    }
+
+    bool contains(key_type key) const {
+        return c.contains(key);
+    }
+
+    std::optional<key_type> lower_bound(key_type key) const {
+        auto it = c.lower_bound(key);
+        return it == c.end() ? std::nullopt : std::optional<key_type>(*it);
+    }
+
+    template<typename F>
+    void for_each(F f) const {
+        c.for_each([&f](key_type key) {
+            f(key);
+        });
+    }
+};
+
+template<typename T>
+struct sorted_vector_adapter {
+    using key_type = T;
+
+    static constexpr bool fast_writes = false;
+
+    std::vector<T> c;
+
+    sorted_vector_adapter() {}
+
+    explicit sorted_vector_adapter(const std::vector<T> &sorted)
+        : c(sorted) {}
+
+    void insert(const T &key) {
+        auto it = std::lower_bound(c.begin(), c.end(), key);
+        if (it == c.end() || key < *it) {
+            c.insert(it, key);
+        }
+    }
+
+    void erase(const T &key) {
+        auto it = std::lower_bound(c.begin(), c.end(), key);
+        if (it != c.end() && !(key < *it)) {
+            c.erase(it);
+        }
+    }
+
+    bool contains(const T &key) const {
+        return std::binary_search(c.begin(), c.end(), key);
+    }
+
+    const T* lower_bound(const T &key) const {
+        auto it = std::lower_bound(c.begin(), c.end(), key);
+        return it == c.end() ? nullptr : &*it;
+    }
+
+    template<typename F>
+    void for_each(F f) const {
+        for (const T &key : c) {
+            f(key);
+        }
+    }
+};
+
+template<typename A>
+const A &full(uint64_t n) {
+    return built_cache::get<A>(n, [n] {
+        return A(sorted_keys<typename A::key_type>(n));
+    });
+}
+
+template<typename A>
+void bm_insert(benchmark::State &state, order o) {
+    uint64_t n = state.range(0);
+    std::vector<typename A::key_type> keys = keys_at<typename A::key_type>(indices(o, n, n, true));
+    for (auto _ : state) {
+        std::optional<A> a;
+        a.emplace();
+        for (const auto &key : keys) {
+            a->insert(key);
+        }
+        benchmark::DoNotOptimize(a->c);
+        state.PauseTiming();
+        a.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template<typename A>
+void bm_erase(benchmark::State &state, order o) {
+    uint64_t n = state.range(0);
+    std::vector<typename A::key_type> keys = keys_at<typename A::key_type>(indices(o, n, n, true));
+    std::vector<typename A::key_type> sorted = sorted_keys<typename A::key_type>(n);
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::optional<A> a;
+        a.emplace(sorted);
+        state.ResumeTiming();
+        for (const auto &key : keys) {
+            a->erase(key);
+        }
+        benchmark::DoNotOptimize(a->c);
+        state.PauseTiming();
+        a.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template<typename A>
+void bm_find(benchmark::State &state, order o) {
+    uint64_t n = state.range(0);
+    std::vector<typename A::key_type> probes = keys_at<typename A::key_type>(indices(o, n, probe_count, false));
+    const A &a = full<A>(n);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(a.contains(probes[i]));
+        i = (i + 1) & (probe_count - 1);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Sets with contains_batch(), lookups run a block at a time
+template<typename C, typename = void>
+struct has_contains_batch : std::false_type {};
+
+template<typename C>
+struct has_contains_batch<C, std::void_t<decltype(std::declval<const C&>().contains_batch(
+    std::declval<const typename C::value_type*>(), std::declval<const typename C::value_type*>(), std::declval<char*>()))>>
+    : std::true_type {};
+
+constexpr size_t batch_block = 1024;
+
+template<typename A>
+void bm_contains_batch(benchmark::State &state, order o) {
+    uint64_t n = state.range(0);
+    std::vector<typename A::key_type> probes = keys_at<typename A::key_type>(indices(o, n, probe_count, false));
+    const A &a = full<A>(n);
+    std::vector<char> out(batch_block);
+    size_t i = 0;
+    for (auto _ : state) {
+        a.c.contains_batch(probes.data() + i, probes.data() + i + batch_block, out.data());
+        benchmark::DoNotOptimize(out.data());
+        i = (i + batch_block) & (probe_count - 1);
+    }
+    state.SetItemsProcessed(state.iterations() * batch_block);
+}
+
+// Probes fall between stored keys, so the search can't stop early
+template<typename A>
+void bm_lower_bound(benchmark::State &state, order o) {
+    uint64_t n = state.range(0);
+    std::vector<typename A::key_type> probes = keys_at<typename A::key_type>(indices(o, n, probe_count, false), true);
+    const A &a = full<A>(n);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(a.lower_bound(probes[i]));
+        i = (i + 1) & (probe_count - 1);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template<typename A>
+void bm_iterate(benchmark::State &state) {
+    uint64_t n = state.range(0);
+    const A &a = full<A>(n);
+    for (auto _ : state) {
+        size_t count = 0;
+        a.for_each([&count](const typename A::key_type &key) {
+            benchmark::DoNotOptimize(&key);
+            count++;
+        });
+        benchmark::DoNotOptimize(count);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Building from sorted unique keys
+template<typename A>
+void bm_bulk_load(benchmark::State &state) {
+    uint64_t n = state.range(0);
+    std::vector<typename A::key_type> sorted = sorted_keys<typename A::key_type>(n);
+    for (auto _ : state) {
+        std::optional<A> a;
+        a.emplace(sorted);
+        benchmark::DoNotOptimize(a->c);
+        state.PauseTiming();
+        a.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Containers whose allocations are counted
+template<typename C, typename = void>
+struct counts_memory : std::false_type {};
+
+template<typename C>
+struct counts_memory<C, std::void_t<decltype(std::declval<const C&>().get_allocator())>>
+    : std::is_same<decltype(std::declval<const C&>().get_allocator()),
+                   counting_allocator<typename C::value_type>> {};
+
+// Bytes per key of the container the lookups run on, built from sorted
+// keys
+template<typename A>
+void bm_memory(benchmark::State &state) {
+    uint64_t n = state.range(0);
+    std::vector<typename A::key_type> sorted = sorted_keys<typename A::key_type>(n);
+    size_t bytes = 0;
+    for (auto _ : state) {
+        size_t before = allocated_bytes;
+        std::optional<A> a;
+        a.emplace(sorted);
+        bytes = allocated_bytes - before;
+        benchmark::DoNotOptimize(a->c);
+        state.PauseTiming();
+        a.reset();
+        state.ResumeTiming();
+    }
+    state.counters["bytes_per_key"] = static_cast<double>(bytes) / n;
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template<typename A>
+void bm_copy(benchmark::State &state) {
+    uint64_t n = state.range(0);
+    const A &a = full<A>(n);
+    for (auto _ : state) {
+        std::optional<A> b;
+        b.emplace(a);
+        benchmark::DoNotOptimize(b->c);
+        state.PauseTiming();
+        b.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+std::vector<int64_t> sizes(uint64_t max_size) {
+    std::vector<int64_t> res;
+    for (int64_t n = 1000; n <= 100000000 && static_cast<uint64_t>(n) <= max_size; n *= 10) {
+        res.push_back(n);
+    }
+    return res;
+}
+
+template<typename A>
+void register_container(const std::string &key, const std::string &container, uint64_t max_size) {
+    std::vector<int64_t> all = sizes(max_size);
+    if (all.empty()) {
+        return;
+    }
+    auto reg = [&](const std::string &op, const std::string &tail, auto fn, bool write) {
+        std::string name = op + "/" + key + "/" + container + tail;
+        benchmark::internal::Benchmark* b = benchmark::RegisterBenchmark(name.c_str(), fn);
+        for (int64_t n : all) {
+            if (write && !A::fast_writes && static_cast<uint64_t>(n) > vector_write_limit) {
+                break;
+            }
+            b->Arg(n);
+        }
+    };
+    for (order o : {order::sequential, order::uniform, order::zipf}) {
+        std::string tail = std::string("/") + order_name(o);
+        reg("insert", tail, [o](benchmark::State &state) { bm_insert<A>(state, o); }, true);
+        reg("erase", tail, [o](benchmark::State &state) { bm_erase<A>(state, o); }, true);
+        reg("find", tail, [o](benchmark::State &state) { bm_find<A>(state, o); }, false);
+        if constexpr (has_contains_batch<decltype(A::c)>::value) {
+            reg("contains_batch", tail, [o](benchmark::State &state) { bm_contains_batch<A>(state, o); }, false);
+        }
+        reg("lower_bound", tail, [o](benchmark::State &state) { bm_lower_bound<A>(state, o); }, false);
+    }
+    reg("iterate", "", bm_iterate<A>, false);
+    reg("bulk_load", "", bm_bulk_load<A>, false);
+    reg("copy", "", bm_copy<A>, false);
+    if constexpr (counts_memory<decltype(A::c)>::value) {
+        reg("memory", "", bm_memory<A>, false);
+    }
+}
+
+template<typename T>
+void register_key(uint64_t max_size) {
+    const std::string key = key_traits<T>::name;
+    register_container<tree_adapter<Set<T, 4>>>(key, "Set_B4", max_size);
+    register_container<tree_adapter<Set<T, 16>>>(key, "Set_B16", max_size);
+    register_container<tree_adapter<Set<T, 32>>>(key, "Set_B32", max_size);
+    register_container<tree_adapter<Set<T, 64>>>(key, "Set_B64", max_size);
+    register_container<tree_adapter<Set<T, auto_fanout_v<T>>>>(key, "Set_auto", max_size);
+    register_container<tree_adapter<std::set<T>>>(key, "std_set", max_size);
+#ifdef BTREE_BENCH_ABSL
+    register_container<tree_adapter<absl::btree_set<T>>>(key, "absl_btree_set", max_size);
+#endif
+    register_container<sorted_vector_adapter<T>>(key, "sorted_vector", max_size);
+}
+
+void register_packed(uint64_t max_size) {
+    using T = uint64_t;
+    using Alloc = counting_allocator<T>;
+    const std::string key = key_traits<T>::name;
+    register_container<packed_adapter<PackedSet<T, 512, 16, Alloc>>>(key, "PackedSet", max_size);
+    register_container<tree_adapter<Set<T, 16, std::less<T>, Alloc>>>(key, "Set_B16", max_size);
+    register_container<tree_adapter<Set<T, auto_fanout_v<T>, std::less<T>, Alloc>>>(key, "Set_auto", max_size);
+    register_container<tree_adapter<std::set<T, std::less<T>, Alloc>>>(key, "std_set", max_size);
+}
+
+}
+
+int main(int argc, char** argv) {
+    // Our own flag, taken out before the library sees the rest
+    uint64_t max_size = 100000000;
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--max_size=", 0) == 0) {
+            max_size = std::strtoull(arg.c_str() + 11, nullptr, 10);
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+    register_key<int32_t>(max_size);
+    register_key<int64_t>(max_size);
+    register_key<std::string>(max_size);
+    register_packed(max_size);
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,241 @@
+// Write-optimised set: inserts and erases are buffered and applied to a
+// B+-tree in sorted batches
+#pragma once
+
+#include "tree.h"
+
+// Set in front of which writes are collected as messages instead of
+// descending the tree one by one. Messages go to a short unsorted tail,
+// a full tail is sorted into a run and runs are merged in cascade, each
+// level about fanout times larger than the one above (a log-structured
+// buffer). Once buffer_size messages are pending they are applied to
+// the tree with one erase_batch() and one insert_batch(), so every touched
+// leaf is visited once per flush.
+//
+// Writes are blind: they don't look at the tree, so they don't report
+// whether the key was there. Lookups check the tail, then the runs from
+// the newest, then the tree, and stop at the first message for the key:
+// O(tail_size + log(buffer_size) * levels + log n). size() and set()
+// flush first.
+template<typename T, unsigned int B = 16, typename Compare = std::less<T>, typename Allocator = std::allocator<T>, typename Policy = default_policy>
+class BufferedSet {
+    // A message replaces the previous one for its key
+    static_assert(!Policy::multi, "equal keys are not supported");
+
+public:
+    using set_type = Set<T, B, Compare, Allocator, Policy>;
+    using value_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+
+    // Messages kept unsorted, lookups scan them
+    static constexpr size_t tail_size = 64;
+    // Ratio of the sizes of consecutive runs
+    static constexpr size_t fanout = 8;
+    static constexpr size_t default_buffer_size = 1 << 20;
+
+private:
+    struct message {
+        T key;
+        bool erase;
+    };
+
+    // Only the nodes of the tree use Allocator, it may be a node pool
+    // which isn't meant for growing arrays
+    using Run = std::vector<message>;
+
+    set_type tree;
+    // Newest messages in arrival order
+    Run tail;
+    // Sorted runs with one message per key, newer ones first. runs[i]
+    // holds at most tail_size * fanout^(i + 1) messages.
+    std::vector<Run> runs;
+    size_t buffered;
+    size_t buffer_size;
+
+    bool less(const T &a, const T &b) const {
+        return btree_detail::key_order<Compare, T, T>::less(tree.key_comp(), a, b);
+    }
+
+    bool equal(const T &a, const T &b) const {
+        return !less(a, b) && !less(b, a);
+    }
+
+    // Merge two runs into one, newer wins on equal keys
+    Run merge(Run &newer, Run &older) const {
+        Run res;
+        res.reserve(newer.size() + older.size());
+        auto a = newer.begin();
+        auto b = older.begin();
+        while (a != newer.end() && b != older.end()) {
+            if (less(b->key, a->key)) {
+                res.push_back(std::move(*b++));
+            } else {
+                if (!less(a->key, b->key)) {
+                    ++b;
+                }
+                res.push_back(std::move(*a++));
+            }
+        }
+        std::move(a, newer.end(), std::back_inserter(res));
+        std::move(b, older.end(), std::back_inserter(res));
+        return res;
+    }
+
+    // Sort the tail into a run and push it down the levels
+    void compact_tail() {
+        if (tail.empty()) {
+            return;
+        }
+        std::stable_sort(tail.begin(), tail.end(), [this](const message &a, const message &b) {
+            return less(a.key, b.key);
+        });
+        // Keep the last message of every key, it is the newest
+        Run run;
+        run.reserve(tail.size());
+        for (size_t i = 0; i < tail.size(); i++) {
+            if (i + 1 < tail.size() && !less(tail[i].key, tail[i + 1].key)) {
+                continue;
+            }
+            run.push_back(std::move(tail[i]));
+        }
+        tail.clear();
+        size_t limit = tail_size;
+        for (size_t level = 0;; level++) {
+            limit *= fanout;
+            if (level == runs.size()) {
+                runs.push_back(std::move(run));
+                break;
+            }
+            run = merge(run, runs[level]);
+            runs[level].clear();
+            if (run.size() <= limit) {
+                runs[level] = std::move(run);
+                break;
+            }
+        }
+        buffered = 0;
+        for (const Run &r : runs) {
+            buffered += r.size();
+        }
+    }
+
+    // Last message for elem, nullptr if there is none
+    const message* lookup(const T &elem) const {
+        for (size_t i = tail.size(); i-- > 0;) {
+            if (equal(tail[i].key, elem)) {
+                return &tail[i];
+            }
+        }
+        for (const Run &run : runs) {
+            auto it = std::lower_bound(run.begin(), run.end(), elem, [this](const message &m, const T &x) {
+                return less(m.key, x);
+            });
+            if (it != run.end() && !less(elem, it->key)) {
+                return &*it;
+            }
+        }
+        return nullptr;
+    }
+
+    template<typename U>
+    void push(U &&elem, bool erase) {
+        tail.push_back(message{std::forward<U>(elem), erase});
+        if (tail.size() == tail_size) {
+            compact_tail();
+            if (buffered >= buffer_size) {
+                flush();
+            }
+        }
+    }
+
+public:
+    explicit BufferedSet(size_t buffer_size = default_buffer_size, const Compare &comp = Compare(), const Allocator &alloc = Allocator())
+        : tree(comp, alloc)
+        , buffered(0)
+        , buffer_size(buffer_size) {
+        tail.reserve(tail_size);
+    }
+
+    key_compare key_comp() const {
+        return tree.key_comp();
+    }
+
+    value_compare value_comp() const {
+        return tree.value_comp();
+    }
+
+    // Queue an insert. Amortized, every message is moved about fanout
+    // times per level of runs, plus its share of a flush.
+    void insert(const T &elem) {
+        push(elem, false);
+    }
+
+    void insert(T &&elem) {
+        push(std::move(elem), false);
+    }
+
+    // Queue an erase
+    void erase(const T &elem) {
+        push(elem, true);
+    }
+
+    bool contains(const T &elem) const {
+        if (const message* m = lookup(elem)) {
+            return !m->erase;
+        }
+        return tree.find(elem) != tree.end();
+    }
+
+    size_t count(const T &elem) const {
+        return contains(elem);
+    }
+
+    // Number of queued messages
+    size_t pending() const {
+        return buffered + tail.size();
+    }
+
+    // Apply all queued messages to the tree
+    void flush() {
+        compact_tail();
+        if (runs.empty()) {
+            return;
+        }
+        Run all = std::move(runs[0]);
+        for (size_t i = 1; i < runs.size(); i++) {
+            all = merge(all, runs[i]);
+        }
+        runs.clear();
+        buffered = 0;
+        std::vector<T> inserted;
+        std::vector<T> erased;
+        for (message &m : all) {
+            (m.erase ? erased : inserted).push_back(std::move(m.key));
+        }
+        // Keys are unique across both, so the order doesn't matter
+        tree.erase_batch(erased.begin(), erased.end());
+        tree.insert_batch(std::make_move_iterator(inserted.begin()), std::make_move_iterator(inserted.end()));
+    }
+
+    // The tree with every message applied, for iteration and ordered queries
+    const set_type &set() {
+        flush();
+        return tree;
+    }
+
+    size_t size() {
+        return set().size();
+    }
+
+    bool empty() {
+        return set().empty();
+    }
+
+    void clear() {
+        tail.clear();
+        runs.clear();
+        buffered = 0;
+        tree.clear();
+    }
+};
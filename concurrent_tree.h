@@ -0,0 +1,537 @@
+// B+-tree for many readers and writers, synchronized with optimistic lock
+// coupling (Leis et al., "The ART of Practical Synchronization")
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace btree_detail {
+
+// Version lock of a node. The version is bumped by every writer, readers
+// don't lock at all: they remember the version before reading a node and
+// check that it didn't change afterwards, otherwise the operation restarts.
+// Bit 1 is set while the node is locked for writing.
+class olc_lock {
+public:
+    // Wait until the node is unlocked and return its version
+    uint64_t read_lock() const {
+        uint64_t v = version.load(std::memory_order_acquire);
+        for (unsigned int spins = 0; locked(v); spins++) {
+            if (spins >= 64) {
+                std::this_thread::yield();
+            }
+            v = version.load(std::memory_order_acquire);
+        }
+        return v;
+    }
+
+    // Whether nothing was written to the node since read_lock() returned v
+    bool check(uint64_t v) const {
+        // Orders the reads of the node before the second read of the version
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return version.load(std::memory_order_relaxed) == v;
+    }
+
+    // Lock the node for writing if it is still at version v
+    bool upgrade(uint64_t v) {
+        if (!version.compare_exchange_strong(v, v + lock_bit, std::memory_order_acquire)) {
+            return false;
+        }
+        // Readers which see any of the following writes also see the lock
+        std::atomic_thread_fence(std::memory_order_release);
+        return true;
+    }
+
+    // Unlock and move to the next version
+    void unlock() {
+        version.fetch_add(lock_bit, std::memory_order_release);
+    }
+
+private:
+    static constexpr uint64_t lock_bit = 2;
+
+    static bool locked(uint64_t v) {
+        return (v & lock_bit) != 0;
+    }
+
+    std::atomic<uint64_t> version{0};
+};
+
+}
+
+// Set of keys shared by any number of reader and writer threads.
+//
+// Lookups take no locks. A descent reads every node optimistically and
+// validates its version before moving on, so a concurrent split makes it
+// restart instead of blocking. insert() and erase() lock only the leaf they
+// change, plus the parent when a node is split. Full internal nodes are
+// split on the way down, so a split never propagates upwards.
+//
+// Every field a reader may see half written is an atomic accessed with
+// relaxed order, so keys must be lock-free atomics: integers, pointers or
+// small trivially copyable structs.
+//
+// Nodes are never freed while the set is alive, so readers never touch
+// freed memory. For the same reason erase() doesn't merge nodes, leaves
+// may become underfull or empty and are reused by later inserts.
+// Separators are the maximum of the left subtree, an internal node with
+// n children has n - 1 of them. Leaves are chained for lower_bound().
+template<typename T, unsigned int B = 16, typename Compare = std::less<T>>
+class ConcurrentSet {
+    static_assert(B >= 2, "B must be at least 2");
+    static_assert(std::is_trivially_copyable<T>::value, "keys must be trivially copyable");
+    static_assert(std::atomic<T>::is_always_lock_free, "keys must be lock-free atomics");
+
+    struct Node {
+        btree_detail::olc_lock lock;
+        const bool leaf;
+        // Number of keys of a leaf, number of children of an internal node
+        std::atomic<unsigned int> cnt{0};
+
+        Node(bool is_leaf)
+            : leaf(is_leaf) {}
+    };
+
+    struct Leaf : Node {
+        std::atomic<T> keys[2 * B];
+        std::atomic<Leaf*> next{nullptr};
+
+        Leaf()
+            : Node(true) {}
+    };
+
+    struct Inner : Node {
+        std::atomic<T> keys[2 * B - 1];
+        std::atomic<Node*> children[2 * B];
+
+        Inner()
+            : Node(false) {}
+    };
+
+    static Inner* inner(Node* p) {
+        return static_cast<Inner*>(p);
+    }
+
+    static Leaf* leaf(Node* p) {
+        return static_cast<Leaf*>(p);
+    }
+
+    static T load(const std::atomic<T> &a) {
+        return a.load(std::memory_order_relaxed);
+    }
+
+    // Position of the first of n keys which is not less than elem. The keys
+    // may be changing, the caller validates the node afterwards.
+    unsigned int lower(const std::atomic<T>* k, unsigned int n, const T &elem) const {
+        unsigned int lo = 0;
+        while (n > 0) {
+            unsigned int half = n / 2;
+            if (comp(load(k[lo + half]), elem)) {
+                lo += half + 1;
+                n -= half + 1;
+            } else {
+                n = half;
+            }
+        }
+        return lo;
+    }
+
+    // Index of the child of an internal node holding elem. A count read
+    // during a write may be out of range, it is clamped and the node fails
+    // validation later.
+    Node* child(Inner* p, const T &elem) const {
+        unsigned int n = p->cnt.load(std::memory_order_relaxed);
+        n = n == 0 ? 1 : n > 2 * B ? 2 * B : n;
+        return p->children[lower(p->keys, n - 1, elem)].load(std::memory_order_relaxed);
+    }
+
+    Compare comp;
+    std::atomic<Node*> root;
+    std::atomic<size_t> sz{0};
+
+    // Descend optimistically to the leaf where elem belongs. Returns the
+    // leaf and its version, or null if a node changed on the way.
+    std::pair<Leaf*, uint64_t> descend(const T &elem) const {
+        Node* cur = root.load(std::memory_order_acquire);
+        uint64_t v = cur->lock.read_lock();
+        if (cur != root.load(std::memory_order_acquire)) {
+            return {nullptr, 0};
+        }
+        while (!cur->leaf) {
+            Node* next = child(inner(cur), elem);
+            if (!cur->lock.check(v)) {
+                return {nullptr, 0};
+            }
+            uint64_t next_v = next->lock.read_lock();
+            // The parent must still be current when the child is entered
+            if (!cur->lock.check(v)) {
+                return {nullptr, 0};
+            }
+            cur = next;
+            v = next_v;
+        }
+        return {leaf(cur), v};
+    }
+
+    // Number of keys a leaf copy may hold, clamped like in child()
+    static unsigned int leaf_count(const Leaf* p) {
+        unsigned int n = p->cnt.load(std::memory_order_relaxed);
+        return n > 2 * B ? 2 * B : n;
+    }
+
+    // Split a full node locked by the caller, its parent is locked too or
+    // it is the root. The upper half goes to a new right sibling.
+    void split(Node* cur, Inner* par) {
+        unsigned int n = cur->cnt.load(std::memory_order_relaxed);
+        unsigned int half = n / 2;
+        T sep;
+        Node* sibling;
+        if (cur->leaf) {
+            Leaf* l = leaf(cur);
+            Leaf* r = new Leaf();
+            for (unsigned int j = half; j < n; j++) {
+                r->keys[j - half].store(load(l->keys[j]), std::memory_order_relaxed);
+            }
+            r->cnt.store(n - half, std::memory_order_relaxed);
+            r->next.store(l->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            sep = load(l->keys[half - 1]);
+            // The sibling is complete before readers can reach it
+            l->next.store(r, std::memory_order_release);
+            l->cnt.store(half, std::memory_order_relaxed);
+            sibling = r;
+        } else {
+            Inner* l = inner(cur);
+            Inner* r = new Inner();
+            for (unsigned int j = half; j < n; j++) {
+                r->children[j - half].store(l->children[j].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+            for (unsigned int j = half; j + 1 < n; j++) {
+                r->keys[j - half].store(load(l->keys[j]), std::memory_order_relaxed);
+            }
+            r->cnt.store(n - half, std::memory_order_relaxed);
+            sep = load(l->keys[half - 1]);
+            l->cnt.store(half, std::memory_order_relaxed);
+            sibling = r;
+        }
+        if (par == nullptr) {
+            Inner* new_root = new Inner();
+            new_root->children[0].store(cur, std::memory_order_relaxed);
+            new_root->children[1].store(sibling, std::memory_order_relaxed);
+            new_root->keys[0].store(sep, std::memory_order_relaxed);
+            new_root->cnt.store(2, std::memory_order_relaxed);
+            root.store(new_root, std::memory_order_release);
+            return;
+        }
+        // Put the sibling right after cur, the parent has room
+        unsigned int pn = par->cnt.load(std::memory_order_relaxed);
+        unsigned int i = 0;
+        while (par->children[i].load(std::memory_order_relaxed) != cur) {
+            i++;
+        }
+        for (unsigned int j = pn; j > i + 1; j--) {
+            par->children[j].store(par->children[j - 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        for (unsigned int j = pn - 1; j > i; j--) {
+            par->keys[j].store(load(par->keys[j - 1]), std::memory_order_relaxed);
+        }
+        par->children[i + 1].store(sibling, std::memory_order_release);
+        par->keys[i].store(sep, std::memory_order_relaxed);
+        par->cnt.store(pn + 1, std::memory_order_relaxed);
+    }
+
+    static void destroy(Node* p) {
+        if (p->leaf) {
+            delete leaf(p);
+            return;
+        }
+        Inner* in = inner(p);
+        for (unsigned int j = 0; j < in->cnt.load(std::memory_order_relaxed); j++) {
+            destroy(in->children[j].load(std::memory_order_relaxed));
+        }
+        delete in;
+    }
+
+    [[noreturn]] static void invariant_failed(const char* what) {
+        throw std::logic_error(std::string("ConcurrentSet invariant violated: ") + what);
+    }
+
+    // Check the subtree of p at the given depth, its keys must be greater
+    // than *lo and at most *hi where given. prev is the leaf before the
+    // subtree, on return its last leaf, and depth is set to the depth of
+    // the leaves on the first one. Returns the number of keys.
+    size_t check_subtree(Node* p, unsigned int depth, unsigned int &h, const T* lo, const T* hi, Leaf* &prev) const {
+        unsigned int n = p->cnt.load(std::memory_order_relaxed);
+        if (n > 2 * B) {
+            invariant_failed("a node is overfull");
+        }
+        if (p->leaf) {
+            Leaf* l = leaf(p);
+            if (prev == nullptr) {
+                h = depth;
+            } else if (prev->next.load(std::memory_order_relaxed) != l) {
+                invariant_failed("the leaf chain is broken");
+            }
+            if (depth != h) {
+                invariant_failed("leaves are at different depths");
+            }
+            for (unsigned int i = 0; i < n; i++) {
+                T k = load(l->keys[i]);
+                if ((i > 0 && !comp(load(l->keys[i - 1]), k)) || (lo != nullptr && !comp(*lo, k)) || (hi != nullptr && comp(*hi, k))) {
+                    invariant_failed("keys are out of order");
+                }
+            }
+            prev = l;
+            return n;
+        }
+        if (n < 2) {
+            invariant_failed("an internal node has a single child");
+        }
+        Inner* in = inner(p);
+        size_t total = 0;
+        for (unsigned int i = 0; i < n; i++) {
+            // Child i holds the keys between separators i - 1 and i
+            T sep_lo = i > 0 ? load(in->keys[i - 1]) : T();
+            T sep_hi = i + 1 < n ? load(in->keys[i]) : T();
+            if (i > 0 && i + 1 < n && !comp(sep_lo, sep_hi)) {
+                invariant_failed("separators are out of order");
+            }
+            total += check_subtree(in->children[i].load(std::memory_order_relaxed), depth + 1, h,
+                                   i > 0 ? &sep_lo : lo, i + 1 < n ? &sep_hi : hi, prev);
+        }
+        return total;
+    }
+
+    // Visit the leaves after one with version v until a key not less than
+    // elem shows up. All leaves are validated once more at the end, so the
+    // answer held at one moment.
+    std::optional<std::optional<T>> scan_right(Leaf* p, uint64_t v, const T &elem) const {
+        thread_local std::vector<std::pair<Leaf*, uint64_t>> seen;
+        seen.clear();
+        seen.emplace_back(p, v);
+        std::optional<T> res;
+        while (true) {
+            Leaf* next = p->next.load(std::memory_order_acquire);
+            if (!p->lock.check(v)) {
+                return std::nullopt;
+            }
+            if (next == nullptr) {
+                break;
+            }
+            p = next;
+            v = p->lock.read_lock();
+            unsigned int n = leaf_count(p);
+            unsigned int i = lower(p->keys, n, elem);
+            if (i < n) {
+                res = load(p->keys[i]);
+                if (!p->lock.check(v)) {
+                    return std::nullopt;
+                }
+                break;
+            }
+            seen.emplace_back(p, v);
+        }
+        for (auto [l, lv] : seen) {
+            if (!l->lock.check(lv)) {
+                return std::nullopt;
+            }
+        }
+        return res;
+    }
+
+public:
+    ConcurrentSet()
+        : ConcurrentSet(Compare()) {}
+
+    explicit ConcurrentSet(const Compare &c)
+        : comp(c)
+        , root(new Leaf()) {}
+
+    ConcurrentSet(const ConcurrentSet&) = delete;
+    ConcurrentSet& operator=(const ConcurrentSet&) = delete;
+
+    // Must not run concurrently with anything else
+    ~ConcurrentSet() {
+        destroy(root.load(std::memory_order_relaxed));
+    }
+
+    // Number of keys, exact when no writer is running
+    size_t size() const {
+        return sz.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // Walk the whole tree and throw std::logic_error if its structure is
+    // broken: overfull nodes, internal nodes with a single child, leaves
+    // at different depths, keys out of order or outside the separators
+    // above them, a broken leaf chain or a wrong size(). Leaves may be
+    // underfull, erase() doesn't merge them. O(n), must not run
+    // concurrently with writers.
+    void check_invariants() const {
+        Leaf* prev = nullptr;
+        unsigned int h = 0;
+        size_t n = check_subtree(root.load(std::memory_order_acquire), 0, h, nullptr, nullptr, prev);
+        if (prev->next.load(std::memory_order_relaxed) != nullptr) {
+            invariant_failed("the last leaf has a next leaf");
+        }
+        if (n != size()) {
+            invariant_failed("size() doesn't match the number of keys");
+        }
+    }
+
+    bool contains(const T &elem) const {
+        while (true) {
+            auto [l, v] = descend(elem);
+            if (l == nullptr) {
+                continue;
+            }
+            unsigned int n = leaf_count(l);
+            unsigned int i = lower(l->keys, n, elem);
+            bool found = i < n && !comp(elem, load(l->keys[i]));
+            if (l->lock.check(v)) {
+                return found;
+            }
+        }
+    }
+
+    // The smallest key not less than elem, if there is one
+    std::optional<T> lower_bound(const T &elem) const {
+        while (true) {
+            auto [l, v] = descend(elem);
+            if (l == nullptr) {
+                continue;
+            }
+            unsigned int n = leaf_count(l);
+            unsigned int i = lower(l->keys, n, elem);
+            if (i < n) {
+                T res = load(l->keys[i]);
+                if (l->lock.check(v)) {
+                    return res;
+                }
+                continue;
+            }
+            // Everything here is less, the answer is in a later leaf
+            if (auto res = scan_right(l, v, elem)) {
+                return *res;
+            }
+        }
+    }
+
+    // Returns whether the key was inserted
+    bool insert(const T &elem) {
+        while (true) {
+            Node* cur = root.load(std::memory_order_acquire);
+            uint64_t v = cur->lock.read_lock();
+            if (cur != root.load(std::memory_order_acquire)) {
+                continue;
+            }
+            Inner* par = nullptr;
+            uint64_t par_v = 0;
+            bool restart = false;
+            while (true) {
+                // Split full nodes on the way down, so the parent always has room
+                if (cur->cnt.load(std::memory_order_relaxed) == 2 * B) {
+                    if (par != nullptr && !par->lock.upgrade(par_v)) {
+                        restart = true;
+                        break;
+                    }
+                    if (!cur->lock.upgrade(v)) {
+                        if (par != nullptr) {
+                            par->lock.unlock();
+                        }
+                        restart = true;
+                        break;
+                    }
+                    // A root that got a parent in the meantime
+                    if (par == nullptr && cur != root.load(std::memory_order_relaxed)) {
+                        cur->lock.unlock();
+                        restart = true;
+                        break;
+                    }
+                    split(cur, par);
+                    cur->lock.unlock();
+                    if (par != nullptr) {
+                        par->lock.unlock();
+                    }
+                    restart = true;
+                    break;
+                }
+                if (cur->leaf) {
+                    break;
+                }
+                Node* next = child(inner(cur), elem);
+                if (!cur->lock.check(v) || (par != nullptr && !par->lock.check(par_v))) {
+                    restart = true;
+                    break;
+                }
+                uint64_t next_v = next->lock.read_lock();
+                if (!cur->lock.check(v)) {
+                    restart = true;
+                    break;
+                }
+                par = inner(cur);
+                par_v = v;
+                cur = next;
+                v = next_v;
+            }
+            if (restart) {
+                continue;
+            }
+            Leaf* l = leaf(cur);
+            if (!l->lock.upgrade(v)) {
+                continue;
+            }
+            if (par != nullptr && !par->lock.check(par_v)) {
+                l->lock.unlock();
+                continue;
+            }
+            unsigned int n = l->cnt.load(std::memory_order_relaxed);
+            unsigned int i = lower(l->keys, n, elem);
+            if (i < n && !comp(elem, load(l->keys[i]))) {
+                l->lock.unlock();
+                return false;
+            }
+            for (unsigned int j = n; j > i; j--) {
+                l->keys[j].store(load(l->keys[j - 1]), std::memory_order_relaxed);
+            }
+            l->keys[i].store(elem, std::memory_order_relaxed);
+            l->cnt.store(n + 1, std::memory_order_relaxed);
+            l->lock.unlock();
+            sz.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    // Returns whether the key was there
+    bool erase(const T &elem) {
+        while (true) {
+            auto [l, v] = descend(elem);
+            if (l == nullptr || !l->lock.upgrade(v)) {
+                continue;
+            }
+            unsigned int n = l->cnt.load(std::memory_order_relaxed);
+            unsigned int i = lower(l->keys, n, elem);
+            if (i == n || comp(elem, load(l->keys[i]))) {
+                l->lock.unlock();
+                return false;
+            }
+            for (unsigned int j = i; j + 1 < n; j++) {
+                l->keys[j].store(load(l->keys[j + 1]), std::memory_order_relaxed);
+            }
+            l->cnt.store(n - 1, std::memory_order_relaxed);
+            l->lock.unlock();
+            sz.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+};
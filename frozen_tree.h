@@ -0,0 +1,203 @@
+// Immutable set in one flat array, laid out as a static B+-tree without
+// pointers
+#pragma once
+
+#include "tree.h"
+
+// Set frozen for reading, made by Set::freeze() or from sorted keys. Keys
+// and separators live in a single array: first the keys in order, padded
+// to whole blocks of B, then every level of separators above them up to
+// the root. A node is a block of B separators, the maximum of each of its
+// children, and the children of node k of a level are nodes k * B to
+// k * B + B - 1 of the level below, so the position of every node is
+// computed instead of stored. Padding repeats the largest key.
+//
+// A lookup searches one block per level, a fixed number of them, with the
+// same vectorized search as Set for arithmetic keys. Apart from about
+// 1 / (B - 1) extra keys for the separators there is no overhead, and
+// iterators are plain pointers into the sorted keys.
+//
+// Equal keys may be frozen as they come, lower_bound() finds the first
+// of them.
+template<typename T, unsigned int B = btree_detail::frozen_fanout, typename Compare = std::less<T>, typename Allocator = std::allocator<T>>
+class FrozenSet : private btree_detail::compare_holder<Compare> {
+    static_assert(B >= 2, "B must be at least 2");
+
+    using CompareHolder = btree_detail::compare_holder<Compare>;
+
+public:
+    using value_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+    using iterator = const T*;
+    using const_iterator = const T*;
+
+private:
+    // Keys, then the separator levels from the bottom up
+    std::vector<T, Allocator> data;
+    // Start of every level in data, the keys are level 0 and the root is
+    // the last one
+    std::vector<size_t> levels;
+    size_t sz;
+
+    bool less(const T &a, const T &b) const {
+        return btree_detail::key_order<Compare, T, T>::less(this->comp(), a, b);
+    }
+
+    // Position of the first key of block k[0, B) not less than elem
+    unsigned int lower(const T* k, const T &elem) const {
+        if constexpr (btree_detail::key_order<Compare, T, T>::user_three_way) {
+            return btree_detail::lower_bound(k, B, elem, [this](const T &a, const T &b) {
+                return less(a, b);
+            });
+        } else {
+            return btree_detail::lower_bound(k, B, elem, this->comp());
+        }
+    }
+
+    // Position of the first key of the block greater than elem
+    unsigned int upper(const T* k, const T &elem) const {
+        return btree_detail::count_less(k, B, elem, [this](const T &a, const T &b) {
+            return !less(b, a);
+        });
+    }
+
+    // Go down from the root with search picking a position in every block,
+    // returns the position in the keys. The largest key is at least elem,
+    // so every block has a position to go to.
+    template<typename Search>
+    size_t descend(const T &elem, Search search) const {
+        size_t k = 0;
+        for (size_t level = levels.size(); level-- > 1;) {
+            k = k * B + search(data.data() + levels[level] + k * B, elem);
+        }
+        return k * B + search(data.data() + k * B, elem);
+    }
+
+    // Length of data for n keys
+    static size_t total_size(size_t n) {
+        size_t nodes = (n + B - 1) / B;
+        size_t total = nodes * B;
+        while (nodes > 1) {
+            nodes = (nodes + B - 1) / B;
+            total += nodes * B;
+        }
+        return total;
+    }
+
+    // Add the padding and the separator levels above the keys already in
+    // data
+    void build() {
+        sz = data.size();
+        levels.assign(1, 0);
+        if (sz == 0) {
+            return;
+        }
+        size_t nodes = (sz + B - 1) / B;
+        data.reserve(total_size(sz));
+        data.resize(nodes * B, data[sz - 1]);
+        // Separators of a level are the last keys of the blocks below
+        while (nodes > 1) {
+            size_t below = levels.back();
+            size_t parents = (nodes + B - 1) / B;
+            levels.push_back(data.size());
+            for (size_t j = 0; j < parents * B; j++) {
+                size_t child = std::min(j, nodes - 1);
+                T sep = data[below + child * B + B - 1];
+                data.push_back(std::move(sep));
+            }
+            nodes = parents;
+        }
+    }
+
+public:
+    explicit FrozenSet(const Compare &comp = Compare(), const Allocator &alloc = Allocator())
+        : CompareHolder(comp)
+        , data(alloc)
+        , levels(1, 0)
+        , sz(0) {}
+
+    // Input is known to be sorted, equal keys are kept
+    template<typename Iter>
+    FrozenSet(sorted_unique_t, Iter begin, Iter end, const Compare &comp = Compare(), const Allocator &alloc = Allocator())
+        : CompareHolder(comp)
+        , data(alloc)
+        , sz(0) {
+        // Known sizes are allocated once, with room for the separators
+        if constexpr (std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<Iter>::iterator_category>::value) {
+            data.reserve(total_size(std::distance(begin, end)));
+        }
+        data.assign(begin, end);
+        build();
+    }
+
+    key_compare key_comp() const {
+        return this->comp();
+    }
+
+    value_compare value_comp() const {
+        return this->comp();
+    }
+
+    bool empty() const {
+        return sz == 0;
+    }
+
+    size_t size() const {
+        return sz;
+    }
+
+    // Memory of the keys and separators
+    size_t bytes() const {
+        return data.capacity() * sizeof(T);
+    }
+
+    iterator begin() const {
+        return data.data();
+    }
+
+    iterator end() const {
+        return data.data() + sz;
+    }
+
+    // First key which is not less than elem
+    iterator lower_bound(const T &elem) const {
+        if (sz == 0 || less(data[sz - 1], elem)) {
+            return end();
+        }
+        return begin() + descend(elem, [this](const T* k, const T &x) {
+            return lower(k, x);
+        });
+    }
+
+    // First key which is greater than elem
+    iterator upper_bound(const T &elem) const {
+        if (sz == 0 || !less(elem, data[sz - 1])) {
+            return end();
+        }
+        return begin() + descend(elem, [this](const T* k, const T &x) {
+            return upper(k, x);
+        });
+    }
+
+    std::pair<iterator, iterator> equal_range(const T &elem) const {
+        return {lower_bound(elem), upper_bound(elem)};
+    }
+
+    iterator find(const T &elem) const {
+        iterator it = lower_bound(elem);
+        if (it != end() && less(elem, *it)) {
+            return end();
+        }
+        return it;
+    }
+
+    bool contains(const T &elem) const {
+        return find(elem) != end();
+    }
+
+    size_t count(const T &elem) const {
+        auto [first, last] = equal_range(elem);
+        return last - first;
+    }
+};
@@ -0,0 +1,124 @@
+// Stress test of ConcurrentSet, meant to run under ThreadSanitizer and
+// AddressSanitizer as well
+//
+// Writers insert and erase random keys of their own stripe, key % writers,
+// and remember what they did in a std::set. Readers run contains() and
+// lower_bound() at the same time on keys inserted before the start, which
+// no writer erases, so some answers are known in advance. At the end the
+// tree is compared with the union of the writers' sets and
+// check_invariants() runs.
+//
+//   concurrent_stress [ops per writer [seed]]
+#include "concurrent_tree.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr unsigned int writers = 4;
+constexpr unsigned int readers = 2;
+// Keys are below this, multiples of stable_step are never erased
+constexpr int64_t key_range = 1 << 14;
+constexpr int64_t stable_step = 64;
+
+std::atomic<bool> failed{false};
+
+void expect(bool ok, const char* what) {
+    if (!ok && !failed.exchange(true)) {
+        std::fprintf(stderr, "concurrent_stress: %s\n", what);
+    }
+}
+
+bool stable(int64_t k) {
+    return k % stable_step == 0;
+}
+
+template<typename S>
+void run(unsigned long ops, unsigned long seed) {
+    S s;
+    for (int64_t k = 0; k < key_range; k += stable_step) {
+        s.insert(k);
+    }
+    std::vector<std::set<int64_t>> done(writers);
+    std::atomic<unsigned int> running{writers};
+    std::vector<std::thread> threads;
+    for (unsigned int w = 0; w < writers; w++) {
+        threads.emplace_back([&, w] {
+            std::mt19937_64 gen(seed * 31 + w);
+            std::set<int64_t> &mine = done[w];
+            for (unsigned long i = 0; i < ops; i++) {
+                int64_t k = static_cast<int64_t>(gen() % (key_range / writers)) * writers + w;
+                if (stable(k)) {
+                    continue;
+                }
+                if (gen() % 3) {
+                    expect(s.insert(k) == mine.insert(k).second, "insert() result differs");
+                } else {
+                    expect(s.erase(k) == (mine.erase(k) != 0), "erase() result differs");
+                }
+            }
+            running.fetch_sub(1);
+        });
+    }
+    for (unsigned int r = 0; r < readers; r++) {
+        threads.emplace_back([&, r] {
+            std::mt19937_64 gen(seed * 37 + r);
+            while (running.load() != 0) {
+                int64_t k = static_cast<int64_t>(gen() % key_range);
+                if (stable(k)) {
+                    expect(s.contains(k), "a stable key is missing");
+                }
+                // The next stable key is the furthest answer there can be
+                auto next = s.lower_bound(k);
+                int64_t limit = (k + stable_step - 1) / stable_step * stable_step;
+                if (limit < key_range) {
+                    expect(next && *next >= k && *next <= limit, "lower_bound() is out of range");
+                }
+            }
+        });
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    std::set<int64_t> ref;
+    for (int64_t k = 0; k < key_range; k += stable_step) {
+        ref.insert(k);
+    }
+    for (const std::set<int64_t> &mine : done) {
+        ref.insert(mine.begin(), mine.end());
+    }
+    s.check_invariants();
+    expect(s.size() == ref.size(), "size() differs");
+    // Walk the keys with lower_bound()
+    auto it = ref.begin();
+    for (auto k = s.lower_bound(0); k; k = s.lower_bound(*k + 1)) {
+        expect(it != ref.end() && *k == *it, "contents differ");
+        if (it == ref.end()) {
+            break;
+        }
+        ++it;
+    }
+    expect(it == ref.end(), "keys are missing");
+}
+
+}
+
+int main(int argc, char** argv) {
+    unsigned long ops = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+    unsigned long seed = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1;
+    // Small nodes split all the time
+    run<ConcurrentSet<int64_t, 2>>(ops, seed);
+    run<ConcurrentSet<int64_t, 16>>(ops, seed + 1);
+    if (failed.load()) {
+        return 1;
+    }
+    std::printf("concurrent_stress: passed\n");
+    return 0;
+}
@@ -0,0 +1,892 @@
+// Differential fuzzer of the containers against std::set, std::multiset
+// and std::map
+//
+// The input is read as a sequence of operations with their arguments and
+// applied to a Set and to the reference, then the results, the contents
+// and check_invariants() are compared after every step. Keys come from a
+// small range, so nodes fill, split, steal and merge all the time. Each
+// input runs on several B, policies and allocators. Some steps also check
+// the containers made from a Set: frozen copies, files written by save()
+// and mapped by MappedSet, and PersistentSet snapshots.
+//
+// The same input also drives BufferedSet with buffers of several sizes;
+// Map, through operator[], try_emplace(), at() and the pair of
+// references its iterators give; PackedSet, with keys spread so that
+// leaves take every offset width up to the largest key; and StringSet,
+// with keys sharing prefixes and keys of max_key_size. Every run ends by
+// erasing all the keys, so underfull nodes get merged and refilled all
+// the way down to an empty container.
+//
+// Built with BTREE_LIBFUZZER it is a libFuzzer target, otherwise main()
+// feeds it random inputs:
+//
+//   set_fuzz [runs [seed]]
+#include "tree.h"
+#include "buffered_tree.h"
+#include "frozen_tree.h"
+#include "map_tree.h"
+#include "mapped_tree.h"
+#include "packed_tree.h"
+#include "persistent_tree.h"
+#include "string_tree.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+// Number of distinct keys, a few leaves worth for small B
+constexpr int key_range = 512;
+// Longest run of keys for the batch operations
+constexpr unsigned int max_run = 64;
+
+[[noreturn]] void fail(const char* what) {
+    std::fprintf(stderr, "set_fuzz: %s\n", what);
+    std::abort();
+}
+
+void expect(bool ok, const char* what) {
+    if (!ok) {
+        fail(what);
+    }
+}
+
+// Bytes of the input, zeros once it runs out
+class input {
+public:
+    input(const uint8_t* data, size_t size)
+        : data(data)
+        , size(size) {}
+
+    bool done() const {
+        return pos == size;
+    }
+
+    uint8_t byte() {
+        return pos < size ? data[pos++] : 0;
+    }
+
+    int key() {
+        int hi = byte();
+        return (hi << 8 | byte()) % key_range;
+    }
+
+    // Sorted keys, unique ones unless equal is set
+    std::vector<int> run(bool equal) {
+        unsigned int n = byte() % max_run;
+        std::vector<int> keys;
+        for (unsigned int i = 0; i < n; i++) {
+            keys.push_back(key());
+        }
+        std::sort(keys.begin(), keys.end());
+        if (!equal) {
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        }
+        return keys;
+    }
+
+private:
+    const uint8_t* data;
+    size_t size;
+    size_t pos = 0;
+};
+
+// File for the save() and MappedSet round trips, one per process
+const std::string &save_path() {
+    static const std::string path = "/tmp/set_fuzz." + std::to_string(::getpid());
+    return path;
+}
+
+template<typename S>
+struct reference_of;
+
+template<unsigned int B, typename Allocator, typename Policy>
+struct reference_of<Set<int, B, std::less<int>, Allocator, Policy>> {
+    static constexpr unsigned int b = B;
+    static constexpr bool multi = Policy::multi;
+    static constexpr bool order_statistics = Policy::order_statistics;
+    using type = typename std::conditional<multi, std::multiset<int>, std::set<int>>::type;
+};
+
+template<unsigned int B, typename Allocator, typename Policy>
+struct reference_of<Map<int, int, B, std::less<int>, Allocator, Policy>> {
+    static constexpr bool order_statistics = Policy::order_statistics;
+    using type = std::map<int, int>;
+};
+
+template<typename S>
+void expect_equal(const S &s, const typename reference_of<S>::type &ref) {
+    s.check_invariants();
+    expect(s.size() == ref.size(), "size() differs");
+    expect(s.empty() == ref.empty(), "empty() differs");
+    expect(std::equal(s.begin(), s.end(), ref.begin(), ref.end()), "contents differ");
+}
+
+// Compare an iterator of c with one of ref
+template<typename C, typename It, typename Ref>
+bool same(const C &c, It it, const Ref &ref, typename Ref::const_iterator rit) {
+    if (rit == ref.end()) {
+        return it == c.end();
+    }
+    return it != c.end() && *it == *rit;
+}
+
+// Contents and lookups of another container made from the set
+template<typename C, typename Ref>
+void expect_copy(const C &c, const Ref &ref, input &in, const char* what) {
+    expect(std::equal(c.begin(), c.end(), ref.begin(), ref.end()), what);
+    for (int j = 0; j < 4; j++) {
+        int k = in.key();
+        expect(same(c, c.lower_bound(k), ref, ref.lower_bound(k)), what);
+        expect(same(c, c.find(k), ref, ref.find(k)), what);
+        expect(c.contains(k) == (ref.count(k) != 0), what);
+    }
+}
+
+// Sorted keys in the order the drain at the end of a run erases them:
+// ascending, descending or from both ends in turn
+template<typename K>
+std::vector<K> drain_order(std::vector<K> keys, size_t which) {
+    switch (which % 3) {
+    case 0:
+        break;
+    case 1:
+        std::reverse(keys.begin(), keys.end());
+        break;
+    default: {
+        std::vector<K> res;
+        for (size_t i = 0, j = keys.size(); i < j;) {
+            res.push_back(std::move(keys[i++]));
+            if (i < j) {
+                res.push_back(std::move(keys[--j]));
+            }
+        }
+        keys = std::move(res);
+        break;
+    }
+    }
+    return keys;
+}
+
+template<typename S>
+void run_ops(const uint8_t* data, size_t size) {
+    using Ref = typename reference_of<S>::type;
+    constexpr bool multi = reference_of<S>::multi;
+    input in(data, size);
+    S s;
+    Ref ref;
+    while (!in.done()) {
+        switch (in.byte() % 20) {
+        case 0:
+        case 1:
+        case 2: {
+            int k = in.key();
+            auto [it, inserted] = s.insert(k);
+            auto rit = ref.insert(k);
+            expect(*it == k, "insert() returned a wrong iterator");
+            if constexpr (multi) {
+                expect(inserted, "insert() of an equal key failed");
+            } else {
+                expect(inserted == rit.second, "insert() result differs");
+            }
+            break;
+        }
+        case 3:
+        case 4: {
+            int k = in.key();
+            expect(s.erase(k) == ref.erase(k), "erase() count differs");
+            break;
+        }
+        case 5: {
+            // Erase at an iterator, the result is the next key
+            int k = in.key();
+            auto it = s.lower_bound(k);
+            auto rit = ref.lower_bound(k);
+            expect(same(s, it, ref, rit), "lower_bound() differs");
+            if (rit != ref.end()) {
+                it = s.erase(it);
+                rit = ref.erase(rit);
+                expect(same(s, it, ref, rit), "erase(iterator) returned a wrong iterator");
+            }
+            break;
+        }
+        case 6: {
+            int a = in.key();
+            int b = in.key();
+            if (b < a) {
+                std::swap(a, b);
+            }
+            auto it = s.erase(s.lower_bound(a), s.lower_bound(b));
+            auto rit = ref.erase(ref.lower_bound(a), ref.lower_bound(b));
+            expect(same(s, it, ref, rit), "range erase() returned a wrong iterator");
+            break;
+        }
+        case 7: {
+            std::vector<int> keys = in.run(true);
+            size_t inserted = s.insert_batch(keys.begin(), keys.end());
+            size_t before = ref.size();
+            ref.insert(keys.begin(), keys.end());
+            expect(inserted == ref.size() - before, "insert_batch() count differs");
+            break;
+        }
+        case 8: {
+            std::vector<int> keys = in.run(true);
+            size_t erased = s.erase_batch(keys.begin(), keys.end());
+            size_t before = ref.size();
+            for (int k : keys) {
+                ref.erase(k);
+            }
+            expect(erased == before - ref.size(), "erase_batch() count differs");
+            break;
+        }
+        case 9: {
+            // Rare, it throws everything away
+            if (in.byte() % 8 == 0) {
+                std::vector<int> keys = in.run(multi);
+                double fill = (in.byte() % 4 + 1) / 4.0;
+                s.bulk_load(keys.begin(), keys.end(), fill);
+                ref = Ref(keys.begin(), keys.end());
+            }
+            break;
+        }
+        case 10: {
+            // Split and check both halves, then join them back
+            int k = in.key();
+            S right = s.split_at(k);
+            Ref ref_right(ref.lower_bound(k), ref.end());
+            Ref ref_left(ref.begin(), ref.lower_bound(k));
+            expect_equal(s, ref_left);
+            expect_equal(right, ref_right);
+            if (in.byte() % 2) {
+                s.join(right);
+            } else {
+                s = join(std::move(s), std::move(right));
+            }
+            break;
+        }
+        case 11: {
+            // Merge a second set, keys already present stay in it
+            std::vector<int> keys = in.run(multi);
+            S other;
+            other.bulk_load(keys.begin(), keys.end());
+            Ref ref_other(keys.begin(), keys.end());
+            s.merge(other);
+            ref.merge(ref_other);
+            expect_equal(other, ref_other);
+            break;
+        }
+        case 12: {
+            // Copies are independent, moves leave the source empty
+            S copy(s);
+            expect_equal(copy, ref);
+            copy.insert(in.key());
+            expect_equal(s, ref);
+            S moved(std::move(copy));
+            moved.check_invariants();
+            expect(copy.empty(), "a moved from set isn't empty");
+            copy = s;
+            s = std::move(copy);
+            break;
+        }
+        case 13: {
+            if (in.byte() % 16 == 0) {
+                s.clear();
+                ref.clear();
+            }
+            break;
+        }
+        case 14: {
+            int k = in.key();
+            expect(same(s, s.lower_bound(k), ref, ref.lower_bound(k)), "lower_bound() differs");
+            expect(same(s, s.upper_bound(k), ref, ref.upper_bound(k)), "upper_bound() differs");
+            expect(same(s, s.find(k), ref, ref.find(k)), "find() differs");
+            expect(s.count(k) == ref.count(k), "count() differs");
+            if constexpr (reference_of<S>::order_statistics) {
+                size_t r = std::distance(ref.begin(), ref.lower_bound(k));
+                expect(s.rank(k) == r, "rank() differs");
+                expect(same(s, s.select(r), ref, ref.lower_bound(k)), "select() differs");
+            }
+            break;
+        }
+        case 15: {
+            // Walk backwards from a key and compare every step
+            int k = in.key();
+            auto it = s.lower_bound(k);
+            auto rit = ref.lower_bound(k);
+            while (rit != ref.begin()) {
+                --it;
+                --rit;
+                expect(*it == *rit, "backward iteration differs");
+            }
+            expect(it == s.begin(), "backward iteration didn't end at begin()");
+            break;
+        }
+        case 16: {
+            // Frozen copies answer like the set, freezing a temporary
+            // takes its keys
+            auto frozen = s.freeze();
+            expect_copy(frozen, ref, in, "freeze() differs");
+            for (int j = 0; j < 4; j++) {
+                int k = in.key();
+                expect(same(frozen, frozen.upper_bound(k), ref, ref.upper_bound(k)), "frozen upper_bound() differs");
+                expect(frozen.count(k) == ref.count(k), "frozen count() differs");
+            }
+            if (in.byte() % 4 == 0) {
+                S copy(s);
+                auto taken = std::move(copy).freeze();
+                expect(std::equal(taken.begin(), taken.end(), ref.begin(), ref.end()), "freeze() && differs");
+                expect_equal(copy, Ref());
+            }
+            break;
+        }
+        case 17: {
+            // Rare, it writes a file
+            if (in.byte() % 8 == 0) {
+                s.save(save_path());
+                {
+                    MappedSet<int, reference_of<S>::b> mapped(save_path());
+                    expect(mapped.size() == ref.size(), "mapped size() differs");
+                    expect_copy(mapped, ref, in, "MappedSet differs");
+                }
+                std::remove(save_path().c_str());
+            }
+            break;
+        }
+        case 18: {
+            // Every snapshot keeps the keys it was taken with while the
+            // other versions change
+            if constexpr (!multi) {
+                using Persistent = PersistentSet<int, 2>;
+                Persistent p(s.begin(), s.end());
+                Ref current = ref;
+                std::vector<std::pair<Persistent, Ref>> versions;
+                unsigned int writes = in.byte() % 32;
+                for (unsigned int j = 0; j < writes; j++) {
+                    if (j % 4 == 0) {
+                        versions.emplace_back(p.snapshot(), current);
+                    }
+                    int k = in.key();
+                    if (in.byte() % 2) {
+                        expect(p.insert(k) == current.insert(k).second, "PersistentSet insert() differs");
+                    } else {
+                        expect(p.erase(k) == current.erase(k), "PersistentSet erase() differs");
+                    }
+                }
+                versions.emplace_back(std::move(p), std::move(current));
+                for (auto &[version, keys] : versions) {
+                    expect(version.size() == keys.size(), "snapshot size() differs");
+                    expect_copy(version, keys, in, "snapshot differs");
+                }
+            }
+            break;
+        }
+        default: {
+            // Unsorted batch lookups and a fold over the keys
+            std::vector<int> keys;
+            unsigned int n = in.byte() % max_run;
+            for (unsigned int j = 0; j < n; j++) {
+                keys.push_back(in.key());
+            }
+            std::vector<typename S::iterator> found(n);
+            std::vector<char> present(n);
+            s.find_batch(keys.begin(), keys.end(), found.begin());
+            s.contains_batch(keys.begin(), keys.end(), present.begin());
+            for (unsigned int j = 0; j < n; j++) {
+                expect(same(s, found[j], ref, ref.find(keys[j])), "find_batch() differs");
+                expect(bool(present[j]) == (ref.count(keys[j]) != 0), "contains_batch() differs");
+            }
+            auto add = [](long a, long b) {
+                return a + b;
+            };
+            long sum = s.parallel_reduce(0L, add, add, 4);
+            expect(sum == std::accumulate(ref.begin(), ref.end(), 0L), "parallel_reduce() differs");
+            break;
+        }
+        }
+        expect_equal(s, ref);
+    }
+    // Erase everything, so nodes merge and steal all the way up
+    std::vector<int> keys(ref.begin(), ref.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    keys = drain_order(std::move(keys), size);
+    for (size_t i = 0; i < keys.size(); i++) {
+        expect(s.erase(keys[i]) == ref.erase(keys[i]), "erase() count differs");
+        if (i % 16 == 0) {
+            expect_equal(s, ref);
+        }
+    }
+    expect_equal(s, ref);
+}
+
+template<typename C, typename = void>
+struct has_upper_bound : std::false_type {};
+
+template<typename C>
+struct has_upper_bound<C, std::void_t<decltype(std::declval<const C&>().upper_bound(std::declval<typename C::value_type>()))>>
+    : std::true_type {};
+
+// Sets of other keys with the interface of std::set, insert() giving a
+// bool: PackedSet and StringSet. make_key reads a key from the input.
+template<typename C, typename MakeKey>
+void run_keys(const uint8_t* data, size_t size, MakeKey make_key) {
+    using K = typename C::value_type;
+    using Ref = std::set<K>;
+    input in(data, size);
+    C c;
+    Ref ref;
+    auto check = [&] {
+        c.check_invariants();
+        expect(c.size() == ref.size(), "size() differs");
+        expect(c.empty() == ref.empty(), "empty() differs");
+        expect(std::equal(c.begin(), c.end(), ref.begin(), ref.end()), "contents differ");
+    };
+    // Walking the tree for every step is slow with long strings, the size
+    // is checked after every step and the rest after every few
+    for (unsigned int step = 0; !in.done(); step++) {
+        switch (in.byte() % 8) {
+        case 0:
+        case 1:
+        case 2: {
+            K k = make_key(in);
+            expect(c.insert(k) == ref.insert(k).second, "insert() result differs");
+            break;
+        }
+        case 3:
+        case 4: {
+            K k = make_key(in);
+            expect(c.erase(k) == ref.erase(k), "erase() count differs");
+            break;
+        }
+        case 5: {
+            K k = make_key(in);
+            expect(same(c, c.lower_bound(k), ref, ref.lower_bound(k)), "lower_bound() differs");
+            expect(same(c, c.find(k), ref, ref.find(k)), "find() differs");
+            expect(c.contains(k) == (ref.count(k) != 0), "contains() differs");
+            expect(c.count(k) == ref.count(k), "count() differs");
+            if constexpr (has_upper_bound<C>::value) {
+                expect(same(c, c.upper_bound(k), ref, ref.upper_bound(k)), "upper_bound() differs");
+            }
+            break;
+        }
+        case 6: {
+            // A few steps backwards, every key is a new string
+            K k = make_key(in);
+            auto it = c.lower_bound(k);
+            auto rit = ref.lower_bound(k);
+            for (unsigned int j = 0; j < max_run && rit != ref.begin(); j++) {
+                --it;
+                --rit;
+                expect(*it == *rit, "backward iteration differs");
+            }
+            expect(rit != ref.begin() || it == c.begin(), "backward iteration didn't end at begin()");
+            break;
+        }
+        default: {
+            C copy(c);
+            copy.check_invariants();
+            expect(std::equal(copy.begin(), copy.end(), ref.begin(), ref.end()), "a copy differs");
+            copy.insert(make_key(in));
+            C moved(std::move(copy));
+            moved.check_invariants();
+            expect(copy.empty(), "a moved from set isn't empty");
+            if (in.byte() % 16 == 0) {
+                c = std::move(moved);
+                c.clear();
+                ref.clear();
+            }
+            break;
+        }
+        }
+        expect(c.size() == ref.size(), "size() differs");
+        if (step % 4 == 0) {
+            check();
+        }
+    }
+    check();
+    std::vector<K> keys = drain_order(std::vector<K>(ref.begin(), ref.end()), size);
+    for (size_t i = 0; i < keys.size(); i++) {
+        expect(c.erase(keys[i]) == 1, "erase() of a present key failed");
+        ref.erase(keys[i]);
+        if (i % 16 == 0) {
+            check();
+        }
+    }
+    check();
+}
+
+// Compare an iterator of a Map with one of a std::map, key and value
+template<typename M, typename It>
+bool same_entry(const M &m, It it, const std::map<int, int> &ref, std::map<int, int>::const_iterator rit) {
+    if (rit == ref.end()) {
+        return it == m.end();
+    }
+    return it != m.end() && it->first == rit->first && it->second == rit->second;
+}
+
+template<typename M>
+void expect_map_equal(const M &m, const std::map<int, int> &ref) {
+    m.check_invariants();
+    expect(m.size() == ref.size(), "size() differs");
+    expect(m.empty() == ref.empty(), "empty() differs");
+    auto eq = [](auto &&a, const auto &b) {
+        return a.first == b.first && a.second == b.second;
+    };
+    expect(std::equal(m.begin(), m.end(), ref.begin(), ref.end(), eq), "contents differ");
+}
+
+// Map against std::map, values are bytes of the input
+template<typename M>
+void run_map(const uint8_t* data, size_t size) {
+    using Ref = std::map<int, int>;
+    input in(data, size);
+    M m;
+    Ref ref;
+    while (!in.done()) {
+        switch (in.byte() % 12) {
+        case 0: {
+            // Reading an absent key inserts a value initialized one
+            int k = in.key();
+            expect(m[k] == ref[k], "operator[] differs");
+            int v = in.byte();
+            m[k] = v;
+            ref[k] = v;
+            break;
+        }
+        case 1: {
+            int k = in.key();
+            int v = in.byte();
+            auto [it, inserted] = m.try_emplace(k, v);
+            auto [rit, ref_inserted] = ref.try_emplace(k, v);
+            expect(inserted == ref_inserted, "try_emplace() result differs");
+            expect(same_entry(m, it, ref, rit), "try_emplace() returned a wrong iterator");
+            break;
+        }
+        case 2: {
+            int k = in.key();
+            int v = in.byte();
+            auto [it, inserted] = m.insert_or_assign(k, v);
+            auto [rit, ref_inserted] = ref.insert_or_assign(k, v);
+            expect(inserted == ref_inserted, "insert_or_assign() result differs");
+            expect(same_entry(m, it, ref, rit), "insert_or_assign() returned a wrong iterator");
+            break;
+        }
+        case 3: {
+            int k = in.key();
+            int v = in.byte();
+            auto [it, inserted] = in.byte() % 2 ? m.insert({k, v}) : m.emplace(k, v);
+            auto [rit, ref_inserted] = ref.insert({k, v});
+            expect(inserted == ref_inserted, "insert() result differs");
+            expect(same_entry(m, it, ref, rit), "insert() returned a wrong iterator");
+            break;
+        }
+        case 4: {
+            // at() of an absent key throws, of a present one gives the
+            // value to change
+            int k = in.key();
+            auto rit = ref.find(k);
+            if (rit == ref.end()) {
+                bool thrown = false;
+                try {
+                    m.at(k);
+                } catch (const std::out_of_range&) {
+                    thrown = true;
+                }
+                expect(thrown, "at() of an absent key didn't throw");
+                thrown = false;
+                try {
+                    static_cast<const M&>(m).at(k);
+                } catch (const std::out_of_range&) {
+                    thrown = true;
+                }
+                expect(thrown, "const at() of an absent key didn't throw");
+            } else {
+                expect(static_cast<const M&>(m).at(k) == rit->second, "at() differs");
+                m.at(k) = rit->second = in.byte();
+            }
+            break;
+        }
+        case 5: {
+            int k = in.key();
+            expect(m.erase(k) == ref.erase(k), "erase() count differs");
+            break;
+        }
+        case 6: {
+            int k = in.key();
+            auto it = m.lower_bound(k);
+            auto rit = ref.lower_bound(k);
+            expect(same_entry(m, it, ref, rit), "lower_bound() differs");
+            if (rit != ref.end()) {
+                it = m.erase(it);
+                rit = ref.erase(rit);
+                expect(same_entry(m, it, ref, rit), "erase(iterator) returned a wrong iterator");
+            }
+            break;
+        }
+        case 7: {
+            int a = in.key();
+            int b = in.key();
+            if (b < a) {
+                std::swap(a, b);
+            }
+            auto it = m.erase(m.lower_bound(a), m.lower_bound(b));
+            auto rit = ref.erase(ref.lower_bound(a), ref.lower_bound(b));
+            expect(same_entry(m, it, ref, rit), "range erase() returned a wrong iterator");
+            break;
+        }
+        case 8: {
+            int k = in.key();
+            const M &c = m;
+            expect(same_entry(m, m.lower_bound(k), ref, ref.lower_bound(k)), "lower_bound() differs");
+            expect(same_entry(m, c.upper_bound(k), ref, ref.upper_bound(k)), "upper_bound() differs");
+            expect(same_entry(m, m.find(k), ref, ref.find(k)), "find() differs");
+            expect(c.contains(k) == (ref.count(k) != 0), "contains() differs");
+            expect(c.count(k) == ref.count(k), "count() differs");
+            if constexpr (reference_of<M>::order_statistics) {
+                size_t r = std::distance(ref.begin(), ref.lower_bound(k));
+                expect(c.rank(k) == r, "rank() differs");
+                expect(same_entry(m, c.select(r), ref, ref.lower_bound(k)), "select() differs");
+                expect(r == ref.size() || c.index(c.lower_bound(k)) == r, "index() differs");
+            }
+            break;
+        }
+        case 9: {
+            // Walk backwards through structured bindings, changing every
+            // value on the way through it->second
+            int k = in.key();
+            int v = in.byte();
+            auto it = m.lower_bound(k);
+            auto rit = ref.lower_bound(k);
+            while (rit != ref.begin()) {
+                --it;
+                --rit;
+                auto &&[key, value] = *it;
+                expect(key == rit->first && value == rit->second, "backward iteration differs");
+                it->second = rit->second = v;
+            }
+            expect(it == m.begin(), "backward iteration didn't end at begin()");
+            break;
+        }
+        case 10: {
+            // Copies are independent, moves leave the source empty
+            M copy(m);
+            expect_map_equal(copy, ref);
+            copy[in.key()]++;
+            expect_map_equal(m, ref);
+            M moved(std::move(copy));
+            moved.check_invariants();
+            expect(copy.empty(), "a moved from map isn't empty");
+            copy = m;
+            m = std::move(copy);
+            break;
+        }
+        default: {
+            if (in.byte() % 16 == 0) {
+                m.clear();
+                ref.clear();
+            }
+            break;
+        }
+        }
+        expect_map_equal(m, ref);
+    }
+    std::vector<int> keys;
+    for (const auto &[k, v] : ref) {
+        keys.push_back(k);
+    }
+    keys = drain_order(std::move(keys), size);
+    for (size_t i = 0; i < keys.size(); i++) {
+        expect(m.erase(keys[i]) == 1, "erase() of a present key failed");
+        ref.erase(keys[i]);
+        if (i % 16 == 0) {
+            expect_map_equal(m, ref);
+        }
+    }
+    expect_map_equal(m, ref);
+}
+
+template<typename S>
+void expect_buffered_equal(S &s, const std::set<int> &ref) {
+    const typename S::set_type &tree = s.set();
+    tree.check_invariants();
+    expect(s.pending() == 0, "set() didn't flush");
+    expect(s.size() == ref.size(), "size() differs");
+    expect(s.empty() == ref.empty(), "empty() differs");
+    expect(std::equal(tree.begin(), tree.end(), ref.begin(), ref.end()), "contents differ");
+}
+
+// BufferedSet against std::set, flushing every buffer_size messages.
+// Lookups go through the tail, the runs and the tree, so they are checked
+// after every step while set() flushes only now and then.
+template<typename S>
+void run_buffered(const uint8_t* data, size_t size, size_t buffer_size) {
+    input in(data, size);
+    S s(buffer_size);
+    std::set<int> ref;
+    auto check_key = [&](int k) {
+        expect(s.contains(k) == (ref.count(k) != 0), "contains() differs");
+        expect(s.count(k) == ref.count(k), "count() differs");
+        expect(s.pending() < buffer_size + S::tail_size, "too many messages are pending");
+    };
+    while (!in.done()) {
+        int k = in.key();
+        switch (in.byte() % 8) {
+        case 0:
+        case 1:
+        case 2:
+            s.insert(k);
+            ref.insert(k);
+            break;
+        case 3:
+        case 4:
+            s.erase(k);
+            ref.erase(k);
+            break;
+        case 5:
+            s.flush();
+            expect(s.pending() == 0, "flush() left messages");
+            break;
+        case 6:
+            expect_buffered_equal(s, ref);
+            break;
+        default:
+            if (in.byte() % 16 == 0) {
+                s.clear();
+                ref.clear();
+                expect(s.pending() == 0, "clear() left messages");
+            }
+            break;
+        }
+        check_key(k);
+        check_key(in.key());
+    }
+    std::vector<int> keys = drain_order(std::vector<int>(ref.begin(), ref.end()), size);
+    for (size_t i = 0; i < keys.size(); i++) {
+        s.erase(keys[i]);
+        ref.erase(keys[i]);
+        check_key(keys[i]);
+        if (i % 64 == 0) {
+            expect_buffered_equal(s, ref);
+        }
+    }
+    expect_buffered_equal(s, ref);
+}
+
+// Keys of PackedSet: a byte spread over one of five ranges, so that the
+// leaves of each range need a different width. The last one ends at the
+// largest key.
+template<typename T>
+T packed_key(input &in) {
+    constexpr unsigned int bits = std::numeric_limits<T>::digits;
+    static_assert(bits >= 32, "the ranges don't fit");
+    uint8_t sel = in.byte();
+    T off = in.byte();
+    switch (sel % 5) {
+    case 0:
+        return off;
+    case 1:
+        return static_cast<T>((T(1) << 16) + (off << 8));
+    case 2:
+        return static_cast<T>((T(1) << (bits - 8)) + (off << (bits - 16)));
+    case 3:
+        return static_cast<T>(std::numeric_limits<T>::max() / 2 + (off << (bits - 9)));
+    default:
+        return static_cast<T>(std::numeric_limits<T>::max() - off);
+    }
+}
+
+// Keys of StringSet: a number under one of a few prefixes, some of them
+// padded up to max_key_size, so pages hold a handful of keys only
+template<typename C>
+std::string string_key(input &in) {
+    static const char* const prefixes[] = {"", "\xff\x01", "https://example.com/", "https://example.com/users/"};
+    uint8_t sel = in.byte();
+    std::string k = prefixes[sel % 4] + std::to_string(in.byte() % 64);
+    switch (sel / 4 % 8) {
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+        break;
+    case 4:
+    case 5:
+        k += "/index.html";
+        break;
+    case 6:
+        k.resize(std::max(k.size(), C::max_key_size / 2), '/');
+        break;
+    default:
+        k.resize(C::max_key_size, 'z');
+        break;
+    }
+    k.resize(std::min(k.size(), C::max_key_size));
+    return k;
+}
+
+void run_all(const uint8_t* data, size_t size) {
+    run_ops<Set<int, 2>>(data, size);
+    run_ops<Set<int, 3, std::less<int>, std::allocator<int>, order_statistics_policy>>(data, size);
+    run_ops<Set<int, 16>>(data, size);
+    run_ops<MultiSet<int, 2, std::less<int>, std::allocator<int>, order_statistics_policy>>(data, size);
+    run_ops<MultiSet<int, 5>>(data, size);
+    // Nodes from a pool, sets made by the tests get pools of their own
+    run_ops<Set<int, 4, std::less<int>, pool_allocator<int>>>(data, size);
+    run_ops<MultiSet<int, 3, std::less<int>, pool_allocator<int>, order_statistics_policy>>(data, size);
+    // Buffers from none, every message goes to the tree once the tail is
+    // full, to one which is flushed only by set()
+    for (size_t buffer_size : {0, 1, 7, 64, 1000}) {
+        run_buffered<BufferedSet<int, 2>>(data, size, buffer_size);
+    }
+    run_buffered<BufferedSet<int, 16>>(data, size, BufferedSet<int, 16>::default_buffer_size);
+    run_map<Map<int, int, 2>>(data, size);
+    run_map<Map<int, int, 3, std::less<int>, std::allocator<std::pair<const int, int>>, order_statistics_policy>>(data, size);
+    // Small leaves and nodes re-encode and split all the time
+    run_keys<PackedSet<uint64_t, 128, 2>>(data, size, packed_key<uint64_t>);
+    run_keys<PackedSet<uint32_t, 128, 3>>(data, size, packed_key<uint32_t>);
+    run_keys<PackedSet<uint64_t>>(data, size, packed_key<uint64_t>);
+    run_keys<StringSet<512>>(data, size, string_key<StringSet<512>>);
+    run_keys<StringSet<4096>>(data, size, string_key<StringSet<4096>>);
+}
+
+}
+
+#ifdef BTREE_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    run_all(data, size);
+    return 0;
+}
+
+#else
+
+int main(int argc, char** argv) {
+    unsigned long runs = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 500;
+    unsigned long seed = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1;
+    std::mt19937_64 gen(seed);
+    std::vector<uint8_t> data;
+    for (unsigned long r = 0; r < runs; r++) {
+        data.resize(gen() % 16384);
+        for (uint8_t &b : data) {
+            b = static_cast<uint8_t>(gen());
+        }
+        run_all(data.data(), data.size());
+    }
+    std::printf("set_fuzz: %lu runs passed\n", runs);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,317 @@
+// B+-tree map on the engine of Set, values are stored in the leaves next
+// to their keys
+#pragma once
+
+#include "tree.h"
+
+#include <stdexcept>
+
+namespace btree_detail {
+
+// Policy of the Set under a Map, adds the values to the leaves
+template<typename Policy, typename V>
+struct map_policy : Policy {
+    using mapped_type = V;
+};
+
+// Result of operator-> for iterators whose reference is a proxy
+template<typename Ref>
+struct arrow_proxy {
+    Ref ref;
+
+    const Ref* operator->() const {
+        return &ref;
+    }
+};
+
+}
+
+// Ordered map with the layout of Set: keys and separators are searched
+// exactly like there, and every leaf keeps the values of its keys in a
+// parallel array, so the tree is as deep as for a set of the keys alone.
+//
+// Entries aren't stored as pairs, so like std::flat_map the iterators
+// give a pair of references, std::pair<const K&, V&>. Structured bindings
+// and it->first / it->second work as usual, but bind with auto&& or
+// const auto&, not with auto&. Iterators are invalidated by inserts and
+// erases like those of Set.
+//
+// operator[], try_emplace() and insert_or_assign() descend only once, the
+// value is built in its slot and only when the key is new.
+template<typename K, typename V, unsigned int B = 2, typename Compare = std::less<K>,
+         typename Allocator = std::allocator<std::pair<const K, V>>, typename Policy = default_policy>
+class Map : private Set<K, B, Compare, Allocator, btree_detail::map_policy<Policy, V>> {
+    using Base = Set<K, B, Compare, Allocator, btree_detail::map_policy<Policy, V>>;
+    using Leaf = typename Base::Leaf;
+    using BaseIterator = typename Base::iterator;
+
+public:
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = std::pair<const K, V>;
+    using reference = std::pair<const K&, V&>;
+    using const_reference = std::pair<const K&, const V&>;
+    using key_compare = Compare;
+    using allocator_type = Allocator;
+
+    // Points to a (leaf, slot) pair like the iterator of Set
+    template<bool Const>
+    class basic_iterator {
+        friend Map;
+        template<bool>
+        friend class basic_iterator;
+
+    private:
+        BaseIterator it;
+
+        explicit basic_iterator(BaseIterator i)
+            : it(i) {}
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = std::pair<const K, V>;
+        using difference_type = std::ptrdiff_t;
+        using reference = std::conditional_t<Const, const_reference, Map::reference>;
+        using pointer = btree_detail::arrow_proxy<reference>;
+
+        basic_iterator() {}
+
+        // iterator converts to const_iterator
+        template<bool C, typename = std::enable_if_t<Const && !C>>
+        basic_iterator(const basic_iterator<C> &iter)
+            : it(iter.it) {}
+
+        // iterator and const_iterator compare with each other
+        template<bool C>
+        bool operator==(const basic_iterator<C> &iter) const {
+            return it == iter.it;
+        }
+
+        template<bool C>
+        bool operator!=(const basic_iterator<C> &iter) const {
+            return it != iter.it;
+        }
+
+        reference operator*() const {
+            return reference(it.ptr->keys()[it.slot], it.ptr->values()[it.slot]);
+        }
+
+        pointer operator->() const {
+            return pointer{**this};
+        }
+
+        basic_iterator& operator++() {
+            ++it;
+            return *this;
+        }
+
+        basic_iterator operator++(int) {
+            basic_iterator ret = *this;
+            ++it;
+            return ret;
+        }
+
+        basic_iterator& operator--() {
+            --it;
+            return *this;
+        }
+
+        basic_iterator operator--(int) {
+            basic_iterator ret = *this;
+            --it;
+            return ret;
+        }
+    };
+
+    using iterator = basic_iterator<false>;
+    using const_iterator = basic_iterator<true>;
+
+    Map()
+        : Base() {}
+
+    explicit Map(const Compare &comp, const Allocator &alloc = Allocator())
+        : Base(comp, alloc) {}
+
+    explicit Map(const Allocator &alloc)
+        : Base(alloc) {}
+
+    // Later duplicates of a key are ignored, like with insert()
+    template<typename Iter>
+    Map(Iter begin, Iter end, const Compare &comp = Compare(), const Allocator &alloc = Allocator())
+        : Base(comp, alloc) {
+        for (; begin != end; ++begin) {
+            insert(*begin);
+        }
+    }
+
+    Map(std::initializer_list<value_type> init, const Compare &comp = Compare(), const Allocator &alloc = Allocator())
+        : Map(init.begin(), init.end(), comp, alloc) {}
+
+    using Base::get_allocator;
+    using Base::key_comp;
+    using Base::clear;
+    using Base::empty;
+    using Base::size;
+    using Base::check_invariants;
+
+    iterator begin() {
+        return iterator(Base::begin());
+    }
+
+    iterator end() {
+        return iterator(Base::end());
+    }
+
+    const_iterator begin() const {
+        return const_iterator(Base::begin());
+    }
+
+    const_iterator end() const {
+        return const_iterator(Base::end());
+    }
+
+    const_iterator cbegin() const {
+        return begin();
+    }
+
+    const_iterator cend() const {
+        return end();
+    }
+
+    iterator find(const K &key) {
+        return iterator(Base::find(key));
+    }
+
+    const_iterator find(const K &key) const {
+        return const_iterator(Base::find(key));
+    }
+
+    bool contains(const K &key) const {
+        return Base::count(key) != 0;
+    }
+
+    size_t count(const K &key) const {
+        return Base::count(key);
+    }
+
+    iterator lower_bound(const K &key) {
+        return iterator(Base::lower_bound(key));
+    }
+
+    const_iterator lower_bound(const K &key) const {
+        return const_iterator(Base::lower_bound(key));
+    }
+
+    iterator upper_bound(const K &key) {
+        return iterator(Base::upper_bound(key));
+    }
+
+    const_iterator upper_bound(const K &key) const {
+        return const_iterator(Base::upper_bound(key));
+    }
+
+    // Throws std::out_of_range if the key is absent
+    V& at(const K &key) {
+        return const_cast<V&>(static_cast<const Map&>(*this).at(key));
+    }
+
+    const V& at(const K &key) const {
+        auto [l, r] = Base::descend(key);
+        if (!r.eq) {
+            throw std::out_of_range("Map::at: key not found");
+        }
+        return l->values()[r.pos];
+    }
+
+    // Value of key, value-initialized and inserted if the key is new
+    V& operator[](const K &key) {
+        return (*try_emplace(key).first).second;
+    }
+
+    V& operator[](K &&key) {
+        return (*try_emplace(std::move(key)).first).second;
+    }
+
+    // Insert key with a value built from args, nothing is built or moved
+    // from if the key is present
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const K &key, Args&&... args) {
+        auto [it, inserted] = Base::insert_impl(key, std::forward<Args>(args)...);
+        return {iterator(it), inserted};
+    }
+
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(K &&key, Args&&... args) {
+        auto [it, inserted] = Base::insert_impl(std::move(key), std::forward<Args>(args)...);
+        return {iterator(it), inserted};
+    }
+
+    // Insert or overwrite the value of key
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(const K &key, M &&obj) {
+        auto res = try_emplace(key, std::forward<M>(obj));
+        if (!res.second) {
+            (*res.first).second = std::forward<M>(obj);
+        }
+        return res;
+    }
+
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(K &&key, M &&obj) {
+        auto res = try_emplace(std::move(key), std::forward<M>(obj));
+        if (!res.second) {
+            (*res.first).second = std::forward<M>(obj);
+        }
+        return res;
+    }
+
+    // A present key keeps its value
+    std::pair<iterator, bool> insert(const value_type &entry) {
+        return try_emplace(entry.first, entry.second);
+    }
+
+    std::pair<iterator, bool> insert(value_type &&entry) {
+        return try_emplace(entry.first, std::move(entry.second));
+    }
+
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        return insert(value_type(std::forward<Args>(args)...));
+    }
+
+    // Returns the number of erased entries
+    size_t erase(const K &key) {
+        return Base::erase(key);
+    }
+
+    // Returns the iterator following the erased entry
+    iterator erase(const_iterator pos) {
+        return iterator(Base::erase(pos.it));
+    }
+
+    iterator erase(iterator pos) {
+        return iterator(Base::erase(pos.it));
+    }
+
+    iterator erase(const_iterator first, const_iterator last) {
+        return iterator(Base::erase(first.it, last.it));
+    }
+
+    // Order statistics, available with a policy that enables them
+
+    size_t rank(const K &key) const {
+        return Base::rank(key);
+    }
+
+    size_t index(const_iterator iter) const {
+        return Base::index(iter.it);
+    }
+
+    iterator select(size_t k) {
+        return iterator(Base::select(k));
+    }
+
+    const_iterator select(size_t k) const {
+        return const_iterator(Base::select(k));
+    }
+};
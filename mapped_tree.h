@@ -0,0 +1,345 @@
+// Read-only B+-tree served straight from a file written by Set::save()
+#pragma once
+
+#include "tree.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Maps the file and searches its pages in place, nothing is read or
+// decoded up front, so opening takes the same time for any size. Pages
+// are loaded by the OS on first touch and shared through the page cache
+// by every process mapping the same file.
+//
+// T, B and Compare have to be those of the Set which saved the file. The
+// first three are checked when the file is opened, the comparator can't
+// be. Any number of threads may read a MappedSet at once.
+template<typename T, unsigned int B = 2, typename Compare = std::less<T>>
+class MappedSet : private btree_detail::compare_holder<Compare> {
+    static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable keys can be mapped");
+
+    using CompareHolder = btree_detail::compare_holder<Compare>;
+    using Header = btree_detail::disk_header;
+    using DiskLeaf = btree_detail::disk_leaf<T, B>;
+    using DiskInner = btree_detail::disk_inner<T, B>;
+
+public:
+    using value_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+
+    class iterator;
+    using const_iterator = iterator;
+
+private:
+    const char* base;
+    size_t length;
+    const Header* hdr;
+
+    static const T* keys(const DiskLeaf* p) {
+        return reinterpret_cast<const T*>(p->keys);
+    }
+
+    static const T* keys(const DiskInner* p) {
+        return reinterpret_cast<const T*>(p->keys);
+    }
+
+    template<typename Page>
+    const Page* page(uint64_t offset) const {
+        return reinterpret_cast<const Page*>(base + offset);
+    }
+
+    const DiskLeaf* first_leaf() const {
+        return page<DiskLeaf>(hdr->first_leaf);
+    }
+
+    const DiskLeaf* last_leaf() const {
+        return first_leaf() + (hdr->leaves - 1);
+    }
+
+    // Number of keys of a page, clamped to what fits so a damaged page
+    // can't send a search outside of it
+    template<typename Page>
+    static unsigned int key_count(const Page* p) {
+        return p->cnt > 2 * B ? 2 * B : p->cnt;
+    }
+
+    // Whether offset is the start of an internal page, which lie between
+    // the header and the leaves
+    bool inner_page(uint64_t offset) const {
+        return offset >= sizeof(Header) && offset < hdr->first_leaf && (offset - sizeof(Header)) % sizeof(DiskInner) == 0;
+    }
+
+    bool leaf_page(uint64_t offset) const {
+        return offset >= hdr->first_leaf && (offset - hdr->first_leaf) % sizeof(DiskLeaf) == 0
+            && (offset - hdr->first_leaf) / sizeof(DiskLeaf) < hdr->leaves;
+    }
+
+    [[noreturn]] static void corrupt() {
+        throw std::runtime_error("saved set is corrupt");
+    }
+
+    bool less(const T &a, const T &b) const {
+        return btree_detail::key_order<Compare, T, T>::less(this->comp(), a, b);
+    }
+
+    // Position of the first key of k[0, n) which is not less than elem
+    unsigned int lower(const T* k, unsigned int n, const T &elem) const {
+        if constexpr (btree_detail::key_order<Compare, T, T>::user_three_way) {
+            return btree_detail::lower_bound(k, n, elem, [this](const T &a, const T &b) {
+                return less(a, b);
+            });
+        } else {
+            return btree_detail::lower_bound(k, n, elem, this->comp());
+        }
+    }
+
+    // Reject files which weren't written by a matching Set, and headers
+    // whose root, height or leaves don't fit the file
+    void check() const {
+        if (length < sizeof(Header) || std::memcmp(hdr->magic, btree_detail::disk_magic, sizeof(hdr->magic)) != 0) {
+            throw std::runtime_error("not a saved set");
+        }
+        if (hdr->version != btree_detail::disk_version || hdr->byte_order != btree_detail::disk_byte_order) {
+            throw std::runtime_error("saved set has an unsupported version or byte order");
+        }
+        if (hdr->b != B || hdr->key_size != sizeof(T) || hdr->key_align != alignof(T)) {
+            throw std::runtime_error("saved set has a different B or key type");
+        }
+        if (hdr->size == 0) {
+            return;
+        }
+        if (hdr->first_leaf > length || (length - hdr->first_leaf) / sizeof(DiskLeaf) < hdr->leaves) {
+            throw std::runtime_error("saved set is truncated");
+        }
+        // Every internal level has a page at least, the root is the only
+        // leaf without them
+        if (hdr->leaves == 0 || hdr->first_leaf < sizeof(Header) || (hdr->first_leaf - sizeof(Header)) % sizeof(DiskInner) != 0) {
+            corrupt();
+        }
+        uint64_t inner_pages = (hdr->first_leaf - sizeof(Header)) / sizeof(DiskInner);
+        if (hdr->height > inner_pages || (hdr->height == 0) != (inner_pages == 0)) {
+            corrupt();
+        }
+        if (hdr->height == 0 ? hdr->root != hdr->first_leaf : !inner_page(hdr->root)) {
+            corrupt();
+        }
+    }
+
+    static std::system_error os_error(const std::string &what) {
+        return std::system_error(errno, std::generic_category(), what);
+    }
+
+public:
+    explicit MappedSet(const std::string &path, const Compare &comp = Compare())
+        : CompareHolder(comp)
+        , base(nullptr)
+        , length(0)
+        , hdr(nullptr) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw os_error("cannot open " + path);
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            std::system_error err = os_error("cannot stat " + path);
+            ::close(fd);
+            throw err;
+        }
+        length = st.st_size;
+        // The mapping stays valid after the descriptor is closed
+        void* p = length > 0 ? ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        std::system_error err = os_error("cannot map " + path);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            if (length == 0) {
+                throw std::runtime_error("not a saved set");
+            }
+            throw err;
+        }
+        base = static_cast<const char*>(p);
+        hdr = reinterpret_cast<const Header*>(base);
+        try {
+            check();
+        } catch (...) {
+            ::munmap(const_cast<char*>(base), length);
+            throw;
+        }
+    }
+
+    MappedSet(const MappedSet&) = delete;
+    MappedSet &operator=(const MappedSet&) = delete;
+
+    MappedSet(MappedSet &&set) noexcept(std::is_nothrow_copy_constructible<Compare>::value)
+        : CompareHolder(set.comp())
+        , base(set.base)
+        , length(set.length)
+        , hdr(set.hdr) {
+        set.base = nullptr;
+        set.length = 0;
+        set.hdr = nullptr;
+    }
+
+    MappedSet &operator=(MappedSet &&set) noexcept(std::is_nothrow_copy_assignable<Compare>::value) {
+        std::swap(static_cast<CompareHolder&>(*this), static_cast<CompareHolder&>(set));
+        std::swap(base, set.base);
+        std::swap(length, set.length);
+        std::swap(hdr, set.hdr);
+        return *this;
+    }
+
+    ~MappedSet() {
+        if (base != nullptr) {
+            ::munmap(const_cast<char*>(base), length);
+        }
+    }
+
+    key_compare key_comp() const {
+        return this->comp();
+    }
+
+    value_compare value_comp() const {
+        return this->comp();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    size_t size() const {
+        return hdr == nullptr ? 0 : hdr->size;
+    }
+
+    // Points to a (leaf page, slot) pair, leaf pages follow each other in
+    // the file so the next one is the adjacent page
+    class iterator {
+        friend MappedSet;
+
+    private:
+        const DiskLeaf* ptr;
+        const DiskLeaf* last;
+        unsigned int slot;
+
+        iterator(const DiskLeaf* p, const DiskLeaf* l, unsigned int s)
+            : ptr(p)
+            , last(l)
+            , slot(s) {}
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        iterator()
+            : ptr(nullptr)
+            , last(nullptr)
+            , slot(0) {}
+
+        bool operator==(const iterator &iter) const {
+            return ptr == iter.ptr && slot == iter.slot;
+        }
+
+        bool operator!=(const iterator &iter) const {
+            return !(*this == iter);
+        }
+
+        const T& operator*() const {
+            return keys(ptr)[slot];
+        }
+
+        const T* operator->() const {
+            return keys(ptr) + slot;
+        }
+
+        iterator& operator++() {
+            slot++;
+            // Go to the next leaf, stay past the end if there is none
+            while (slot >= key_count(ptr) && ptr != last) {
+                ptr++;
+                slot = 0;
+            }
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator ret = *this;
+            ++(*this);
+            return ret;
+        }
+
+        iterator& operator--() {
+            while (slot == 0) {
+                ptr--;
+                slot = key_count(ptr);
+            }
+            slot--;
+            return *this;
+        }
+
+        iterator operator--(int) {
+            iterator ret = *this;
+            --(*this);
+            return ret;
+        }
+    };
+
+    iterator begin() const {
+        if (empty()) {
+            return iterator();
+        }
+        return iterator(first_leaf(), last_leaf(), 0);
+    }
+
+    iterator end() const {
+        if (empty()) {
+            return iterator();
+        }
+        return iterator(last_leaf(), last_leaf(), key_count(last_leaf()));
+    }
+
+    // First key which is not less than elem. Throws std::runtime_error
+    // on a child offset that doesn't point at a page of the right kind.
+    iterator lower_bound(const T &elem) const {
+        if (empty()) {
+            return iterator();
+        }
+        uint64_t offset = hdr->root;
+        for (uint32_t level = 0; level < hdr->height; level++) {
+            const DiskInner* in = page<DiskInner>(offset);
+            unsigned int n = key_count(in);
+            unsigned int i = lower(keys(in), n, elem);
+            if (i == n) {
+                // Greater than everything
+                return end();
+            }
+            offset = in->children[i];
+            // Children are checked before they are touched
+            if (level + 1 < hdr->height ? !inner_page(offset) : !leaf_page(offset)) {
+                corrupt();
+            }
+        }
+        const DiskLeaf* p = page<DiskLeaf>(offset);
+        return iterator(p, last_leaf(), lower(keys(p), key_count(p), elem));
+    }
+
+    iterator find(const T &elem) const {
+        iterator it = lower_bound(elem);
+        if (it != end() && less(elem, *it)) {
+            return end();
+        }
+        return it;
+    }
+
+    bool contains(const T &elem) const {
+        return find(elem) != end();
+    }
+
+    size_t count(const T &elem) const {
+        return contains(elem);
+    }
+};
@@ -0,0 +1,879 @@
+// B+-tree of unsigned integers whose leaves are frame-of-reference encoded:
+// a leaf keeps its keys as narrow offsets from a base
+#pragma once
+
+#include "tree.h"
+
+#include <limits>
+
+namespace btree_detail {
+
+// Compare-and-count over a short window of narrow unsigned keys. SSE2 only
+// compares signed lanes, so both sides get their top bit flipped first.
+template<typename W>
+unsigned int count_less_unsigned(const W* k, unsigned int n, W x) {
+    return count_less_linear<W>(k, n, x);
+}
+
+#if defined(__SSE2__)
+inline unsigned int count_less_unsigned(const uint8_t* k, unsigned int n, uint8_t x) {
+    __m128i flip = _mm_set1_epi8(static_cast<char>(0x80));
+    __m128i xv = _mm_xor_si128(_mm_set1_epi8(static_cast<char>(x)), flip);
+    unsigned int res = 0, i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i kv = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(k + i)), flip);
+        res += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(xv, kv)));
+    }
+    return res + count_less_linear<uint8_t>(k + i, n - i, x);
+}
+
+inline unsigned int count_less_unsigned(const uint16_t* k, unsigned int n, uint16_t x) {
+    __m128i flip = _mm_set1_epi16(static_cast<short>(0x8000));
+    __m128i xv = _mm_xor_si128(_mm_set1_epi16(static_cast<short>(x)), flip);
+    unsigned int res = 0, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i kv = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(k + i)), flip);
+        // Two mask bits per lane
+        res += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi16(xv, kv))) / 2;
+    }
+    return res + count_less_linear<uint16_t>(k + i, n - i, x);
+}
+
+inline unsigned int count_less_unsigned(const uint32_t* k, unsigned int n, uint32_t x) {
+    __m128i flip = _mm_set1_epi32(static_cast<int>(0x80000000u));
+    __m128i xv = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(x)), flip);
+    unsigned int res = 0, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i kv = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(k + i)), flip);
+        res += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(xv, kv))));
+    }
+    return res + count_less_linear<uint32_t>(k + i, n - i, x);
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+// A window has at most linear_window keys, so 8-bit lanes don't overflow
+inline unsigned int count_less_unsigned(const uint8_t* k, unsigned int n, uint8_t x) {
+    uint8x16_t xv = vdupq_n_u8(x);
+    uint8x16_t acc = vdupq_n_u8(0);
+    unsigned int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc = vsubq_u8(acc, vcltq_u8(vld1q_u8(k + i), xv));
+    }
+    return vaddlvq_u8(acc) + count_less_linear<uint8_t>(k + i, n - i, x);
+}
+
+inline unsigned int count_less_unsigned(const uint16_t* k, unsigned int n, uint16_t x) {
+    uint16x8_t xv = vdupq_n_u16(x);
+    uint16x8_t acc = vdupq_n_u16(0);
+    unsigned int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc = vsubq_u16(acc, vcltq_u16(vld1q_u16(k + i), xv));
+    }
+    return vaddlvq_u16(acc) + count_less_linear<uint16_t>(k + i, n - i, x);
+}
+
+inline unsigned int count_less_unsigned(const uint32_t* k, unsigned int n, uint32_t x) {
+    uint32x4_t xv = vdupq_n_u32(x);
+    uint32x4_t acc = vdupq_n_u32(0);
+    unsigned int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = vsubq_u32(acc, vcltq_u32(vld1q_u32(k + i), xv));
+    }
+    return vaddvq_u32(acc) + count_less_linear<uint32_t>(k + i, n - i, x);
+}
+#endif
+
+// Position of the first of the sorted offsets k[0, n) which is not less
+// than x: binary search down to a window, then a vector count inside it
+template<typename W>
+unsigned int lower_bound_unsigned(const W* k, unsigned int n, W x) {
+    const W* base = k;
+    while (n > linear_window) {
+        unsigned int half = n / 2;
+        base = base[half - 1] < x ? base + half : base;
+        n -= half;
+    }
+    return (base - k) + count_less_unsigned(base, n, x);
+}
+
+}
+
+// Set of unsigned integers with the interface of Set and leaves of
+// LeafBytes bytes. A leaf stores its keys as offsets from a base with
+// the narrowest width of 1, 2, 4 or 8 bytes which holds the largest of
+// them, so a leaf of dense IDs keeps about one byte per key. Searching a
+// leaf needs no decoding, the offset of the key is compared against the
+// offsets with vector instructions.
+//
+// Like StringSet, internal nodes hold n separators and n + 1 children,
+// each separator being the first key of the child after it. Inserts
+// which grow the range of a leaf past its width re-encode it, and split
+// it if the keys don't fit anymore. Appending past the last key splits
+// off a leaf with the new key only, so ascending inserts fill the leaves.
+//
+// Iterators give the keys by value and are invalidated by inserts and
+// erases.
+template<typename T = uint64_t, unsigned int LeafBytes = 512, unsigned int B = 16, typename Allocator = std::allocator<T>>
+class PackedSet {
+    static_assert(std::is_integral<T>::value && std::is_unsigned<T>::value, "keys have to be unsigned integers");
+    static_assert(B >= 2, "B must be at least 2");
+
+public:
+    using value_type = T;
+    using key_compare = std::less<T>;
+    using value_compare = std::less<T>;
+
+    class iterator;
+    using const_iterator = iterator;
+
+private:
+    struct Node {
+        bool leaf;
+        // Bytes per offset of a leaf
+        uint8_t width;
+        // Number of keys, for an internal node of separators
+        unsigned int cnt;
+    };
+
+    struct Leaf : Node {
+        static constexpr size_t header = sizeof(Node) + 2 * sizeof(void*) + sizeof(T);
+
+        Leaf* prev;
+        Leaf* next;
+        // Not greater than any key of the leaf
+        T base;
+        unsigned char data[LeafBytes - header];
+    };
+
+    struct Inner : Node {
+        T keys[2 * B];
+        Node* children[2 * B + 1];
+    };
+
+    static_assert(LeafBytes >= Leaf::header + 8 * sizeof(T), "leaves are too small");
+    static_assert(sizeof(Leaf) == LeafBytes, "LeafBytes has to be a multiple of the alignment of pointers");
+    static_assert(std::is_trivially_copyable<Leaf>::value, "leaves are copied as bytes");
+
+    // Bytes for the offsets of a leaf
+    static constexpr size_t leaf_data = sizeof(Leaf::data);
+
+    using LeafAlloc = typename std::allocator_traits<Allocator>::template rebind_alloc<Leaf>;
+    using InnerAlloc = typename std::allocator_traits<Allocator>::template rebind_alloc<Inner>;
+    using LeafTraits = std::allocator_traits<LeafAlloc>;
+    using InnerTraits = std::allocator_traits<InnerAlloc>;
+
+    LeafAlloc leaf_alloc;
+    InnerAlloc inner_alloc;
+
+    // nullptr for an empty set
+    Node* root;
+    Leaf* first_leaf;
+    Leaf* last_leaf;
+    size_t sz;
+
+    static Leaf* leaf(Node* p) {
+        return static_cast<Leaf*>(p);
+    }
+
+    static Inner* inner(Node* p) {
+        return static_cast<Inner*>(p);
+    }
+
+    static const Inner* inner(const Node* p) {
+        return static_cast<const Inner*>(p);
+    }
+
+    // Narrowest width for offsets up to range
+    static unsigned int width_for(T range) {
+        if (range <= 0xff) {
+            return 1;
+        }
+        if (range <= 0xffff) {
+            return 2;
+        }
+        if (sizeof(T) <= 4 || static_cast<uint64_t>(range) <= 0xffffffffu) {
+            return 4;
+        }
+        return 8;
+    }
+
+    // Whether the sorted keys k[0, n) fit in one leaf
+    static bool fits(const T* k, size_t n) {
+        return n == 0 || n * width_for(k[n - 1] - k[0]) <= leaf_data;
+    }
+
+    template<typename W>
+    static W* offsets(Leaf* p) {
+        return reinterpret_cast<W*>(p->data);
+    }
+
+    template<typename W>
+    static const W* offsets(const Leaf* p) {
+        return reinterpret_cast<const W*>(p->data);
+    }
+
+    // Call f with the offsets of p as an array of their width
+    template<typename L, typename F>
+    static decltype(auto) visit(L* p, F &&f) {
+        switch (p->width) {
+        case 1:
+            return f(offsets<uint8_t>(p));
+        case 2:
+            return f(offsets<uint16_t>(p));
+        case 4:
+            return f(offsets<uint32_t>(p));
+        default:
+            if constexpr (sizeof(T) > 4) {
+                return f(offsets<uint64_t>(p));
+            } else {
+                return f(offsets<uint32_t>(p));
+            }
+        }
+    }
+
+    static T key(const Leaf* p, unsigned int i) {
+        return visit(p, [&](const auto* k) {
+            return static_cast<T>(p->base + k[i]);
+        });
+    }
+
+    // Position of the first key of p which is not less than x
+    static unsigned int search(const Leaf* p, T x) {
+        if (p->cnt == 0 || x <= p->base) {
+            return 0;
+        }
+        T d = x - p->base;
+        return visit(p, [&](const auto* k) {
+            using W = std::remove_const_t<std::remove_pointer_t<decltype(k)>>;
+            if (d > std::numeric_limits<W>::max()) {
+                return p->cnt;
+            }
+            return btree_detail::lower_bound_unsigned<W>(k, p->cnt, static_cast<W>(d));
+        });
+    }
+
+    static void decode(const Leaf* p, T* out) {
+        visit(p, [&](const auto* k) {
+            for (unsigned int i = 0; i < p->cnt; i++) {
+                out[i] = static_cast<T>(p->base + k[i]);
+            }
+        });
+    }
+
+    // Replace the keys of p with the sorted keys k[0, n), which fit
+    static void encode(Leaf* p, const T* k, size_t n) {
+        p->base = n != 0 ? k[0] : 0;
+        p->width = static_cast<uint8_t>(n != 0 ? width_for(k[n - 1] - k[0]) : 1);
+        p->cnt = static_cast<unsigned int>(n);
+        visit(p, [&](auto* o) {
+            using W = std::remove_pointer_t<decltype(o)>;
+            for (size_t i = 0; i < n; i++) {
+                o[i] = static_cast<W>(k[i] - p->base);
+            }
+        });
+    }
+
+    // Most even cut of the sorted keys k[0, n) into two leaves which both
+    // fit: the left one takes k[0, m). Leaves which fitted before the
+    // insert or the merge are one such cut, so there always is one.
+    static size_t split_point(const T* k, size_t n, size_t prefer) {
+        size_t best = n;
+        for (size_t m = 1; m < n; m++) {
+            if (!fits(k, m) || !fits(k + m, n - m)) {
+                continue;
+            }
+            auto dist = [&](size_t x) {
+                return x > prefer ? x - prefer : prefer - x;
+            };
+            if (best == n || dist(m) < dist(best)) {
+                best = m;
+            }
+        }
+        return best;
+    }
+
+    Leaf* new_leaf() {
+        Leaf* p = ::new (static_cast<void*>(LeafTraits::allocate(leaf_alloc, 1))) Leaf;
+        p->leaf = true;
+        p->cnt = 0;
+        p->prev = nullptr;
+        p->next = nullptr;
+        p->base = 0;
+        p->width = 1;
+        return p;
+    }
+
+    Inner* new_inner() {
+        Inner* p = ::new (static_cast<void*>(InnerTraits::allocate(inner_alloc, 1))) Inner;
+        p->leaf = false;
+        p->cnt = 0;
+        return p;
+    }
+
+    void free_node(Node* p) {
+        if (p->leaf) {
+            LeafTraits::deallocate(leaf_alloc, leaf(p), 1);
+        } else {
+            InnerTraits::deallocate(inner_alloc, inner(p), 1);
+        }
+    }
+
+    void free_tree(Node* p) {
+        if (!p->leaf) {
+            for (unsigned int i = 0; i <= p->cnt; i++) {
+                free_tree(inner(p)->children[i]);
+            }
+        }
+        free_node(p);
+    }
+
+    // Copy of the subtree of p, leaves are chained after prev
+    Node* clone(const Node* p, Leaf* &prev) {
+        if (p->leaf) {
+            Leaf* c = new_leaf();
+            std::memcpy(static_cast<void*>(c), p, sizeof(Leaf));
+            c->prev = prev;
+            c->next = nullptr;
+            if (prev != nullptr) {
+                prev->next = c;
+            }
+            prev = c;
+            return c;
+        }
+        Inner* c = new_inner();
+        unsigned int done = 0;
+        try {
+            for (; done <= p->cnt; done++) {
+                c->children[done] = clone(inner(p)->children[done], prev);
+            }
+        } catch (...) {
+            for (unsigned int i = 0; i < done; i++) {
+                free_tree(c->children[i]);
+            }
+            free_node(c);
+            throw;
+        }
+        std::copy(inner(p)->keys, inner(p)->keys + p->cnt, c->keys);
+        c->cnt = p->cnt;
+        return c;
+    }
+
+    // Index of the child of in where x goes: the number of separators not
+    // greater than x
+    static unsigned int child_index(const Inner* in, T x) {
+        return btree_detail::count_less(in->keys, in->cnt, x, [](T a, T b) {
+            return !(b < a);
+        });
+    }
+
+    // Insert x at pos of p, re-encoding or splitting the leaf if needed.
+    // Returns the new right sibling with its first key in sep.
+    Leaf* insert_leaf(Leaf* p, unsigned int pos, T x, T &sep) {
+        unsigned int n = p->cnt;
+        if (x >= p->base && (n + 1) * p->width <= leaf_data && width_for(x - p->base) <= p->width) {
+            visit(p, [&](auto* k) {
+                using W = std::remove_pointer_t<decltype(k)>;
+                std::move_backward(k + pos, k + n, k + n + 1);
+                k[pos] = static_cast<W>(x - p->base);
+            });
+            p->cnt++;
+            return nullptr;
+        }
+        T tmp[leaf_data + 1];
+        decode(p, tmp);
+        std::move_backward(tmp + pos, tmp + n, tmp + n + 1);
+        tmp[pos] = x;
+        n++;
+        if (fits(tmp, n)) {
+            encode(p, tmp, n);
+            return nullptr;
+        }
+        // A new maximum of the last leaf goes alone to a new leaf
+        size_t prefer = pos == n - 1 && p->next == nullptr ? n - 1 : n / 2;
+        size_t m = split_point(tmp, n, prefer);
+        Leaf* q = new_leaf();
+        encode(p, tmp, m);
+        encode(q, tmp + m, n - m);
+        q->next = p->next;
+        q->prev = p;
+        if (p->next != nullptr) {
+            p->next->prev = q;
+        } else {
+            last_leaf = q;
+        }
+        p->next = q;
+        sep = tmp[m];
+        return q;
+    }
+
+    // Insert x into the subtree of p, inserted tells whether it was
+    // absent. Returns the new right sibling of p if p had to split, with
+    // its first key in sep.
+    Node* insert_rec(Node* p, T x, T &sep, bool &inserted) {
+        if (p->leaf) {
+            Leaf* l = leaf(p);
+            unsigned int pos = search(l, x);
+            inserted = pos == l->cnt || key(l, pos) != x;
+            return inserted ? insert_leaf(l, pos, x, sep) : nullptr;
+        }
+        Inner* in = inner(p);
+        unsigned int i = child_index(in, x);
+        T child_sep;
+        Node* sib = insert_rec(in->children[i], x, child_sep, inserted);
+        if (sib == nullptr) {
+            return nullptr;
+        }
+        std::move_backward(in->keys + i, in->keys + in->cnt, in->keys + in->cnt + 1);
+        std::move_backward(in->children + i + 1, in->children + in->cnt + 1, in->children + in->cnt + 2);
+        in->keys[i] = child_sep;
+        in->children[i + 1] = sib;
+        in->cnt++;
+        if (in->cnt < 2 * B) {
+            return nullptr;
+        }
+        // The middle separator goes up
+        Inner* q = new_inner();
+        std::copy(in->keys + B + 1, in->keys + 2 * B, q->keys);
+        std::copy(in->children + B + 1, in->children + 2 * B + 1, q->children);
+        q->cnt = B - 1;
+        in->cnt = B;
+        sep = in->keys[B];
+        return q;
+    }
+
+    static bool underfull(const Node* p) {
+        if (p->leaf) {
+            const Leaf* l = static_cast<const Leaf*>(p);
+            return l->cnt * l->width < leaf_data / 4;
+        }
+        return p->cnt < B - 1;
+    }
+
+    // Remove separator i of in and the child after it
+    static void erase_child(Inner* in, unsigned int i) {
+        std::move(in->keys + i + 1, in->keys + in->cnt, in->keys + i);
+        std::move(in->children + i + 2, in->children + in->cnt + 1, in->children + i + 1);
+        in->cnt--;
+    }
+
+    // Child i of in is underfull: merge it with a neighbour if both fit in
+    // one node, otherwise spread their keys evenly
+    void rebalance(Inner* in, unsigned int i) {
+        unsigned int li = i < in->cnt ? i : i - 1;
+        Node* l = in->children[li];
+        Node* r = in->children[li + 1];
+        if (l->leaf) {
+            T tmp[2 * leaf_data];
+            decode(leaf(l), tmp);
+            decode(leaf(r), tmp + l->cnt);
+            size_t n = l->cnt + r->cnt;
+            if (fits(tmp, n)) {
+                encode(leaf(l), tmp, n);
+                leaf(l)->next = leaf(r)->next;
+                if (leaf(r)->next != nullptr) {
+                    leaf(r)->next->prev = leaf(l);
+                } else {
+                    last_leaf = leaf(l);
+                }
+                erase_child(in, li);
+                free_node(r);
+                return;
+            }
+            size_t m = split_point(tmp, n, n / 2);
+            encode(leaf(l), tmp, m);
+            encode(leaf(r), tmp + m, n - m);
+            in->keys[li] = tmp[m];
+            return;
+        }
+        Inner* a = inner(l);
+        Inner* b = inner(r);
+        unsigned int total = a->cnt + b->cnt + 1;
+        if (total <= 2 * B - 1) {
+            a->keys[a->cnt] = in->keys[li];
+            std::copy(b->keys, b->keys + b->cnt, a->keys + a->cnt + 1);
+            std::copy(b->children, b->children + b->cnt + 1, a->children + a->cnt + 1);
+            a->cnt = total;
+            erase_child(in, li);
+            free_node(b);
+            return;
+        }
+        // The separator comes down and the one in the middle goes up
+        T keys[4 * B];
+        Node* children[4 * B + 2];
+        std::copy(a->keys, a->keys + a->cnt, keys);
+        keys[a->cnt] = in->keys[li];
+        std::copy(b->keys, b->keys + b->cnt, keys + a->cnt + 1);
+        std::copy(a->children, a->children + a->cnt + 1, children);
+        std::copy(b->children, b->children + b->cnt + 1, children + a->cnt + 1);
+        unsigned int m = total / 2;
+        std::copy(keys, keys + m, a->keys);
+        std::copy(children, children + m + 1, a->children);
+        a->cnt = m;
+        std::copy(keys + m + 1, keys + total, b->keys);
+        std::copy(children + m + 1, children + total + 1, b->children);
+        b->cnt = total - m - 1;
+        in->keys[li] = keys[m];
+    }
+
+    // Erase x from the subtree of p, returns whether it was there
+    bool erase_rec(Node* p, T x) {
+        if (p->leaf) {
+            Leaf* l = leaf(p);
+            unsigned int pos = search(l, x);
+            if (pos == l->cnt || key(l, pos) != x) {
+                return false;
+            }
+            visit(l, [&](auto* k) {
+                std::move(k + pos + 1, k + l->cnt, k + pos);
+            });
+            l->cnt--;
+            return true;
+        }
+        Inner* in = inner(p);
+        unsigned int i = child_index(in, x);
+        if (!erase_rec(in->children[i], x)) {
+            return false;
+        }
+        if (underfull(in->children[i]) && in->cnt != 0) {
+            rebalance(in, i);
+        }
+        return true;
+    }
+
+    [[noreturn]] static void invariant_failed(const char* what) {
+        throw std::logic_error(std::string("PackedSet invariant violated: ") + what);
+    }
+
+    // Check the subtree of p at the given depth, its keys must be at least
+    // *lo and less than *hi where given. prev is the leaf before the
+    // subtree, on return its last leaf, and h is set to the depth of the
+    // leaves on the first one. Returns the number of keys.
+    size_t check_subtree(const Node* p, unsigned int depth, unsigned int &h, const T* lo, const T* hi, const Leaf* &prev) const {
+        if (p->leaf) {
+            const Leaf* l = static_cast<const Leaf*>(p);
+            if (l->prev != prev || (prev == nullptr ? l != first_leaf : prev->next != l)) {
+                invariant_failed("the leaf chain is broken");
+            }
+            if (prev == nullptr) {
+                h = depth;
+            } else if (depth != h) {
+                invariant_failed("leaves are at different depths");
+            }
+            if (l->width != 1 && l->width != 2 && l->width != 4 && (l->width != 8 || sizeof(T) <= 4)) {
+                invariant_failed("a leaf has an unknown width");
+            }
+            if (l->cnt * l->width > leaf_data) {
+                invariant_failed("a leaf is overfull");
+            }
+            if (l->cnt == 0 && p != root) {
+                invariant_failed("a leaf is empty");
+            }
+            for (unsigned int i = 0; i < l->cnt; i++) {
+                T k = key(l, i);
+                if (k < l->base || (i > 0 && !(key(l, i - 1) < k)) || (lo != nullptr && k < *lo) || (hi != nullptr && !(k < *hi))) {
+                    invariant_failed("keys are out of order");
+                }
+            }
+            prev = l;
+            return l->cnt;
+        }
+        const Inner* in = inner(p);
+        if (in->cnt > 2 * B - 1) {
+            invariant_failed("a node is overfull");
+        }
+        if (in->cnt == 0 && p != root) {
+            invariant_failed("an internal node has a single child");
+        }
+        size_t total = 0;
+        for (unsigned int i = 0; i <= in->cnt; i++) {
+            // Child i holds the keys between separators i - 1 and i
+            if (i > 0 && i < in->cnt && !(in->keys[i - 1] < in->keys[i])) {
+                invariant_failed("separators are out of order");
+            }
+            total += check_subtree(in->children[i], depth + 1, h, i > 0 ? in->keys + i - 1 : lo,
+                                   i < in->cnt ? in->keys + i : hi, prev);
+        }
+        return total;
+    }
+
+public:
+    explicit PackedSet(const Allocator &alloc = Allocator())
+        : leaf_alloc(alloc)
+        , inner_alloc(alloc)
+        , root(nullptr)
+        , first_leaf(nullptr)
+        , last_leaf(nullptr)
+        , sz(0) {}
+
+    template<typename Iter>
+    PackedSet(Iter begin, Iter end, const Allocator &alloc = Allocator())
+        : PackedSet(alloc) {
+        for (; begin != end; ++begin) {
+            insert(*begin);
+        }
+    }
+
+    PackedSet(std::initializer_list<T> init, const Allocator &alloc = Allocator())
+        : PackedSet(init.begin(), init.end(), alloc) {}
+
+    PackedSet(const PackedSet &set)
+        : PackedSet(std::allocator_traits<Allocator>::select_on_container_copy_construction(set.get_allocator())) {
+        if (set.root != nullptr) {
+            Leaf* prev = nullptr;
+            root = clone(set.root, prev);
+            last_leaf = prev;
+            for (first_leaf = prev; first_leaf->prev != nullptr; first_leaf = first_leaf->prev) {}
+            sz = set.sz;
+        }
+    }
+
+    PackedSet(PackedSet &&set) noexcept
+        : leaf_alloc(set.leaf_alloc)
+        , inner_alloc(set.inner_alloc)
+        , root(set.root)
+        , first_leaf(set.first_leaf)
+        , last_leaf(set.last_leaf)
+        , sz(set.sz) {
+        set.root = nullptr;
+        set.first_leaf = nullptr;
+        set.last_leaf = nullptr;
+        set.sz = 0;
+    }
+
+    PackedSet &operator=(PackedSet set) noexcept {
+        swap(set);
+        return *this;
+    }
+
+    ~PackedSet() {
+        clear();
+    }
+
+    void swap(PackedSet &set) noexcept {
+        std::swap(leaf_alloc, set.leaf_alloc);
+        std::swap(inner_alloc, set.inner_alloc);
+        std::swap(root, set.root);
+        std::swap(first_leaf, set.first_leaf);
+        std::swap(last_leaf, set.last_leaf);
+        std::swap(sz, set.sz);
+    }
+
+    Allocator get_allocator() const {
+        return Allocator(leaf_alloc);
+    }
+
+    key_compare key_comp() const {
+        return key_compare();
+    }
+
+    value_compare value_comp() const {
+        return value_compare();
+    }
+
+    void clear() {
+        if (root != nullptr) {
+            free_tree(root);
+            root = nullptr;
+        }
+        first_leaf = last_leaf = nullptr;
+        sz = 0;
+    }
+
+    bool empty() const {
+        return sz == 0;
+    }
+
+    size_t size() const {
+        return sz;
+    }
+
+    // Walk the whole tree and throw std::logic_error if its structure is
+    // broken: overfull nodes, empty leaves, leaves at different depths,
+    // keys out of order or outside the separators above them, unknown
+    // widths, a broken leaf chain or a wrong size(). O(n), for tests and
+    // debugging.
+    void check_invariants() const {
+        if (root == nullptr) {
+            if (sz != 0 || first_leaf != nullptr || last_leaf != nullptr) {
+                invariant_failed("an empty set has leaves");
+            }
+            return;
+        }
+        const Leaf* prev = nullptr;
+        unsigned int h = 0;
+        size_t n = check_subtree(root, 0, h, nullptr, nullptr, prev);
+        if (prev != last_leaf || prev->next != nullptr) {
+            invariant_failed("the last leaf isn't the end leaf");
+        }
+        if (n != sz) {
+            invariant_failed("size() doesn't match the number of keys");
+        }
+    }
+
+    // Points to a (leaf, slot) pair like the iterator of Set
+    class iterator {
+        friend PackedSet;
+
+    private:
+        const Leaf* ptr;
+        unsigned int slot;
+
+        // Past the end of a leaf is the start of the next one
+        iterator(const Leaf* p, unsigned int s)
+            : ptr(p)
+            , slot(s) {
+            if (ptr != nullptr && slot == ptr->cnt && ptr->next != nullptr) {
+                ptr = ptr->next;
+                slot = 0;
+            }
+        }
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = T;
+
+        iterator()
+            : ptr(nullptr)
+            , slot(0) {}
+
+        bool operator==(const iterator &iter) const {
+            return ptr == iter.ptr && slot == iter.slot;
+        }
+
+        bool operator!=(const iterator &iter) const {
+            return !(*this == iter);
+        }
+
+        T operator*() const {
+            return key(ptr, slot);
+        }
+
+        iterator& operator++() {
+            slot++;
+            if (slot == ptr->cnt && ptr->next != nullptr) {
+                ptr = ptr->next;
+                slot = 0;
+            }
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator ret = *this;
+            ++(*this);
+            return ret;
+        }
+
+        iterator& operator--() {
+            if (slot == 0) {
+                ptr = ptr->prev;
+                slot = ptr->cnt;
+            }
+            slot--;
+            return *this;
+        }
+
+        iterator operator--(int) {
+            iterator ret = *this;
+            --(*this);
+            return ret;
+        }
+    };
+
+    iterator begin() const {
+        return iterator(first_leaf, 0);
+    }
+
+    iterator end() const {
+        return iterator(last_leaf, last_leaf != nullptr ? last_leaf->cnt : 0);
+    }
+
+    // First key which is not less than x
+    iterator lower_bound(T x) const {
+        if (root == nullptr) {
+            return end();
+        }
+        const Node* p = root;
+        while (!p->leaf) {
+            p = inner(p)->children[child_index(inner(p), x)];
+        }
+        const Leaf* l = static_cast<const Leaf*>(p);
+        return iterator(l, search(l, x));
+    }
+
+    iterator upper_bound(T x) const {
+        iterator it = lower_bound(x);
+        if (it != end() && *it == x) {
+            ++it;
+        }
+        return it;
+    }
+
+    iterator find(T x) const {
+        iterator it = lower_bound(x);
+        if (it == end() || *it != x) {
+            return end();
+        }
+        return it;
+    }
+
+    bool contains(T x) const {
+        return find(x) != end();
+    }
+
+    size_t count(T x) const {
+        return contains(x);
+    }
+
+    // Call f with every key in order. Each leaf is decoded in one loop
+    // over its offsets, which the compiler vectorizes.
+    template<typename F>
+    void for_each(F f) const {
+        for (const Leaf* p = first_leaf; p != nullptr; p = p->next) {
+            visit(p, [&](const auto* k) {
+                for (unsigned int i = 0; i < p->cnt; i++) {
+                    f(static_cast<T>(p->base + k[i]));
+                }
+            });
+        }
+    }
+
+    // Returns whether x was inserted
+    bool insert(T x) {
+        if (root == nullptr) {
+            root = first_leaf = last_leaf = new_leaf();
+        }
+        T sep;
+        bool inserted;
+        if (Node* sib = insert_rec(root, x, sep, inserted)) {
+            Inner* r = new_inner();
+            r->keys[0] = sep;
+            r->children[0] = root;
+            r->children[1] = sib;
+            r->cnt = 1;
+            root = r;
+        }
+        if (inserted) {
+            sz++;
+        }
+        return inserted;
+    }
+
+    // Returns the number of erased keys
+    size_t erase(T x) {
+        if (root == nullptr || !erase_rec(root, x)) {
+            return 0;
+        }
+        sz--;
+        if (sz == 0) {
+            clear();
+        } else if (!root->leaf && root->cnt == 0) {
+            // Root with a single child, the child becomes the root
+            Node* c = inner(root)->children[0];
+            free_node(root);
+            root = c;
+        }
+        return 1;
+    }
+};
@@ -0,0 +1,660 @@
+// Persistent B+-tree: nodes are reference counted and shared between
+// versions, a write copies only the shared nodes on its root-to-leaf path
+#pragma once
+
+#include "tree.h"
+
+#include <array>
+#include <atomic>
+
+// Set with O(1) snapshots. A copy shares every node with the original,
+// insert and erase then copy the nodes on their path which are still
+// shared and write in place those owned by this set alone. Versions never
+// see each other's writes.
+//
+// The layout is the one of Set (separators are the maxima of the
+// children) without the parent pointers and the leaf chain, which can't
+// be shared by several versions. Iterators keep the path from the root
+// instead, and are invalidated by any write to the set they came from.
+//
+// Different sets may be used from different threads even when they share
+// nodes: shared nodes are never written and the counters are atomic. A
+// single set still needs outside synchronization like any container.
+template<typename T, unsigned int B = 16, typename Compare = std::less<T>, typename Allocator = std::allocator<T>>
+class PersistentSet : private btree_detail::compare_holder<Compare> {
+    static_assert(B >= 2, "B must be at least 2");
+    static_assert(std::is_copy_constructible<T>::value, "shared nodes are copied on write");
+
+    using CompareHolder = btree_detail::compare_holder<Compare>;
+
+public:
+    using value_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+
+    class iterator;
+    using const_iterator = iterator;
+
+private:
+    // Keys are stored inline in sorted order, up to 2 * B of them
+    struct Node {
+        // Number of sets and internal nodes pointing to this node
+        std::atomic<size_t> refs;
+        // Number of keys, for an internal node also the number of children
+        unsigned int cnt;
+        bool leaf;
+        alignas(T) unsigned char storage[2 * B * sizeof(T)];
+
+        Node(bool is_leaf)
+            : refs(1)
+            , cnt(0)
+            , leaf(is_leaf) {}
+
+        ~Node() {
+            for (unsigned int i = 0; i < cnt; i++) {
+                keys()[i].~T();
+            }
+        }
+
+        T* keys() {
+            return reinterpret_cast<T*>(storage);
+        }
+
+        const T* keys() const {
+            return reinterpret_cast<const T*>(storage);
+        }
+
+        const T& max() const {
+            return keys()[cnt - 1];
+        }
+
+        // Insert a key at position pos, shifting the tail right
+        template<typename U>
+        void insert_key(unsigned int pos, U&& elem) {
+            T* k = keys();
+            if (pos == cnt) {
+                new (k + cnt) T(std::forward<U>(elem));
+            } else {
+                new (k + cnt) T(std::move(k[cnt - 1]));
+                std::move_backward(k + pos, k + cnt - 1, k + cnt);
+                k[pos] = std::forward<U>(elem);
+            }
+            cnt++;
+        }
+
+        // Remove the key at position pos, shifting the tail left
+        void erase_key(unsigned int pos) {
+            T* k = keys();
+            std::move(k + pos + 1, k + cnt, k + pos);
+            cnt--;
+            k[cnt].~T();
+        }
+    };
+
+    // Internal node, holds a reference to each of its children
+    struct Inner : Node {
+        Node* children[2 * B];
+
+        Inner()
+            : Node(false) {}
+
+        // Insert a child at position pos, its maximum becomes the separator
+        void insert(unsigned int pos, Node* child) {
+            std::move_backward(children + pos, children + this->cnt, children + this->cnt + 1);
+            children[pos] = child;
+            this->insert_key(pos, child->max());
+        }
+
+        // Remove the child at position pos, its reference is left alone
+        void erase(unsigned int pos) {
+            std::move(children + pos + 1, children + this->cnt, children + pos);
+            this->erase_key(pos);
+        }
+    };
+
+    struct Leaf : Node {
+        Leaf()
+            : Node(true) {}
+    };
+
+    using LeafAlloc = typename std::allocator_traits<Allocator>::template rebind_alloc<Leaf>;
+    using InnerAlloc = typename std::allocator_traits<Allocator>::template rebind_alloc<Inner>;
+    using LeafTraits = std::allocator_traits<LeafAlloc>;
+    using InnerTraits = std::allocator_traits<InnerAlloc>;
+
+    // Every non-root node has at least B children or keys, so a tree of
+    // size_t keys is never higher than this
+    static constexpr unsigned int max_height() {
+        unsigned int bits = 0;
+        for (unsigned int b = B; b > 1; b /= 2) {
+            bits++;
+        }
+        return (sizeof(size_t) * 8 - 1) / bits + 2;
+    }
+
+    LeafAlloc leaf_alloc;
+    InnerAlloc inner_alloc;
+
+    // nullptr for an empty set
+    Node* root;
+    size_t sz;
+
+    static Inner* inner(Node* p) {
+        return static_cast<Inner*>(p);
+    }
+
+    static const Inner* inner(const Node* p) {
+        return static_cast<const Inner*>(p);
+    }
+
+    bool less(const T &a, const T &b) const {
+        return btree_detail::key_order<Compare, T, T>::less(this->comp(), a, b);
+    }
+
+    // Position of the first key of p which is not less than elem
+    unsigned int lower(const Node* p, const T &elem) const {
+        if constexpr (btree_detail::key_order<Compare, T, T>::user_three_way) {
+            return btree_detail::lower_bound(p->keys(), p->cnt, elem, [this](const T &a, const T &b) {
+                return less(a, b);
+            });
+        } else {
+            return btree_detail::lower_bound(p->keys(), p->cnt, elem, this->comp());
+        }
+    }
+
+    Leaf* new_leaf() {
+        Leaf* p = LeafTraits::allocate(leaf_alloc, 1);
+        LeafTraits::construct(leaf_alloc, p);
+        return p;
+    }
+
+    Inner* new_inner() {
+        Inner* p = InnerTraits::allocate(inner_alloc, 1);
+        InnerTraits::construct(inner_alloc, p);
+        return p;
+    }
+
+    // Free a single node, children of an internal node are left alone
+    void free_node(Node* p) {
+        if (p->leaf) {
+            LeafTraits::destroy(leaf_alloc, static_cast<Leaf*>(p));
+            LeafTraits::deallocate(leaf_alloc, static_cast<Leaf*>(p), 1);
+        } else {
+            InnerTraits::destroy(inner_alloc, inner(p));
+            InnerTraits::deallocate(inner_alloc, inner(p), 1);
+        }
+    }
+
+    static void retain(Node* p) {
+        p->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Drop a reference, the last one frees the node and releases its children
+    void release(Node* p) {
+        if (p->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+        if (!p->leaf) {
+            Inner* in = inner(p);
+            for (unsigned int i = 0; i < in->cnt; i++) {
+                release(in->children[i]);
+            }
+        }
+        free_node(p);
+    }
+
+    // Copy of p owned by nobody else, the children become shared
+    Node* clone(const Node* p) {
+        Node* c = p->leaf ? static_cast<Node*>(new_leaf()) : new_inner();
+        try {
+            for (unsigned int i = 0; i < p->cnt; i++) {
+                new (c->keys() + i) T(p->keys()[i]);
+                c->cnt++;
+            }
+        } catch (...) {
+            free_node(c);
+            throw;
+        }
+        if (!p->leaf) {
+            for (unsigned int i = 0; i < p->cnt; i++) {
+                inner(c)->children[i] = inner(p)->children[i];
+                retain(inner(c)->children[i]);
+            }
+        }
+        return c;
+    }
+
+    // Make the node in slot owned by this set alone, copying it if it is
+    // shared. Only called with the node holding slot already unshared, so
+    // a single reference means that no other version can reach the node.
+    Node* unshare(Node* &slot) {
+        if (slot->refs.load(std::memory_order_acquire) != 1) {
+            Node* c = clone(slot);
+            release(slot);
+            slot = c;
+        }
+        return slot;
+    }
+
+    // Move the upper half of a full node to a new right sibling
+    Node* split(Node* p) {
+        Node* q = p->leaf ? static_cast<Node*>(new_leaf()) : new_inner();
+        T* from = p->keys();
+        T* to = q->keys();
+        for (unsigned int i = 0; i < B; i++) {
+            new (to + i) T(std::move(from[B + i]));
+            from[B + i].~T();
+        }
+        if (!p->leaf) {
+            std::copy(inner(p)->children + B, inner(p)->children + 2 * B, inner(q)->children);
+        }
+        p->cnt = B;
+        q->cnt = B;
+        return q;
+    }
+
+    // Insert elem, known to be absent, into the subtree in slot. Returns
+    // the new right sibling if the root of the subtree had to split.
+    template<typename U>
+    Node* insert_rec(Node* &slot, U&& elem) {
+        Node* p = unshare(slot);
+        unsigned int i = lower(p, elem);
+        if (p->leaf) {
+            p->insert_key(i, std::forward<U>(elem));
+        } else {
+            Inner* in = inner(p);
+            // Keys greater than everything go to the rightmost child and
+            // raise its maximum
+            bool grow = i == in->cnt;
+            if (grow) {
+                i--;
+            }
+            Node* sib = insert_rec(in->children[i], std::forward<U>(elem));
+            if (grow || sib != nullptr) {
+                in->keys()[i] = in->children[i]->max();
+            }
+            if (sib != nullptr) {
+                in->insert(i + 1, sib);
+            }
+        }
+        return p->cnt == 2 * B ? split(p) : nullptr;
+    }
+
+    // Move one key (and child) between the neighbours l and r
+    static void shift_left(Node* l, Node* r) {
+        l->insert_key(l->cnt, std::move(r->keys()[0]));
+        if (!l->leaf) {
+            inner(l)->children[l->cnt - 1] = inner(r)->children[0];
+            inner(r)->erase(0);
+        } else {
+            r->erase_key(0);
+        }
+    }
+
+    static void shift_right(Node* l, Node* r) {
+        r->insert_key(0, std::move(l->keys()[l->cnt - 1]));
+        if (!l->leaf) {
+            Inner* in = inner(r);
+            std::move_backward(in->children, in->children + r->cnt - 1, in->children + r->cnt);
+            in->children[0] = inner(l)->children[l->cnt - 1];
+        }
+        l->erase_key(l->cnt - 1);
+    }
+
+    // Child i of in has B - 1 keys, refill it from a neighbour or merge
+    // the two. Both neighbours are unshared first since both are written.
+    void rebalance(Inner* in, unsigned int i) {
+        unsigned int l = i + 1 < in->cnt ? i : i - 1;
+        Node* left = unshare(in->children[l]);
+        Node* right = unshare(in->children[l + 1]);
+        if (left->cnt + right->cnt >= 2 * B) {
+            if (left->cnt < B) {
+                shift_left(left, right);
+            } else {
+                shift_right(left, right);
+            }
+            in->keys()[l] = left->max();
+            in->keys()[l + 1] = right->max();
+            return;
+        }
+        // Children of right change hands, their counters stay the same
+        for (unsigned int j = 0; j < right->cnt; j++) {
+            new (left->keys() + left->cnt + j) T(std::move(right->keys()[j]));
+            if (!left->leaf) {
+                inner(left)->children[left->cnt + j] = inner(right)->children[j];
+            }
+        }
+        left->cnt += right->cnt;
+        in->keys()[l] = left->max();
+        in->erase(l + 1);
+        free_node(right);
+    }
+
+    // Erase elem, known to be present, from the subtree in slot
+    void erase_rec(Node* &slot, const T &elem) {
+        Node* p = unshare(slot);
+        unsigned int i = lower(p, elem);
+        if (p->leaf) {
+            p->erase_key(i);
+            return;
+        }
+        Inner* in = inner(p);
+        erase_rec(in->children[i], elem);
+        if (in->children[i]->cnt < B) {
+            rebalance(in, i);
+        } else if (!less(elem, in->keys()[i])) {
+            // elem was the maximum of the child
+            in->keys()[i] = in->children[i]->max();
+        }
+    }
+
+public:
+    explicit PersistentSet(const Compare &comp = Compare(), const Allocator &alloc = Allocator())
+        : CompareHolder(comp)
+        , leaf_alloc(alloc)
+        , inner_alloc(alloc)
+        , root(nullptr)
+        , sz(0) {}
+
+    explicit PersistentSet(const Allocator &alloc)
+        : PersistentSet(Compare(), alloc) {}
+
+    template<typename Iter>
+    PersistentSet(Iter begin, Iter end, const Compare &comp = Compare(), const Allocator &alloc = Allocator())
+        : PersistentSet(comp, alloc) {
+        for (; begin != end; ++begin) {
+            insert(*begin);
+        }
+    }
+
+    PersistentSet(std::initializer_list<T> init, const Compare &comp = Compare(), const Allocator &alloc = Allocator())
+        : PersistentSet(init.begin(), init.end(), comp, alloc) {}
+
+    // Shares all nodes of set, O(1)
+    PersistentSet(const PersistentSet &set)
+        : CompareHolder(set.comp())
+        , leaf_alloc(set.leaf_alloc)
+        , inner_alloc(set.inner_alloc)
+        , root(set.root)
+        , sz(set.sz) {
+        if (root != nullptr) {
+            retain(root);
+        }
+    }
+
+    PersistentSet(PersistentSet &&set) noexcept(std::is_nothrow_copy_constructible<Compare>::value)
+        : CompareHolder(set.comp())
+        , leaf_alloc(set.leaf_alloc)
+        , inner_alloc(set.inner_alloc)
+        , root(set.root)
+        , sz(set.sz) {
+        set.root = nullptr;
+        set.sz = 0;
+    }
+
+    ~PersistentSet() {
+        clear();
+    }
+
+    // Nodes are freed by whichever version drops them last, so all
+    // versions keep the allocator of the set they were copied from
+    PersistentSet &operator=(PersistentSet set) noexcept(std::is_nothrow_copy_assignable<Compare>::value) {
+        swap(set);
+        return *this;
+    }
+
+    void swap(PersistentSet &set) noexcept(std::is_nothrow_copy_assignable<Compare>::value) {
+        std::swap(static_cast<CompareHolder&>(*this), static_cast<CompareHolder&>(set));
+        std::swap(leaf_alloc, set.leaf_alloc);
+        std::swap(inner_alloc, set.inner_alloc);
+        std::swap(root, set.root);
+        std::swap(sz, set.sz);
+    }
+
+    // Point-in-time view of the set, O(1). Later writes to either set
+    // don't show up in the other one.
+    PersistentSet snapshot() const {
+        return *this;
+    }
+
+    Allocator get_allocator() const {
+        return Allocator(leaf_alloc);
+    }
+
+    key_compare key_comp() const {
+        return this->comp();
+    }
+
+    value_compare value_comp() const {
+        return this->comp();
+    }
+
+    // Drop the reference to the root, frees the nodes no other version uses
+    void clear() {
+        if (root != nullptr) {
+            release(root);
+            root = nullptr;
+        }
+        sz = 0;
+    }
+
+    bool empty() const {
+        return sz == 0;
+    }
+
+    size_t size() const {
+        return sz;
+    }
+
+    // Keeps the path from the root to the current key
+    class iterator {
+        friend PersistentSet;
+
+    private:
+        struct frame {
+            const Node* node;
+            unsigned int pos;
+        };
+
+        const Node* root;
+        // Number of frames in use, 0 past the end
+        unsigned int depth;
+        std::array<frame, max_height()> path;
+
+        explicit iterator(const Node* r)
+            : root(r)
+            , depth(0) {}
+
+        // Go down from the child at the top of the path to its first or
+        // last key
+        void descend(bool last) {
+            const Node* p = inner(path[depth - 1].node)->children[path[depth - 1].pos];
+            while (true) {
+                unsigned int pos = last ? p->cnt - 1 : 0;
+                path[depth++] = {p, pos};
+                if (p->leaf) {
+                    return;
+                }
+                p = inner(p)->children[pos];
+            }
+        }
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        iterator()
+            : root(nullptr)
+            , depth(0) {}
+
+        bool operator==(const iterator &iter) const {
+            if (depth == 0 || iter.depth == 0) {
+                return depth == iter.depth;
+            }
+            const frame &a = path[depth - 1];
+            const frame &b = iter.path[iter.depth - 1];
+            return a.node == b.node && a.pos == b.pos;
+        }
+
+        bool operator!=(const iterator &iter) const {
+            return !(*this == iter);
+        }
+
+        const T& operator*() const {
+            const frame &f = path[depth - 1];
+            return f.node->keys()[f.pos];
+        }
+
+        const T* operator->() const {
+            return &**this;
+        }
+
+        iterator& operator++() {
+            if (++path[depth - 1].pos < path[depth - 1].node->cnt) {
+                return *this;
+            }
+            // Climb to the first ancestor with a next child
+            while (--depth > 0) {
+                if (++path[depth - 1].pos < path[depth - 1].node->cnt) {
+                    descend(false);
+                    return *this;
+                }
+            }
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator ret = *this;
+            ++(*this);
+            return ret;
+        }
+
+        iterator& operator--() {
+            if (depth == 0) {
+                // From past the end to the last key
+                path[depth++] = {root, root->cnt - 1};
+                if (!root->leaf) {
+                    descend(true);
+                }
+                return *this;
+            }
+            if (path[depth - 1].pos > 0) {
+                path[depth - 1].pos--;
+                return *this;
+            }
+            while (path[--depth - 1].pos == 0) {}
+            path[depth - 1].pos--;
+            descend(true);
+            return *this;
+        }
+
+        iterator operator--(int) {
+            iterator ret = *this;
+            --(*this);
+            return ret;
+        }
+    };
+
+    iterator begin() const {
+        iterator it(root);
+        if (root != nullptr) {
+            it.path[it.depth++] = {root, 0};
+            if (!root->leaf) {
+                it.descend(false);
+            }
+        }
+        return it;
+    }
+
+    iterator end() const {
+        return iterator(root);
+    }
+
+    // First key which is not less than elem
+    iterator lower_bound(const T &elem) const {
+        iterator it(root);
+        const Node* p = root;
+        while (p != nullptr) {
+            unsigned int i = lower(p, elem);
+            if (i == p->cnt) {
+                // Greater than everything
+                return end();
+            }
+            it.path[it.depth++] = {p, i};
+            p = p->leaf ? nullptr : inner(p)->children[i];
+        }
+        return it;
+    }
+
+    iterator find(const T &elem) const {
+        iterator it = lower_bound(elem);
+        if (it != end() && less(elem, *it)) {
+            return end();
+        }
+        return it;
+    }
+
+    bool contains(const T &elem) const {
+        return find(elem) != end();
+    }
+
+    size_t count(const T &elem) const {
+        return contains(elem);
+    }
+
+    // Returns whether elem was inserted. A key which is already present
+    // copies nothing.
+    bool insert(const T &elem) {
+        return insert_impl(elem);
+    }
+
+    bool insert(T &&elem) {
+        return insert_impl(std::move(elem));
+    }
+
+    template<typename... Args>
+    bool emplace(Args&&... args) {
+        return insert_impl(T(std::forward<Args>(args)...));
+    }
+
+    // Returns the number of erased keys
+    size_t erase(const T &elem) {
+        if (!contains(elem)) {
+            return 0;
+        }
+        erase_rec(root, elem);
+        sz--;
+        if (root->cnt == 0) {
+            release(root);
+            root = nullptr;
+        } else if (!root->leaf && root->cnt == 1) {
+            // Root with a single child, the child becomes the root
+            Node* child = inner(root)->children[0];
+            retain(child);
+            release(root);
+            root = child;
+        }
+        return 1;
+    }
+
+private:
+    template<typename U>
+    bool insert_impl(U&& elem) {
+        if (root == nullptr) {
+            root = new_leaf();
+        } else if (contains(elem)) {
+            return false;
+        }
+        if (Node* sib = insert_rec(root, std::forward<U>(elem))) {
+            Inner* r = new_inner();
+            r->insert(0, root);
+            r->insert(1, sib);
+            root = r;
+        }
+        sz++;
+        return true;
+    }
+};
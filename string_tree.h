@@ -0,0 +1,1060 @@
+// B+-tree of strings on byte pages: keys sharing a prefix store it once per
+// node and separators are cut to the shortest string that still separates
+#pragma once
+
+#include "tree.h"
+
+#include <cassert>
+#include <limits>
+#include <string_view>
+
+namespace btree_detail {
+
+// First four bytes of s as a big-endian number, padded with zeros. Unequal
+// heads order two strings like the strings themselves.
+inline uint32_t key_head(std::string_view s) {
+    uint32_t h = 0;
+    for (size_t i = 0; i < 4; i++) {
+        h <<= 8;
+        if (i < s.size()) {
+            h |= static_cast<unsigned char>(s[i]);
+        }
+    }
+    return h;
+}
+
+inline size_t common_prefix(std::string_view a, std::string_view b) {
+    size_t n = std::min(a.size(), b.size());
+    size_t i = 0;
+    while (i < n && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+}
+
+// Set of std::string ordered by bytes like std::set<std::string>, with the
+// nodes laid out as pages of PageSize bytes. A page holds sorted slots
+// growing from its front and the key bytes growing from its back, so keys
+// of any length share one allocation and nothing is allocated per key.
+//
+// Every node knows its fences: its keys are not less than the lower one
+// and less than the upper one. All strings between two fences start with
+// their common prefix, so it is stored once in the node and only the rest
+// of each key is kept. A split puts up the shortest prefix of the right
+// half's first key which is greater than the left half's last one, and
+// the separators of internal nodes are compared like any other key. Each
+// slot also holds the first four bytes of its key as a number, so most
+// probes of a search decide on it without touching the key bytes.
+//
+// Unlike in Set, separators are not the maxima of the children: an
+// internal node with n separators has n + 1 children, and a key goes to
+// the child after the last separator not greater than it. Nodes are
+// merged when they drop below a quarter of a page and their neighbour has
+// room for the rest, otherwise refilled from it. A leaf may stay emptier
+// if its parent has no room for the new separator, iterators skip empty
+// leaves.
+//
+// Keys longer than max_key_size throw std::length_error, which guarantees
+// that both halves of a split fit in a page. Iterators give the keys by
+// value (prefix and rest are put together), they are invalidated by
+// inserts and erases.
+template<unsigned int PageSize = 4096, typename Allocator = std::allocator<char>>
+class StringSet {
+    static_assert(PageSize >= 512 && PageSize <= 32768, "pages are addressed with 16-bit offsets");
+
+public:
+    using value_type = std::string;
+    using key_type = std::string;
+    using key_compare = std::less<std::string>;
+    using value_compare = std::less<std::string>;
+
+    class iterator;
+    using const_iterator = iterator;
+
+private:
+    // Header of a page. The fences are stored at the very end of the page,
+    // the upper one first, and the prefix is the start of the lower one.
+    struct Node {
+        bool leaf;
+        // false for the rightmost node of a level, which has no upper fence
+        bool has_upper;
+        uint16_t cnt;
+        // Start of the key bytes
+        uint16_t heap;
+        // Key bytes of erased slots, given back by compact()
+        uint16_t garbage;
+        uint16_t prefix;
+        uint16_t lower_len;
+        uint16_t upper_len;
+    };
+
+    // Start of the fields after the header, which are pointers
+    static constexpr size_t node_bytes = (sizeof(Node) + alignof(void*) - 1) / alignof(void*) * alignof(void*);
+
+    struct leaf_slot {
+        uint32_t head;
+        uint16_t off;
+        uint16_t len;
+    };
+
+    struct inner_slot {
+        uint32_t head;
+        uint16_t off;
+        uint16_t len;
+        // Child holding the keys not less than this separator
+        Node* child;
+    };
+
+    struct Leaf : Node {
+        using Slot = leaf_slot;
+        static constexpr size_t header = node_bytes + 2 * sizeof(void*);
+
+        Leaf* prev;
+        Leaf* next;
+        alignas(Slot) unsigned char data[PageSize - header];
+    };
+
+    struct Inner : Node {
+        using Slot = inner_slot;
+        static constexpr size_t header = node_bytes + sizeof(void*);
+
+        // Child holding the keys less than the first separator
+        Node* first;
+        alignas(Slot) unsigned char data[PageSize - header];
+    };
+
+    static_assert(sizeof(Leaf) == PageSize && sizeof(Inner) == PageSize, "PageSize has to be a multiple of the alignment of pointers");
+    static_assert(std::is_trivially_copyable<Leaf>::value && std::is_trivially_copyable<Inner>::value,
+                  "pages are copied as bytes");
+
+    // A key to be written to a page, given in two parts since keys coming
+    // from different nodes have different prefixes. For an internal node
+    // also the child following it.
+    struct entry {
+        std::string_view pre;
+        std::string_view rest;
+        Node* child;
+
+        size_t size() const {
+            return pre.size() + rest.size();
+        }
+
+        std::string str() const {
+            std::string s;
+            s.reserve(size());
+            s.append(pre);
+            s.append(rest);
+            return s;
+        }
+    };
+
+    using LeafAlloc = typename std::allocator_traits<Allocator>::template rebind_alloc<Leaf>;
+    using InnerAlloc = typename std::allocator_traits<Allocator>::template rebind_alloc<Inner>;
+    using LeafTraits = std::allocator_traits<LeafAlloc>;
+    using InnerTraits = std::allocator_traits<InnerAlloc>;
+
+public:
+    // Longest key which can be inserted. With two fences, a separator and
+    // a key of this size a half of a split still fits in a page.
+    static constexpr size_t max_key_size = sizeof(Leaf::data) / 8 - sizeof(inner_slot);
+
+private:
+    LeafAlloc leaf_alloc;
+    InnerAlloc inner_alloc;
+
+    // nullptr for an empty set
+    Node* root;
+    Leaf* first_leaf;
+    Leaf* last_leaf;
+    size_t sz;
+
+    static Leaf* leaf(Node* p) {
+        return static_cast<Leaf*>(p);
+    }
+
+    static Inner* inner(Node* p) {
+        return static_cast<Inner*>(p);
+    }
+
+    static const Inner* inner(const Node* p) {
+        return static_cast<const Inner*>(p);
+    }
+
+    template<typename N>
+    static constexpr size_t capacity() {
+        return sizeof(N::data);
+    }
+
+    template<typename N>
+    static typename N::Slot* slots(N* p) {
+        return reinterpret_cast<typename N::Slot*>(p->data);
+    }
+
+    template<typename N>
+    static const typename N::Slot* slots(const N* p) {
+        return reinterpret_cast<const typename N::Slot*>(p->data);
+    }
+
+    template<typename N>
+    static std::string_view lower_fence(const N* p) {
+        return {reinterpret_cast<const char*>(p->data) + capacity<N>() - p->lower_len, p->lower_len};
+    }
+
+    template<typename N>
+    static std::string_view upper_fence(const N* p) {
+        return {reinterpret_cast<const char*>(p->data) + capacity<N>() - p->lower_len - p->upper_len, p->upper_len};
+    }
+
+    template<typename N>
+    static std::string_view prefix(const N* p) {
+        return lower_fence(p).substr(0, p->prefix);
+    }
+
+    // Key i of p without the prefix
+    template<typename N>
+    static std::string_view rest(const N* p, unsigned int i) {
+        const auto &s = slots(p)[i];
+        return {reinterpret_cast<const char*>(p->data) + s.off, s.len};
+    }
+
+    template<typename N>
+    static size_t free_space(const N* p) {
+        return p->heap - p->cnt * sizeof(typename N::Slot);
+    }
+
+    // Bytes of p in use, fences included
+    template<typename N>
+    static size_t used(const N* p) {
+        return capacity<N>() - free_space(p) - p->garbage;
+    }
+
+    template<typename N>
+    static bool underfull(const N* p) {
+        return used(p) < capacity<N>() / 4;
+    }
+
+    // Sign of key i of p minus the key whose rest and head are given
+    template<typename N>
+    static int compare(const N* p, unsigned int i, uint32_t head, std::string_view key) {
+        uint32_t h = slots(p)[i].head;
+        if (h != head) {
+            return h < head ? -1 : 1;
+        }
+        return rest(p, i).compare(key);
+    }
+
+    // Position of the first key of p which is not less than key, or with
+    // upper set greater than it. key has the prefix of p cut off.
+    template<typename N>
+    static unsigned int search(const N* p, std::string_view key, bool upper) {
+        uint32_t head = btree_detail::key_head(key);
+        unsigned int lo = 0;
+        unsigned int hi = p->cnt;
+        while (lo < hi) {
+            unsigned int mid = (lo + hi) / 2;
+            int c = compare(p, mid, head, key);
+            if (c < 0 || (upper && c == 0)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    // Child i of in: 0 is the first child, i > 0 the child of separator
+    // i - 1
+    static Node* child(const Inner* in, unsigned int i) {
+        return i == 0 ? in->first : slots(in)[i - 1].child;
+    }
+
+    // Child of in where key goes, with its index
+    static std::pair<Node*, unsigned int> child_for(const Inner* in, std::string_view key) {
+        unsigned int i = search(in, key.substr(in->prefix), true);
+        return {child(in, i), i};
+    }
+
+    // Whether key i of p is key
+    static bool equal(const Leaf* p, unsigned int i, std::string_view key) {
+        std::string_view r = rest(p, i);
+        return key.size() == p->prefix + r.size() && key.compare(0, p->prefix, prefix(p)) == 0
+            && key.compare(p->prefix, r.size(), r) == 0;
+    }
+
+    Leaf* new_leaf() {
+        // Default-initialized, a page is filled by build()
+        Leaf* p = ::new (static_cast<void*>(LeafTraits::allocate(leaf_alloc, 1))) Leaf;
+        p->leaf = true;
+        p->prev = nullptr;
+        p->next = nullptr;
+        return p;
+    }
+
+    Inner* new_inner() {
+        Inner* p = ::new (static_cast<void*>(InnerTraits::allocate(inner_alloc, 1))) Inner;
+        p->leaf = false;
+        return p;
+    }
+
+    void free_node(Node* p) {
+        if (p->leaf) {
+            LeafTraits::deallocate(leaf_alloc, leaf(p), 1);
+        } else {
+            InnerTraits::deallocate(inner_alloc, inner(p), 1);
+        }
+    }
+
+    void free_tree(Node* p) {
+        if (!p->leaf) {
+            Inner* in = inner(p);
+            for (unsigned int i = 0; i <= in->cnt; i++) {
+                free_tree(child(in, i));
+            }
+        }
+        free_node(p);
+    }
+
+    // Copy of the subtree of p, leaves are chained after prev
+    Node* clone(const Node* p, Leaf* &prev) {
+        if (p->leaf) {
+            Leaf* c = new_leaf();
+            std::memcpy(static_cast<void*>(c), p, sizeof(Leaf));
+            c->prev = prev;
+            c->next = nullptr;
+            if (prev != nullptr) {
+                prev->next = c;
+            }
+            prev = c;
+            return c;
+        }
+        Inner* c = new_inner();
+        std::memcpy(static_cast<void*>(c), p, sizeof(Inner));
+        c->cnt = 0;
+        c->first = nullptr;
+        try {
+            c->first = clone(inner(p)->first, prev);
+            for (unsigned int i = 0; i < inner(p)->cnt; i++) {
+                slots(c)[i].child = clone(child(inner(p), i + 1), prev);
+                c->cnt++;
+            }
+        } catch (...) {
+            if (c->first != nullptr) {
+                for (unsigned int i = 0; i <= c->cnt; i++) {
+                    free_tree(child(c, i));
+                }
+            }
+            free_node(c);
+            throw;
+        }
+        return c;
+    }
+
+    // Keys of p in order, for an internal node with the children after them
+    template<typename N>
+    static void gather(const N* p, std::vector<entry> &out) {
+        for (unsigned int i = 0; i < p->cnt; i++) {
+            Node* c = nullptr;
+            if constexpr (!std::is_same<N, Leaf>::value) {
+                c = slots(p)[i].child;
+            }
+            out.push_back({prefix(p), rest(p, i), c});
+        }
+    }
+
+    // Bytes taken by e in a node whose prefix is at least of length pre
+    template<typename N>
+    static size_t entry_bytes(const entry &e, size_t pre) {
+        return sizeof(typename N::Slot) + e.size() - pre;
+    }
+
+    // Append key e to p, there has to be room for it
+    template<typename N>
+    static void append(N* p, const entry &e) {
+        size_t cut = p->prefix;
+        std::string_view a = cut < e.pre.size() ? e.pre.substr(cut) : std::string_view();
+        std::string_view b = e.rest.substr(cut < e.pre.size() ? 0 : cut - e.pre.size());
+        size_t len = a.size() + b.size();
+        assert(free_space(p) >= sizeof(typename N::Slot) + len);
+        p->heap -= static_cast<uint16_t>(len);
+        char* dst = reinterpret_cast<char*>(p->data) + p->heap;
+        std::copy(a.begin(), a.end(), dst);
+        std::copy(b.begin(), b.end(), dst + a.size());
+        auto &s = slots(p)[p->cnt++];
+        s.head = btree_detail::key_head({dst, len});
+        s.off = p->heap;
+        s.len = static_cast<uint16_t>(len);
+        if constexpr (!std::is_same<N, Leaf>::value) {
+            s.child = e.child;
+        }
+    }
+
+    // Fill p with the keys of e, which must not point into p. The prefix
+    // is the one shared by the fences.
+    template<typename N>
+    static void build(N* p, std::string_view lower, const std::string_view* upper, const entry* e, size_t n) {
+        size_t cap = capacity<N>();
+        char* end = reinterpret_cast<char*>(p->data) + cap;
+        p->lower_len = static_cast<uint16_t>(lower.size());
+        p->upper_len = static_cast<uint16_t>(upper != nullptr ? upper->size() : 0);
+        p->has_upper = upper != nullptr;
+        std::copy(lower.begin(), lower.end(), end - p->lower_len);
+        if (upper != nullptr) {
+            std::copy(upper->begin(), upper->end(), end - p->lower_len - p->upper_len);
+        }
+        p->prefix = static_cast<uint16_t>(upper != nullptr ? btree_detail::common_prefix(lower, *upper) : 0);
+        p->heap = static_cast<uint16_t>(cap - p->lower_len - p->upper_len);
+        p->garbage = 0;
+        p->cnt = 0;
+        for (size_t i = 0; i < n; i++) {
+            append(p, e[i]);
+        }
+    }
+
+    // The slot array and the key bytes may be written straight into a page
+    // only as long as its copy is not one of the sources
+    template<typename N>
+    struct page_copy {
+        N page;
+
+        explicit page_copy(const N* p) {
+            std::memcpy(static_cast<void*>(&page), p, sizeof(N));
+        }
+    };
+
+    // Give back the bytes of erased keys
+    template<typename N>
+    static void compact(N* p) {
+        page_copy<N> copy(p);
+        std::vector<entry> e;
+        gather(&copy.page, e);
+        std::string_view upper = upper_fence(&copy.page);
+        build(p, lower_fence(&copy.page), copy.page.has_upper ? &upper : nullptr, e.data(), e.size());
+        if constexpr (!std::is_same<N, Leaf>::value) {
+            p->first = copy.page.first;
+        }
+    }
+
+    // Make room for bytes more in p, false if there is not enough
+    template<typename N>
+    static bool reserve(N* p, size_t bytes) {
+        if (free_space(p) >= bytes) {
+            return true;
+        }
+        if (free_space(p) + p->garbage < bytes) {
+            return false;
+        }
+        compact(p);
+        return true;
+    }
+
+    // Put e in place of slot pos of p, there has to be room for it
+    template<typename N>
+    static void insert_at(N* p, unsigned int pos, const entry &e) {
+        append(p, e);
+        auto* s = slots(p);
+        std::rotate(s + pos, s + p->cnt - 1, s + p->cnt);
+    }
+
+    template<typename N>
+    static void erase_at(N* p, unsigned int pos) {
+        auto* s = slots(p);
+        p->garbage += s[pos].len;
+        std::move(s + pos + 1, s + p->cnt, s + pos);
+        p->cnt--;
+    }
+
+    // Shortest key after a and not after b, b being greater than a
+    static std::string separator(const entry &a, const entry &b) {
+        std::string x = a.str();
+        std::string y = b.str();
+        y.resize(btree_detail::common_prefix(x, y) + 1);
+        return y;
+    }
+
+    // How the keys of one or two nodes are spread over two of them
+    struct spread {
+        size_t point;
+        std::string sep;
+    };
+
+    // Cut e into two pages of about the same size, the left one fenced by
+    // lower and the separator, the right one by the separator and upper.
+    // For an internal node the key at the point goes up and belongs to
+    // neither page, each of which keeps at least one key. Each page gets
+    // the prefix of its own fences, which may be shorter than those the
+    // keys had, so only cuts where both pages fit are taken. Returns false
+    // if there is none.
+    template<typename N>
+    static bool plan(const std::vector<entry> &e, std::string_view lower, const std::string_view* upper, spread &res) {
+        constexpr bool is_leaf = std::is_same<N, Leaf>::value;
+        constexpr size_t slot = sizeof(typename N::Slot);
+        size_t n = e.size();
+        // Bytes of the first k keys with no prefix cut off
+        std::vector<size_t> sums(n + 1, 0);
+        for (size_t j = 0; j < n; j++) {
+            sums[j + 1] = sums[j] + slot + e[j].size();
+        }
+        size_t upper_len = upper != nullptr ? upper->size() : 0;
+        size_t best_diff = std::numeric_limits<size_t>::max();
+        for (size_t m = 1; m + (is_leaf ? 0 : 1) < n; m++) {
+            std::string sep = is_leaf ? separator(e[m - 1], e[m]) : e[m].str();
+            size_t left_pre = btree_detail::common_prefix(lower, sep);
+            size_t right_pre = upper != nullptr ? btree_detail::common_prefix(sep, *upper) : 0;
+            size_t rb = is_leaf ? m : m + 1;
+            size_t left = lower.size() + sep.size() + sums[m] - m * left_pre;
+            size_t right = sep.size() + upper_len + sums[n] - sums[rb] - (n - rb) * right_pre;
+            if (left > capacity<N>() || right > capacity<N>()) {
+                continue;
+            }
+            size_t diff = left > right ? left - right : right - left;
+            if (diff < best_diff) {
+                best_diff = diff;
+                res.point = m;
+                res.sep = std::move(sep);
+            }
+        }
+        return best_diff != std::numeric_limits<size_t>::max();
+    }
+
+    // Lay keys e out over l and r by plan s, both older pages have been
+    // copied out. l keeps the lower fence and r the upper one.
+    template<typename N>
+    static void apply(const spread &s, const std::vector<entry> &e, Node* first, std::string_view lower,
+                      const std::string_view* upper, N* l, N* r) {
+        std::string_view sep = s.sep;
+        if constexpr (std::is_same<N, Leaf>::value) {
+            build(l, lower, &sep, e.data(), s.point);
+            build(r, sep, upper, e.data() + s.point, e.size() - s.point);
+        } else {
+            build(l, lower, &sep, e.data(), s.point);
+            l->first = first;
+            build(r, sep, upper, e.data() + s.point + 1, e.size() - s.point - 1);
+            r->first = e[s.point].child;
+        }
+    }
+
+    // key goes at pos of a leaf with no room for it: split the leaf, the
+    // new right sibling and its lower fence are returned
+    Leaf* split_leaf(Leaf* p, unsigned int pos, std::string_view key, std::string &sep) {
+        Leaf* q = new_leaf();
+        page_copy<Leaf> copy(p);
+        std::vector<entry> e;
+        gather(&copy.page, e);
+        e.insert(e.begin() + pos, entry{std::string_view(), key, nullptr});
+        std::string_view upper = upper_fence(&copy.page);
+        const std::string_view* up = copy.page.has_upper ? &upper : nullptr;
+        // A page split for one more key of at most max_key_size always
+        // has a cut that fits
+        spread s;
+        bool fits = plan<Leaf>(e, lower_fence(&copy.page), up, s);
+        assert(fits);
+        (void)fits;
+        apply(s, e, nullptr, lower_fence(&copy.page), up, p, q);
+        q->next = p->next;
+        q->prev = p;
+        if (p->next != nullptr) {
+            p->next->prev = q;
+        } else {
+            last_leaf = q;
+        }
+        p->next = q;
+        sep = std::move(s.sep);
+        return q;
+    }
+
+    // Separator key with child c goes at pos of a full internal node
+    Inner* split_inner(Inner* p, unsigned int pos, std::string_view key, Node* c, std::string &sep) {
+        Inner* q = new_inner();
+        page_copy<Inner> copy(p);
+        std::vector<entry> e;
+        gather(&copy.page, e);
+        e.insert(e.begin() + pos, entry{std::string_view(), key, c});
+        std::string_view upper = upper_fence(&copy.page);
+        const std::string_view* up = copy.page.has_upper ? &upper : nullptr;
+        spread s;
+        bool fits = plan<Inner>(e, lower_fence(&copy.page), up, s);
+        assert(fits);
+        (void)fits;
+        apply(s, e, copy.page.first, lower_fence(&copy.page), up, p, q);
+        sep = std::move(s.sep);
+        return q;
+    }
+
+    // Insert key, absent from the subtree of p. Returns the new right
+    // sibling of p if p had to split, with its lower fence in sep.
+    Node* insert_rec(Node* p, std::string_view key, std::string &sep) {
+        if (p->leaf) {
+            Leaf* l = leaf(p);
+            std::string_view r = key.substr(l->prefix);
+            unsigned int pos = search(l, r, false);
+            if (reserve(l, sizeof(leaf_slot) + r.size())) {
+                insert_at(l, pos, entry{std::string_view(), key, nullptr});
+                return nullptr;
+            }
+            return split_leaf(l, pos, key, sep);
+        }
+        Inner* in = inner(p);
+        auto [c, i] = child_for(in, key);
+        std::string child_sep;
+        Node* sib = insert_rec(c, key, child_sep);
+        if (sib == nullptr) {
+            return nullptr;
+        }
+        if (reserve(in, sizeof(inner_slot) + child_sep.size() - in->prefix)) {
+            insert_at(in, i, entry{std::string_view(), child_sep, sib});
+            return nullptr;
+        }
+        return split_inner(in, i, child_sep, sib, sep);
+    }
+
+    // Child i of in is underfull. Merge it with a neighbour if the keys of
+    // both fit in a page, otherwise spread them evenly if in has room for
+    // the new separator.
+    template<typename N>
+    void rebalance(Inner* in, unsigned int i) {
+        constexpr bool is_leaf = std::is_same<N, Leaf>::value;
+        if (in->cnt == 0) {
+            // No neighbour, in is underfull itself and is fixed by its parent
+            return;
+        }
+        unsigned int li = i < in->cnt ? i : i - 1;
+        N* l = static_cast<N*>(child(in, li));
+        N* r = static_cast<N*>(child(in, li + 1));
+        page_copy<N> lc(l);
+        page_copy<N> rc(r);
+        std::vector<entry> e;
+        gather(&lc.page, e);
+        if constexpr (!is_leaf) {
+            // The separator between them comes down
+            e.push_back({prefix(in), rest(in, li), rc.page.first});
+        }
+        gather(&rc.page, e);
+        std::string_view lower = lower_fence(&lc.page);
+        std::string_view upper = upper_fence(&rc.page);
+        const std::string_view* up = rc.page.has_upper ? &upper : nullptr;
+        size_t pre = up != nullptr ? btree_detail::common_prefix(lower, upper) : 0;
+        size_t bytes = lower.size() + upper.size();
+        for (const entry &x : e) {
+            bytes += entry_bytes<N>(x, pre);
+        }
+        if (bytes <= capacity<N>()) {
+            build(l, lower, up, e.data(), e.size());
+            if constexpr (is_leaf) {
+                l->next = r->next;
+                if (r->next != nullptr) {
+                    r->next->prev = l;
+                } else {
+                    last_leaf = l;
+                }
+            } else {
+                l->first = lc.page.first;
+            }
+            erase_at(in, li);
+            free_node(r);
+            return;
+        }
+        if (e.size() < (is_leaf ? 2 : 3)) {
+            return;
+        }
+        spread s;
+        if (!plan<N>(e, lower, up, s)) {
+            return;
+        }
+        size_t len = s.sep.size() - in->prefix;
+        // The old separator is dropped first, so its bytes count as free
+        if (free_space(in) + in->garbage + rest(in, li).size() < len) {
+            return;
+        }
+        Node* first = nullptr;
+        if constexpr (!is_leaf) {
+            first = lc.page.first;
+        }
+        apply(s, e, first, lower, up, l, r);
+        erase_at(in, li);
+        reserve(in, sizeof(inner_slot) + len);
+        insert_at(in, li, entry{std::string_view(), s.sep, r});
+    }
+
+    // Erase key from the subtree of p, returns whether something was erased
+    bool erase_rec(Node* p, std::string_view key) {
+        if (p->leaf) {
+            Leaf* l = leaf(p);
+            std::string_view r = key.substr(l->prefix);
+            unsigned int pos = search(l, r, false);
+            if (pos == l->cnt || rest(l, pos) != r) {
+                return false;
+            }
+            erase_at(l, pos);
+            return true;
+        }
+        Inner* in = inner(p);
+        auto [c, i] = child_for(in, key);
+        if (!erase_rec(c, key)) {
+            return false;
+        }
+        if (c->leaf ? underfull(leaf(c)) : underfull(inner(c))) {
+            if (c->leaf) {
+                rebalance<Leaf>(in, i);
+            } else {
+                rebalance<Inner>(in, i);
+            }
+        }
+        return true;
+    }
+
+    [[noreturn]] static void invariant_failed(const char* what) {
+        throw std::logic_error(std::string("StringSet invariant violated: ") + what);
+    }
+
+    // Check the layout of page p, its fences against lower and upper, none
+    // for the rightmost page of a level, and its keys against the fences.
+    // Returns the keys of p.
+    template<typename N>
+    static std::vector<std::string> check_page(const N* p, std::string_view lower, const std::string* upper) {
+        size_t fences = p->lower_len + p->upper_len;
+        if (fences > capacity<N>() || p->heap > capacity<N>() - fences || p->cnt * sizeof(typename N::Slot) > p->heap) {
+            invariant_failed("a page overflows");
+        }
+        if (lower_fence(p) != lower || p->has_upper != (upper != nullptr)
+            || (upper != nullptr ? upper_fence(p) != *upper : p->upper_len != 0)) {
+            invariant_failed("fences aren't the separators above");
+        }
+        if (p->prefix != (upper != nullptr ? btree_detail::common_prefix(lower, *upper) : 0)) {
+            invariant_failed("the prefix isn't the one of the fences");
+        }
+        // Every byte between the heap and the fences belongs to a key or
+        // is garbage
+        size_t bytes = p->garbage;
+        std::vector<std::string> keys;
+        for (unsigned int i = 0; i < p->cnt; i++) {
+            const auto &slot = slots(p)[i];
+            if (slot.off < p->heap || slot.off + slot.len > capacity<N>() - fences) {
+                invariant_failed("a key is outside the key bytes");
+            }
+            bytes += slot.len;
+            if (slot.head != btree_detail::key_head(rest(p, i))) {
+                invariant_failed("a key head is wrong");
+            }
+            std::string k(prefix(p));
+            k.append(rest(p, i));
+            if (k < lower || (upper != nullptr && !(k < *upper)) || (i > 0 && !(keys.back() < k))) {
+                invariant_failed("keys are out of order");
+            }
+            keys.push_back(std::move(k));
+        }
+        if (bytes != capacity<N>() - fences - p->heap) {
+            invariant_failed("key bytes are lost");
+        }
+        return keys;
+    }
+
+    // Check the subtree of p at the given depth between the fences lower
+    // and upper. prev is the leaf before the subtree, on return its last
+    // leaf, and h is set to the depth of the leaves on the first one.
+    // Returns the number of keys.
+    size_t check_subtree(const Node* p, unsigned int depth, unsigned int &h, std::string_view lower, const std::string* upper,
+                         const Leaf* &prev) const {
+        if (p->leaf) {
+            const Leaf* l = static_cast<const Leaf*>(p);
+            check_page(l, lower, upper);
+            if (l->prev != prev || (prev == nullptr ? l != first_leaf : prev->next != l)) {
+                invariant_failed("the leaf chain is broken");
+            }
+            if (prev == nullptr) {
+                h = depth;
+            } else if (depth != h) {
+                invariant_failed("leaves are at different depths");
+            }
+            prev = l;
+            return l->cnt;
+        }
+        const Inner* in = inner(p);
+        std::vector<std::string> seps = check_page(in, lower, upper);
+        size_t total = 0;
+        for (unsigned int i = 0; i <= in->cnt; i++) {
+            // Child i holds the keys between separators i - 1 and i
+            total += check_subtree(child(in, i), depth + 1, h, i > 0 ? std::string_view(seps[i - 1]) : lower,
+                                   i < in->cnt ? &seps[i] : upper, prev);
+        }
+        return total;
+    }
+
+    static void check_key(std::string_view key) {
+        if (key.size() > max_key_size) {
+            throw std::length_error("StringSet: key is longer than max_key_size");
+        }
+    }
+
+public:
+    explicit StringSet(const Allocator &alloc = Allocator())
+        : leaf_alloc(alloc)
+        , inner_alloc(alloc)
+        , root(nullptr)
+        , first_leaf(nullptr)
+        , last_leaf(nullptr)
+        , sz(0) {}
+
+    template<typename Iter>
+    StringSet(Iter begin, Iter end, const Allocator &alloc = Allocator())
+        : StringSet(alloc) {
+        for (; begin != end; ++begin) {
+            insert(*begin);
+        }
+    }
+
+    StringSet(std::initializer_list<std::string_view> init, const Allocator &alloc = Allocator())
+        : StringSet(init.begin(), init.end(), alloc) {}
+
+    // Pages are copied as they are
+    StringSet(const StringSet &set)
+        : StringSet(std::allocator_traits<Allocator>::select_on_container_copy_construction(set.get_allocator())) {
+        if (set.root != nullptr) {
+            Leaf* prev = nullptr;
+            root = clone(set.root, prev);
+            last_leaf = prev;
+            for (first_leaf = prev; first_leaf->prev != nullptr; first_leaf = first_leaf->prev) {}
+            sz = set.sz;
+        }
+    }
+
+    StringSet(StringSet &&set) noexcept
+        : leaf_alloc(set.leaf_alloc)
+        , inner_alloc(set.inner_alloc)
+        , root(set.root)
+        , first_leaf(set.first_leaf)
+        , last_leaf(set.last_leaf)
+        , sz(set.sz) {
+        set.root = nullptr;
+        set.first_leaf = nullptr;
+        set.last_leaf = nullptr;
+        set.sz = 0;
+    }
+
+    StringSet &operator=(StringSet set) noexcept {
+        swap(set);
+        return *this;
+    }
+
+    ~StringSet() {
+        clear();
+    }
+
+    void swap(StringSet &set) noexcept {
+        std::swap(leaf_alloc, set.leaf_alloc);
+        std::swap(inner_alloc, set.inner_alloc);
+        std::swap(root, set.root);
+        std::swap(first_leaf, set.first_leaf);
+        std::swap(last_leaf, set.last_leaf);
+        std::swap(sz, set.sz);
+    }
+
+    Allocator get_allocator() const {
+        return Allocator(leaf_alloc);
+    }
+
+    key_compare key_comp() const {
+        return key_compare();
+    }
+
+    value_compare value_comp() const {
+        return value_compare();
+    }
+
+    void clear() {
+        if (root != nullptr) {
+            free_tree(root);
+            root = nullptr;
+        }
+        first_leaf = last_leaf = nullptr;
+        sz = 0;
+    }
+
+    bool empty() const {
+        return sz == 0;
+    }
+
+    size_t size() const {
+        return sz;
+    }
+
+    // Walk the whole tree and throw std::logic_error if its structure is
+    // broken: overlapping slots, key bytes and fences, lost bytes, fences
+    // which aren't the separators above, keys out of order or outside
+    // their fences, leaves at different depths, a broken leaf chain or a
+    // wrong size(). O(n), for tests and debugging.
+    void check_invariants() const {
+        if (root == nullptr) {
+            if (sz != 0 || first_leaf != nullptr || last_leaf != nullptr) {
+                invariant_failed("an empty set has leaves");
+            }
+            return;
+        }
+        const Leaf* prev = nullptr;
+        unsigned int h = 0;
+        size_t n = check_subtree(root, 0, h, std::string_view(), nullptr, prev);
+        if (prev != last_leaf || prev->next != nullptr) {
+            invariant_failed("the last leaf isn't the end leaf");
+        }
+        if (n != sz) {
+            invariant_failed("size() doesn't match the number of keys");
+        }
+    }
+
+    // Points to a (leaf, slot) pair like the iterator of Set
+    class iterator {
+        friend StringSet;
+
+    private:
+        const Leaf* ptr;
+        unsigned int slot;
+
+        iterator(const Leaf* p, unsigned int s)
+            : ptr(p)
+            , slot(s) {
+            skip_empty();
+        }
+
+        // Past the end of a leaf is the start of the next non-empty one,
+        // or the end of the last leaf
+        void skip_empty() {
+            while (ptr != nullptr && slot == ptr->cnt && ptr->next != nullptr) {
+                ptr = ptr->next;
+                slot = 0;
+            }
+        }
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = std::string;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = std::string;
+
+        iterator()
+            : ptr(nullptr)
+            , slot(0) {}
+
+        bool operator==(const iterator &iter) const {
+            return ptr == iter.ptr && slot == iter.slot;
+        }
+
+        bool operator!=(const iterator &iter) const {
+            return !(*this == iter);
+        }
+
+        std::string operator*() const {
+            std::string_view p = prefix(ptr);
+            std::string_view r = rest(ptr, slot);
+            std::string s;
+            s.reserve(p.size() + r.size());
+            s.append(p);
+            s.append(r);
+            return s;
+        }
+
+        iterator& operator++() {
+            slot++;
+            skip_empty();
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator ret = *this;
+            ++(*this);
+            return ret;
+        }
+
+        iterator& operator--() {
+            while (slot == 0) {
+                ptr = ptr->prev;
+                slot = ptr->cnt;
+            }
+            slot--;
+            return *this;
+        }
+
+        iterator operator--(int) {
+            iterator ret = *this;
+            --(*this);
+            return ret;
+        }
+    };
+
+    iterator begin() const {
+        return iterator(first_leaf, 0);
+    }
+
+    iterator end() const {
+        return iterator(last_leaf, last_leaf != nullptr ? last_leaf->cnt : 0);
+    }
+
+    // First key which is not less than key
+    iterator lower_bound(std::string_view key) const {
+        if (root == nullptr) {
+            return end();
+        }
+        const Node* p = root;
+        while (!p->leaf) {
+            p = child_for(static_cast<const Inner*>(p), key).first;
+        }
+        const Leaf* l = static_cast<const Leaf*>(p);
+        return iterator(l, search(l, key.substr(l->prefix), false));
+    }
+
+    iterator find(std::string_view key) const {
+        iterator it = lower_bound(key);
+        if (it == end() || !equal(it.ptr, it.slot, key)) {
+            return end();
+        }
+        return it;
+    }
+
+    bool contains(std::string_view key) const {
+        return find(key) != end();
+    }
+
+    size_t count(std::string_view key) const {
+        return contains(key);
+    }
+
+    // Returns whether key was inserted
+    bool insert(std::string_view key) {
+        check_key(key);
+        if (root == nullptr) {
+            Leaf* l = new_leaf();
+            build(l, std::string_view(), nullptr, nullptr, 0);
+            root = first_leaf = last_leaf = l;
+        } else if (contains(key)) {
+            return false;
+        }
+        std::string sep;
+        if (Node* sib = insert_rec(root, key, sep)) {
+            Inner* r = new_inner();
+            build(r, std::string_view(), nullptr, nullptr, 0);
+            r->first = root;
+            insert_at(r, 0, entry{std::string_view(), sep, sib});
+            root = r;
+        }
+        sz++;
+        return true;
+    }
+
+    // Returns the number of erased keys
+    size_t erase(std::string_view key) {
+        if (root == nullptr || !erase_rec(root, key)) {
+            return 0;
+        }
+        sz--;
+        if (sz == 0) {
+            clear();
+        } else if (!root->leaf && root->cnt == 0) {
+            // Root with a single child, the child becomes the root
+            Node* c = inner(root)->first;
+            free_node(root);
+            root = c;
+        }
+        return 1;
+    }
+};
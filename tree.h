@@ -1,395 +1,3455 @@
 // B-tree
 // https://en.wikipedia.org/wiki/B-tree
+#pragma once
 
 #include <memory>
 #include <vector>
 #include <cstddef>
 #include <iostream>
+#include <new>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <functional>
+#include <iterator>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <system_error>
+#include <stdexcept>
+#include <fstream>
+#include <string>
+#include <cstring>
+
+#if defined(__cpp_impl_three_way_comparison) && __has_include(<compare>)
+#include <compare>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Pool of fixed-size blocks carved out of big chunks. Freed blocks go to a
+// per-size free list and are reused, chunks are returned to the system all
+// at once when the pool is destroyed. Not thread-safe.
+class node_pool {
+public:
+    explicit node_pool(size_t chunk_blocks = 256)
+        : chunk_blocks(chunk_blocks) {}
+
+    node_pool(const node_pool&) = delete;
+    node_pool &operator=(const node_pool&) = delete;
+
+    ~node_pool() {
+        for (void* c : chunks) {
+            ::operator delete(c);
+        }
+    }
+
+    void* allocate(size_t size) {
+        Bucket &b = bucket(size);
+        if (b.free == nullptr) {
+            refill(b);
+        }
+        void* p = b.free;
+        b.free = *static_cast<void**>(p);
+        return p;
+    }
+
+    void deallocate(void* p, size_t size) {
+        Bucket &b = bucket(size);
+        *static_cast<void**>(p) = b.free;
+        b.free = p;
+    }
+
+    // Number of chunks requested from the system so far
+    size_t chunk_count() const {
+        return chunks.size();
+    }
+
+private:
+    struct Bucket {
+        size_t size;
+        void* free;
+    };
+
+    size_t chunk_blocks;
+    // A set only asks for a couple of block sizes, so a linear search is enough
+    std::vector<Bucket> buckets;
+    std::vector<void*> chunks;
+
+    Bucket &bucket(size_t size) {
+        const size_t align = alignof(std::max_align_t);
+        size = std::max(size, sizeof(void*));
+        size = (size + align - 1) / align * align;
+        for (auto &b : buckets) {
+            if (b.size == size) {
+                return b;
+            }
+        }
+        buckets.push_back({size, nullptr});
+        return buckets.back();
+    }
+
+    void refill(Bucket &b) {
+        char* c = static_cast<char*>(::operator new(b.size * chunk_blocks));
+        chunks.push_back(c);
+        for (size_t i = chunk_blocks; i-- > 0;) {
+            deallocate(c + i * b.size, b.size);
+        }
+    }
+};
+
+// Allocator handing out blocks from a node_pool. A default-constructed
+// allocator owns a fresh pool, copies and rebound copies share it.
+// Allocations of more than one object bypass the pool.
+template<typename T>
+class pool_allocator {
+    template<typename U>
+    friend class pool_allocator;
+
+    static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types are not supported");
+
+public:
+    using value_type = T;
+    // Nodes belong to the pool, so a set moved or swapped together with
+    // its nodes has to take the pool along
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    pool_allocator()
+        : pool(std::make_shared<node_pool>()) {}
+
+    explicit pool_allocator(std::shared_ptr<node_pool> pool)
+        : pool(std::move(pool)) {}
+
+    template<typename U>
+    pool_allocator(const pool_allocator<U> &other)
+        : pool(other.pool) {}
+
+    // Only single objects, the nodes, come from the pool. Arrays of any
+    // other length would each get a bucket of their own that is never
+    // given back, so they go to operator new.
+    T* allocate(size_t n) {
+        if (n != 1) {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T*>(pool->allocate(sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n != 1) {
+            ::operator delete(p);
+            return;
+        }
+        pool->deallocate(p, sizeof(T));
+    }
+
+    template<typename U>
+    bool operator==(const pool_allocator<U> &other) const {
+        return pool == other.pool;
+    }
+
+    template<typename U>
+    bool operator!=(const pool_allocator<U> &other) const {
+        return pool != other.pool;
+    }
+
+private:
+    std::shared_ptr<node_pool> pool;
+};
+
+namespace btree_detail {
+
+// Number of keys in k[0, n) which are less than x, keys are sorted.
+// Branchless binary search, the comparison result selects the next half
+// without a jump, so a probe costs no branch mispredictions.
+template<typename T, typename K, typename Compare>
+unsigned int count_less(const T* k, unsigned int n, const K &x, const Compare &comp) {
+    if (n == 0) {
+        return 0;
+    }
+    const T* base = k;
+    while (n > 1) {
+        unsigned int half = n / 2;
+        base = comp(base[half - 1], x) ? base + half : base;
+        n -= half;
+    }
+    return (base - k) + comp(*base, x);
+}
+
+// Linear compare-and-count over a short window of arithmetic keys. Every
+// element is compared, which the compiler turns into vector code.
+template<typename T>
+unsigned int count_less_linear(const T* k, unsigned int n, T x) {
+    unsigned int res = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        res += k[i] < x;
+    }
+    return res;
+}
+
+#if defined(__AVX2__)
+inline unsigned int count_less_linear(const int32_t* k, unsigned int n, int32_t x) {
+    __m256i xv = _mm256_set1_epi32(x);
+    unsigned int res = 0, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i kv = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(k + i));
+        res += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(xv, kv))));
+    }
+    return res + count_less_linear<int32_t>(k + i, n - i, x);
+}
+
+inline unsigned int count_less_linear(const int64_t* k, unsigned int n, int64_t x) {
+    __m256i xv = _mm256_set1_epi64x(x);
+    unsigned int res = 0, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i kv = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(k + i));
+        res += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(xv, kv))));
+    }
+    return res + count_less_linear<int64_t>(k + i, n - i, x);
+}
+
+inline unsigned int count_less_linear(const float* k, unsigned int n, float x) {
+    __m256 xv = _mm256_set1_ps(x);
+    unsigned int res = 0, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 kv = _mm256_loadu_ps(k + i);
+        res += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(kv, xv, _CMP_LT_OQ)));
+    }
+    return res + count_less_linear<float>(k + i, n - i, x);
+}
+
+inline unsigned int count_less_linear(const double* k, unsigned int n, double x) {
+    __m256d xv = _mm256_set1_pd(x);
+    unsigned int res = 0, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d kv = _mm256_loadu_pd(k + i);
+        res += __builtin_popcount(_mm256_movemask_pd(_mm256_cmp_pd(kv, xv, _CMP_LT_OQ)));
+    }
+    return res + count_less_linear<double>(k + i, n - i, x);
+}
+#elif defined(__SSE2__)
+inline unsigned int count_less_linear(const int32_t* k, unsigned int n, int32_t x) {
+    __m128i xv = _mm_set1_epi32(x);
+    unsigned int res = 0, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i kv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(k + i));
+        res += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(xv, kv))));
+    }
+    return res + count_less_linear<int32_t>(k + i, n - i, x);
+}
+
+#if defined(__SSE4_2__)
+inline unsigned int count_less_linear(const int64_t* k, unsigned int n, int64_t x) {
+    __m128i xv = _mm_set1_epi64x(x);
+    unsigned int res = 0, i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i kv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(k + i));
+        res += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(xv, kv))));
+    }
+    return res + count_less_linear<int64_t>(k + i, n - i, x);
+}
+#endif
+
+inline unsigned int count_less_linear(const float* k, unsigned int n, float x) {
+    __m128 xv = _mm_set1_ps(x);
+    unsigned int res = 0, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        res += __builtin_popcount(_mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(k + i), xv)));
+    }
+    return res + count_less_linear<float>(k + i, n - i, x);
+}
+
+inline unsigned int count_less_linear(const double* k, unsigned int n, double x) {
+    __m128d xv = _mm_set1_pd(x);
+    unsigned int res = 0, i = 0;
+    for (; i + 2 <= n; i += 2) {
+        res += __builtin_popcount(_mm_movemask_pd(_mm_cmplt_pd(_mm_loadu_pd(k + i), xv)));
+    }
+    return res + count_less_linear<double>(k + i, n - i, x);
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+// Lanes of a NEON comparison are all ones for true, subtracting them counts
+inline unsigned int count_less_linear(const int32_t* k, unsigned int n, int32_t x) {
+    int32x4_t xv = vdupq_n_s32(x);
+    int32x4_t acc = vdupq_n_s32(0);
+    unsigned int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = vsubq_s32(acc, vreinterpretq_s32_u32(vcltq_s32(vld1q_s32(k + i), xv)));
+    }
+    return vaddvq_s32(acc) + count_less_linear<int32_t>(k + i, n - i, x);
+}
+
+inline unsigned int count_less_linear(const int64_t* k, unsigned int n, int64_t x) {
+    int64x2_t xv = vdupq_n_s64(x);
+    int64x2_t acc = vdupq_n_s64(0);
+    unsigned int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        acc = vsubq_s64(acc, vreinterpretq_s64_u64(vcltq_s64(vld1q_s64(k + i), xv)));
+    }
+    return vaddvq_s64(acc) + count_less_linear<int64_t>(k + i, n - i, x);
+}
+
+inline unsigned int count_less_linear(const float* k, unsigned int n, float x) {
+    float32x4_t xv = vdupq_n_f32(x);
+    int32x4_t acc = vdupq_n_s32(0);
+    unsigned int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = vsubq_s32(acc, vreinterpretq_s32_u32(vcltq_f32(vld1q_f32(k + i), xv)));
+    }
+    return vaddvq_s32(acc) + count_less_linear<float>(k + i, n - i, x);
+}
+
+inline unsigned int count_less_linear(const double* k, unsigned int n, double x) {
+    float64x2_t xv = vdupq_n_f64(x);
+    int64x2_t acc = vdupq_n_s64(0);
+    unsigned int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        acc = vsubq_s64(acc, vreinterpretq_s64_u64(vcltq_f64(vld1q_f64(k + i), xv)));
+    }
+    return vaddvq_s64(acc) + count_less_linear<double>(k + i, n - i, x);
+}
+#endif
+
+// Keys which have a compare-and-count kernel
+template<typename T>
+struct simd_searchable : std::integral_constant<bool,
+    std::is_same<T, int32_t>::value || std::is_same<T, int64_t>::value ||
+    std::is_same<T, float>::value || std::is_same<T, double>::value> {};
+
+// Comparators which order keys with the builtin operator<
+template<typename Compare, typename T>
+struct builtin_order : std::integral_constant<bool,
+    std::is_same<Compare, std::less<T>>::value || std::is_same<Compare, std::less<>>::value> {};
+
+// Below this many keys a linear vector scan beats halving the range
+constexpr unsigned int linear_window = 32;
+
+// Position of the first key in k[0, n) which is not less than x
+template<typename T, typename K, typename Compare>
+unsigned int lower_bound(const T* k, unsigned int n, const K &x, const Compare &comp) {
+    if constexpr (simd_searchable<T>::value && std::is_same<T, K>::value && builtin_order<Compare, T>::value) {
+        // Narrow the range with binary search, then count inside the window
+        const T* base = k;
+        while (n > linear_window) {
+            unsigned int half = n / 2;
+            base = base[half - 1] < x ? base + half : base;
+            n -= half;
+        }
+        return (base - k) + count_less_linear(base, n, x);
+    } else {
+        return count_less(k, n, x, comp);
+    }
+}
+
+template<typename Compare, typename L, typename R>
+using compare_result = decltype(std::declval<const Compare&>()(std::declval<const L&>(), std::declval<const R&>()));
+
+template<typename L, typename R, typename = void>
+struct has_compare_member : std::false_type {};
+
+template<typename L, typename R>
+struct has_compare_member<L, R, std::void_t<decltype(int(std::declval<const L&>().compare(std::declval<const R&>())))>>
+    : std::true_type {};
+
+template<typename L, typename R, typename = void>
+struct has_spaceship : std::false_type {};
+
+#if defined(__cpp_impl_three_way_comparison) && __has_include(<compare>)
+template<typename L, typename R>
+struct has_spaceship<L, R, std::void_t<decltype(std::declval<const L&>() <=> std::declval<const R&>())>>
+    : std::true_type {};
+#endif
+
+// How Compare orders an L against an R. A comparator returning anything
+// but bool is three-way: the result is negative, zero or positive like
+// strcmp, or a C++20 ordering. The default order of a class with a
+// compare() member (std::string) or operator<=> is three-way as well.
+// For three-way orders compare() tells less, equal and greater apart with
+// a single comparison.
+template<typename Compare, typename L, typename R>
+struct key_order {
+    static constexpr bool user_three_way = !std::is_same<std::decay_t<compare_result<Compare, L, R>>, bool>::value;
+    static constexpr bool member_compare =
+        !user_three_way && builtin_order<Compare, L>::value && has_compare_member<L, R>::value;
+    static constexpr bool spaceship = !user_three_way && !member_compare && builtin_order<Compare, L>::value &&
+        std::is_class<L>::value && has_spaceship<L, R>::value;
+    static constexpr bool three_way = user_three_way || member_compare || spaceship;
+
+    static bool less(const Compare &comp, const L &a, const R &b) {
+        if constexpr (user_three_way) {
+            return comp(a, b) < 0;
+        } else {
+            return comp(a, b);
+        }
+    }
+
+    static auto compare(const Compare &comp, const L &a, const R &b) {
+        if constexpr (user_three_way) {
+            return comp(a, b);
+        } else if constexpr (member_compare) {
+            return a.compare(b);
+        } else {
+#if defined(__cpp_impl_three_way_comparison) && __has_include(<compare>)
+            return a <=> b;
+#endif
+        }
+    }
+};
+
+struct search_result {
+    unsigned int pos;
+    bool eq;
+};
+
+// Binary search with a three-way comparison, stops at an equal key
+template<typename T, typename K, typename Cmp>
+search_result search_three_way(const T* k, unsigned int n, const K &x, Cmp cmp) {
+    unsigned int lo = 0;
+    unsigned int hi = n;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        auto c = cmp(k[mid], x);
+        if (c < 0) {
+            lo = mid + 1;
+        } else if (c == 0) {
+            return {mid, true};
+        } else {
+            hi = mid;
+        }
+    }
+    return {lo, false};
+}
+
+// Stores a comparator, as an empty base when it has no state
+template<typename Compare, bool = std::is_empty<Compare>::value && !std::is_final<Compare>::value>
+class compare_holder : private Compare {
+public:
+    compare_holder(const Compare &comp)
+        : Compare(comp) {}
+
+    const Compare &comp() const {
+        return *this;
+    }
+};
+
+template<typename Compare>
+class compare_holder<Compare, false> {
+public:
+    compare_holder(const Compare &comp)
+        : c(comp) {}
+
+    const Compare &comp() const {
+        return c;
+    }
+
+private:
+    Compare c;
+};
+
+
+// Keys per block of a FrozenSet unless given
+constexpr unsigned int frozen_fanout = 16;
+
+// Smallest number of keys worth a thread of its own
+constexpr size_t parallel_grain = 4096;
+
+// Lookups of a batch which descend together, each level of each of them
+// is prefetched while the others are searched. Enough to overlap the
+// misses of one level without running out of fill buffers.
+constexpr unsigned int batch_group = 16;
+
+// Cache lines of a node prefetched ahead of its search
+constexpr size_t prefetch_lines = 8;
+
+// Hint the cache to load the first bytes at p, clipped to prefetch_lines
+inline void prefetch(const void* p, size_t bytes) {
+#if defined(__GNUC__) || defined(__clang__)
+    const char* c = static_cast<const char*>(p);
+    for (size_t off = 0; off < bytes && off < prefetch_lines * 64; off += 64) {
+        __builtin_prefetch(c + off);
+    }
+#else
+    (void)p;
+    (void)bytes;
+#endif
+}
+
+// Number of threads for units pieces of work, 0 requests one per core
+inline unsigned int thread_count(unsigned int requested, size_t units) {
+    if (requested == 0) {
+        requested = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    return static_cast<unsigned int>(std::max<size_t>(std::min<size_t>(requested, units), 1));
+}
+
+// Run f(0), ..., f(n - 1) each on its own thread, f(0) on the calling one.
+// If no more threads can be started the rest runs on the calling thread
+// too. The first exception thrown is rethrown once all of them finished.
+template<typename F>
+void parallel_for(unsigned int n, const F &f) {
+    if (n == 0) {
+        return;
+    }
+    std::vector<std::exception_ptr> errors(n);
+    auto run = [&](unsigned int i) {
+        try {
+            f(i);
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> pool;
+    unsigned int started = 1;
+    try {
+        for (; started < n; started++) {
+            pool.emplace_back(run, started);
+        }
+    } catch (const std::system_error&) {}
+    for (unsigned int i = started; i < n; i++) {
+        run(i);
+    }
+    run(0);
+    for (std::thread &t : pool) {
+        t.join();
+    }
+    for (std::exception_ptr &e : errors) {
+        if (e) {
+            std::rethrow_exception(e);
+        }
+    }
+}
+
+}
+
+namespace btree_detail {
+
+// On-disk format written by Set::save() and read by MappedSet: a header,
+// then the internal pages level by level from the root down, then the
+// leaf pages in key order. Pages of a kind have a fixed size and refer to
+// their children by offset from the start of the file, so the file is
+// searched in place once mapped. Integers and keys are stored in the byte
+// order of the machine that wrote them.
+constexpr char disk_magic[8] = {'B', 'T', 'R', 'E', 'E', 'S', 'E', 'T'};
+constexpr uint32_t disk_version = 1;
+constexpr uint32_t disk_byte_order = 0x01020304;
+
+struct alignas(64) disk_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t b;
+    uint32_t key_size;
+    uint32_t key_align;
+    // Number of internal levels, pages below that depth are leaves
+    uint32_t height;
+    uint64_t size;
+    // Offset of the root page, 0 for an empty set
+    uint64_t root;
+    uint64_t first_leaf;
+    uint64_t leaves;
+};
+
+template<typename T, unsigned int B>
+struct alignas(64) disk_leaf {
+    uint32_t cnt;
+    alignas(T) unsigned char keys[2 * B * sizeof(T)];
+};
+
+template<typename T, unsigned int B>
+struct alignas(64) disk_inner {
+    uint32_t cnt;
+    uint64_t children[2 * B];
+    alignas(T) unsigned char keys[2 * B * sizeof(T)];
+};
+
+}
+
+// Tag for constructors taking input that is already sorted
+struct sorted_unique_t {
+    explicit sorted_unique_t() = default;
+};
+
+inline constexpr sorted_unique_t sorted_unique{};
+
+// Optional features of Set, selected at compile time. Derive from
+// default_policy and override the flags to turn them on, a feature that
+// is off adds no members and no work.
+struct default_policy {
+    // Keep the number of keys below every child of an internal node, for
+    // rank(), select() and distance() in O(log n)
+    static constexpr bool order_statistics = false;
+    // Allow equal keys, like std::multiset. Equal keys sit next to each
+    // other in the leaves, a new one goes after those already present.
+    static constexpr bool multi = false;
+    // Type of the values kept next to the keys in the leaves, void for a
+    // set. Map sets it, see map_tree.h.
+    using mapped_type = void;
+    // Count comparisons, node visits, rebalancing and allocations in
+    // operation_counters, see Set::counters()
+    static constexpr bool instrumentation = false;
+};
+
+struct order_statistics_policy : default_policy {
+    static constexpr bool order_statistics = true;
+};
+
+struct instrumentation_policy : default_policy {
+    static constexpr bool instrumentation = true;
+};
+
+// Work done by an instrumented Set since it was created or its counters
+// were reset. The counts of one operation are the difference of the
+// counters taken before and after it.
+struct operation_counters {
+    // Key comparisons, those of vectorized node searches included
+    uint64_t comparisons = 0;
+    // Nodes passed on descents from the root
+    uint64_t node_visits = 0;
+    // Nodes split because they were full, one per node created
+    uint64_t splits = 0;
+    // Nodes merged into a sibling
+    uint64_t merges = 0;
+    // Underfull nodes which took keys or children from a sibling instead
+    uint64_t steals = 0;
+    uint64_t allocations = 0;
+    uint64_t deallocations = 0;
+
+    operation_counters operator-(const operation_counters &c) const {
+        operation_counters res;
+        res.comparisons = comparisons - c.comparisons;
+        res.node_visits = node_visits - c.node_visits;
+        res.splits = splits - c.splits;
+        res.merges = merges - c.merges;
+        res.steals = steals - c.steals;
+        res.allocations = allocations - c.allocations;
+        res.deallocations = deallocations - c.deallocations;
+        return res;
+    }
+};
+
+// Shape of a Set, see Set::stats()
+struct tree_stats {
+    // Number of levels, 1 for a single leaf and 0 for an empty set
+    unsigned int height = 0;
+    // Nodes on every level from the root down, the last one are the leaves
+    std::vector<size_t> level_nodes;
+    size_t leaves = 0;
+    size_t inner_nodes = 0;
+    // Keys or children over the capacity of the nodes, 2 * B each
+    double fill = 0;
+    // Same for the leaves alone
+    double leaf_fill = 0;
+    // Memory of all nodes
+    size_t bytes = 0;
+};
+
+namespace btree_detail {
+
+// Policy with equal keys allowed on top of another one
+template<typename Policy>
+struct multi_policy : Policy {
+    static constexpr bool multi = true;
+};
+
+// Number of comparisons of lower_bound() on n keys. Both of its searches
+// compare a fixed number of times for a given n.
+template<typename T, typename K, typename Compare>
+constexpr unsigned int lower_bound_comparisons(unsigned int n) {
+    unsigned int res = 0;
+    if constexpr (simd_searchable<T>::value && std::is_same<T, K>::value && builtin_order<Compare, T>::value) {
+        for (; n > linear_window; n -= n / 2) {
+            res++;
+        }
+        return res + n;
+    } else {
+        if (n == 0) {
+            return 0;
+        }
+        for (; n > 1; n -= n / 2) {
+            res++;
+        }
+        return res + 1;
+    }
+}
+
+// Fields of operation_counters
+enum class counter {
+    comparisons,
+    node_visits,
+    splits,
+    merges,
+    steals,
+    allocations,
+    deallocations,
+    count,
+};
+
+// Counters of a Set, empty when instrumentation is off
+template<bool Enabled>
+class counter_holder {
+protected:
+    void tick(counter, uint64_t = 1) const {}
+};
+
+// The counters are bumped in const operations too, possibly on several
+// threads at once. Relaxed loads and stores keep that defined and cost
+// no more than plain ones, concurrent bumps may get lost.
+template<>
+class counter_holder<true> {
+public:
+    counter_holder() {}
+
+    // A copy counts its own work from zero
+    counter_holder(const counter_holder&) {}
+
+    counter_holder &operator=(const counter_holder&) {
+        return *this;
+    }
+
+    operation_counters counters() const {
+        operation_counters res;
+        res.comparisons = get(counter::comparisons);
+        res.node_visits = get(counter::node_visits);
+        res.splits = get(counter::splits);
+        res.merges = get(counter::merges);
+        res.steals = get(counter::steals);
+        res.allocations = get(counter::allocations);
+        res.deallocations = get(counter::deallocations);
+        return res;
+    }
+
+    void reset_counters() {
+        for (std::atomic<uint64_t> &v : values) {
+            v.store(0, std::memory_order_relaxed);
+        }
+    }
+
+protected:
+    void tick(counter c, uint64_t n = 1) const {
+        std::atomic<uint64_t> &v = values[static_cast<size_t>(c)];
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+private:
+    mutable std::atomic<uint64_t> values[static_cast<size_t>(counter::count)] = {};
+
+    uint64_t get(counter c) const {
+        return values[static_cast<size_t>(c)].load(std::memory_order_relaxed);
+    }
+};
+
+}
+
+namespace btree_detail {
+
+// Subtree sizes of the children of an internal node, empty when disabled
+template<unsigned int N, bool Enabled>
+struct child_counts {};
+
+template<unsigned int N>
+struct child_counts<N, true> {
+    size_t counts[N];
+};
+
+// Values of a leaf stored inline like its keys, empty for a set
+template<typename V, unsigned int N, bool = std::is_void<V>::value>
+struct leaf_values {
+    alignas(V) unsigned char value_storage[N * sizeof(V)];
+
+    V* values() {
+        return reinterpret_cast<V*>(value_storage);
+    }
+
+    const V* values() const {
+        return reinterpret_cast<const V*>(value_storage);
+    }
+};
+
+template<typename V, unsigned int N>
+struct leaf_values<V, N, true> {};
+
+
+// Same layout as the internal node of Set<T, B> (checked there), so that
+// the node size can be computed without instantiating Set
+template<typename T, unsigned int B, bool OrderStatistics>
+struct inner_layout_header {
+    void* parent;
+    unsigned int cnt;
+    unsigned int pos;
+    bool leaf;
+    alignas(T) unsigned char storage[2 * B * sizeof(T)];
+};
+
+template<typename T, unsigned int B, bool OrderStatistics>
+struct inner_layout : inner_layout_header<T, B, OrderStatistics>, child_counts<2 * B, OrderStatistics> {
+    void* children[2 * B];
+};
+
+// Largest B from Guess down to 2 whose internal node fits into Bytes
+template<typename T, unsigned int Guess, size_t Bytes, bool OrderStatistics>
+constexpr unsigned int fit_fanout() {
+    if constexpr (Guess <= 2 || sizeof(inner_layout<T, Guess, OrderStatistics>) <= Bytes) {
+        return Guess < 2 ? 2 : Guess;
+    } else {
+        return fit_fanout<T, Guess - 1, Bytes, OrderStatistics>();
+    }
+}
+
+}
+
+// Bytes in a cache line, the unit for sizing nodes
+inline constexpr size_t cache_line_size = 64;
+
+// The B for which an internal node of Set<T, B, ..., Policy> fills at most
+// Bytes: a few cache lines to keep searches in cache, or a 4 KiB page for
+// big sets. A node holds 2 * B separators and child pointers, plus the
+// subtree sizes with order statistics. Use as
+// Set<T, auto_fanout<T, 256>::value>.
+template<typename T, size_t Bytes = 4 * cache_line_size, typename Policy = default_policy>
+struct auto_fanout {
+private:
+    static constexpr size_t per_b =
+        2 * (sizeof(T) + sizeof(void*) + (Policy::order_statistics ? sizeof(size_t) : 0));
+    // Upper bound ignoring the node header, fit_fanout() steps down from it
+    static constexpr unsigned int guess = static_cast<unsigned int>(Bytes / per_b);
+
+public:
+    static constexpr unsigned int value = btree_detail::fit_fanout<T, guess, Bytes, Policy::order_statistics>();
+
+    static_assert(value >= 2, "a node has at least two keys");
+    static_assert(value == 2 || sizeof(btree_detail::inner_layout<T, value, Policy::order_statistics>) <= Bytes,
+                  "internal node doesn't fit into the target size");
+    static_assert(sizeof(btree_detail::inner_layout<T, value + 1, Policy::order_statistics>) > Bytes,
+                  "a larger B would still fit");
+};
+
+template<typename T, size_t Bytes = 4 * cache_line_size, typename Policy = default_policy>
+inline constexpr unsigned int auto_fanout_v = auto_fanout<T, Bytes, Policy>::value;
+
+// Nodes are allocated with Allocator rebound to the leaf and internal node
+// types, one block per node:
+//  - insert allocates only when it splits, one node per split vertex plus
+//    one for a new root
+//  - erase frees one node per merge and one when the root is removed
+//  - copying allocates every node of the copy, clear() and the destructor
+//    free every node
+// With pool_allocator the system allocator is called once per chunk of
+// blocks, and freed nodes are kept for reuse until the last set sharing
+// the pool is destroyed.
+//
+// Compare is a strict weak order like for std::set. A transparent one
+// (std::less<>) lets lookups take any type ordered against T, e.g.
+// std::string_view for a set of std::string. A three-way comparator
+// (see btree_detail::key_order) is called once per probe for both search
+// and the equality test.
+//
+// Policy selects optional features, see default_policy.
+template<typename K, typename V, unsigned int B, typename Compare, typename Allocator, typename Policy>
+class Map;
+
+// Read-only copy of a Set in one array, see frozen_tree.h
+template<typename T, unsigned int B, typename Compare, typename Allocator>
+class FrozenSet;
+
+template<typename T, unsigned int B = 2, typename Compare = std::less<T>, typename Allocator = std::allocator<T>, typename Policy = default_policy>
+class Set : private btree_detail::compare_holder<Compare>, private btree_detail::counter_holder<Policy::instrumentation> {
+    static_assert(B >= 2, "B must be at least 2");
+
+    using CompareHolder = btree_detail::compare_holder<Compare>;
+    using CounterHolder = btree_detail::counter_holder<Policy::instrumentation>;
+    using counter = btree_detail::counter;
+
+    static constexpr bool order_statistics = Policy::order_statistics;
+    static constexpr bool multi = Policy::multi;
+    static constexpr bool instrumentation = Policy::instrumentation;
+
+    using Value = typename Policy::mapped_type;
+    static constexpr bool has_values = !std::is_void<Value>::value;
+    static_assert(!(multi && has_values), "maps with equal keys are not supported");
+
+    template<typename, typename, unsigned int, typename, typename, typename>
+    friend class Map;
+
+public:
+    using value_type = T;
+    using key_compare = Compare;
+    using value_compare = Compare;
+
+    class iterator;
 
-template<typename T, unsigned int B = 2>
-class Set {
 private:
+    // Keys are stored inline in sorted order. A leaf holds up to 2 * B
+    // elements, an internal node holds the maximum of every child, so the
+    // separators of a node are contiguous and searched without touching
+    // the children.
     struct Node {
         Node* parent;
-        std::vector<std::unique_ptr<Node>> children;
-        std::unique_ptr<const T> data;
-        const T* mx;
+        // Number of keys, for an internal node also the number of children
+        unsigned int cnt;
+        // Index of the node in the children of its parent
+        unsigned int pos;
+        bool leaf;
+        alignas(T) unsigned char storage[2 * B * sizeof(T)];
 
-        Node()
+        Node(bool is_leaf)
             : parent(nullptr)
-            , data(nullptr)
-            , mx(nullptr) {}
+            , cnt(0)
+            , pos(0)
+            , leaf(is_leaf) {}
+
+        ~Node() {
+            for (unsigned int i = 0; i < cnt; i++) {
+                keys()[i].~T();
+            }
+        }
+
+        T* keys() {
+            return reinterpret_cast<T*>(storage);
+        }
+
+        const T* keys() const {
+            return reinterpret_cast<const T*>(storage);
+        }
+
+        const T& max() const {
+            return keys()[cnt - 1];
+        }
+
+        // Insert a key at position pos, shifting the tail right
+        template<typename U>
+        void insert_key(unsigned int pos, U&& elem) {
+            T* k = keys();
+            if (pos == cnt) {
+                new (k + cnt) T(std::forward<U>(elem));
+            } else {
+                new (k + cnt) T(std::move(k[cnt - 1]));
+                std::move_backward(k + pos, k + cnt - 1, k + cnt);
+                k[pos] = std::forward<U>(elem);
+            }
+            cnt++;
+        }
+
+        // Remove the key at position pos, shifting the tail left
+        void erase_key(unsigned int pos) {
+            T* k = keys();
+            std::move(k + pos + 1, k + cnt, k + pos);
+            cnt--;
+            k[cnt].~T();
+        }
+    };
+
+    // Internal node, owns up to 2 * B children stored inline. With order
+    // statistics the subtree sizes sit next to the children, so rank and
+    // select read them without touching the children.
+    struct Inner : Node, btree_detail::child_counts<2 * B, order_statistics> {
+        Node* children[2 * B];
+
+        Inner()
+            : Node(false) {}
+
+        // Insert a child at position pos, its maximum becomes the separator
+        void insert(unsigned int pos, Node* child) {
+            std::move_backward(children + pos, children + this->cnt, children + this->cnt + 1);
+            children[pos] = child;
+            this->insert_key(pos, child->max());
+            adopt(pos);
+        }
+
+        // Insert a child with an already known separator
+        void insert(unsigned int pos, Node* child, T&& sep) {
+            std::move_backward(children + pos, children + this->cnt, children + this->cnt + 1);
+            children[pos] = child;
+            this->insert_key(pos, std::move(sep));
+            adopt(pos);
+        }
+
+        // Remove the child at position pos, shifting the tail left
+        void erase(unsigned int pos) {
+            std::move(children + pos + 1, children + this->cnt, children + pos);
+            this->erase_key(pos);
+            adopt(pos);
+        }
+
+        // Set parent, position and subtree size of the children starting from from
+        void adopt(unsigned int from) {
+            for (unsigned int j = from; j < this->cnt; j++) {
+                children[j]->parent = this;
+                children[j]->pos = j;
+                if constexpr (order_statistics) {
+                    this->counts[j] = subtree_size(children[j]);
+                }
+            }
+        }
+    };
+
+    static_assert(sizeof(Inner) == sizeof(btree_detail::inner_layout<T, B, order_statistics>) &&
+                  alignof(Inner) == alignof(btree_detail::inner_layout<T, B, order_statistics>),
+                  "btree_detail::inner_layout must match Inner");
+
+    // Leaf page, stores up to 2 * B elements, and for a map their values
+    // in the same slots
+    // Leaves are chained in key order, iteration walks along the chain
+    struct Leaf : Node, btree_detail::leaf_values<Value, 2 * B> {
+        Leaf* prev;
+        Leaf* next;
+
+        Leaf()
+            : Node(true)
+            , prev(nullptr)
+            , next(nullptr) {}
 
-        Node(T elem, Node* par)
-            : parent(par)
-            , data(new T(elem)) {
-            mx = data.get();
+        ~Leaf() {
+            if constexpr (has_values) {
+                for (unsigned int i = 0; i < this->cnt; i++) {
+                    this->values()[i].~Value();
+                }
+            }
+        }
+
+        // Put a new leaf right after this one in the chain
+        void link_after(Leaf* p) {
+            p->prev = this;
+            p->next = next;
+            if (next != nullptr) {
+                next->prev = p;
+            }
+            next = p;
+        }
+
+        // Take this leaf out of the chain
+        void unlink() {
+            if (prev != nullptr) {
+                prev->next = next;
+            }
+            if (next != nullptr) {
+                next->prev = prev;
+            }
+        }
+    };
+
+    using LeafAlloc = typename std::allocator_traits<Allocator>::template rebind_alloc<Leaf>;
+    using InnerAlloc = typename std::allocator_traits<Allocator>::template rebind_alloc<Inner>;
+    using LeafTraits = std::allocator_traits<LeafAlloc>;
+    using InnerTraits = std::allocator_traits<InnerAlloc>;
+
+    LeafAlloc leaf_alloc;
+    InnerAlloc inner_alloc;
+
+    Node* head;
+    size_t sz;
+
+    Leaf* begin_iter;
+    Leaf* end_iter;
+
+    static Inner* inner(Node* p) {
+        return static_cast<Inner*>(p);
+    }
+
+    static Leaf* leaf(Node* p) {
+        return static_cast<Leaf*>(p);
+    }
+
+    // Number of keys in the subtree of p, only with order statistics
+    static size_t subtree_size(const Node* p) {
+        if (p->leaf) {
+            return p->cnt;
+        }
+        const Inner* in = static_cast<const Inner*>(p);
+        size_t n = 0;
+        for (unsigned int j = 0; j < in->cnt; j++) {
+            n += in->counts[j];
+        }
+        return n;
+    }
+
+    // Add delta to the subtree sizes on the path above p
+    static void add_count(Node* p, std::ptrdiff_t delta) {
+        if constexpr (order_statistics) {
+            for (; p->parent != nullptr; p = p->parent) {
+                inner(p->parent)->counts[p->pos] += static_cast<size_t>(delta);
+            }
+        }
+    }
+
+    // Recompute the subtree size of p kept in its parent
+    static void recount(Node* p) {
+        if constexpr (order_statistics) {
+            if (p->parent != nullptr) {
+                inner(p->parent)->counts[p->pos] = subtree_size(p);
+            }
+        }
+    }
+
+    // Same for p and all of its ancestors
+    static void recount_path(Node* p) {
+        for (; p != nullptr; p = p->parent) {
+            recount(p);
+        }
+    }
+
+    // A three-way search stops at any equal key, with equal keys allowed
+    // the first one is needed
+    template<typename K>
+    static constexpr bool three_way = btree_detail::key_order<Compare, T, K>::three_way && !multi;
+
+    template<typename L, typename R>
+    bool less(const L &a, const R &b) const {
+        this->tick(counter::comparisons);
+        return btree_detail::key_order<Compare, L, R>::less(this->comp(), a, b);
+    }
+
+    // Position of the first key of p which is not less than elem
+    template<typename K>
+    unsigned int lower(const Node* p, const K &elem) const {
+        if constexpr (btree_detail::key_order<Compare, T, K>::user_three_way) {
+            return btree_detail::lower_bound(p->keys(), p->cnt, elem, [this](const T &a, const K &b) {
+                return less(a, b);
+            });
+        } else {
+            if constexpr (instrumentation) {
+                this->tick(counter::comparisons, btree_detail::lower_bound_comparisons<T, K, Compare>(p->cnt));
+            }
+            return btree_detail::lower_bound(p->keys(), p->cnt, elem, this->comp());
+        }
+    }
+
+    // Position of the first key of p which is not less than elem and
+    // whether it is equal to elem
+    template<typename K>
+    btree_detail::search_result search(const Node* p, const K &elem) const {
+        if constexpr (three_way<K>) {
+            return btree_detail::search_three_way(p->keys(), p->cnt, elem, [this](const T &a, const K &b) {
+                this->tick(counter::comparisons);
+                return btree_detail::key_order<Compare, T, K>::compare(this->comp(), a, b);
+            });
+        } else {
+            unsigned int i = lower(p, elem);
+            return {i, i < p->cnt && !less(elem, p->keys()[i])};
+        }
+    }
+
+    // Position of the first key of p which is greater than elem
+    template<typename K>
+    unsigned int upper(const Node* p, const K &elem) const {
+        return btree_detail::count_less(p->keys(), p->cnt, elem, [this](const T &a, const K &b) {
+            return !less(b, a);
+        });
+    }
+
+    // Descend to the leaf with the first key greater than elem, or to the
+    // rightmost one if there is none. Returns the leaf and the position
+    // of that key.
+    template<typename K>
+    std::pair<Leaf*, unsigned int> descend_upper(const K &elem) const {
+        Node* cur = head;
+        this->tick(counter::node_visits);
+        while (!cur->leaf) {
+            unsigned int i = upper(cur, elem);
+            if (i == cur->cnt) {
+                i--;
+            }
+            cur = inner(cur)->children[i];
+            this->tick(counter::node_visits);
+        }
+        return {leaf(cur), upper(cur, elem)};
+    }
+
+    // Descend to the leaf where elem is or would be inserted, keys greater
+    // than everything go to the rightmost one. Returns the leaf and the
+    // search result in it. With equal keys it is the first of them.
+    template<typename K>
+    std::pair<Leaf*, btree_detail::search_result> descend(const K &elem) const {
+        Node* cur = head;
+        this->tick(counter::node_visits);
+        while (!cur->leaf) {
+            unsigned int i;
+            if constexpr (three_way<K>) {
+                btree_detail::search_result r = search(cur, elem);
+                if (r.eq) {
+                    // Equal to a separator, so it is the last key of that subtree
+                    cur = inner(cur)->children[r.pos];
+                    this->tick(counter::node_visits);
+                    while (!cur->leaf) {
+                        cur = inner(cur)->children[cur->cnt - 1];
+                        this->tick(counter::node_visits);
+                    }
+                    return {leaf(cur), {cur->cnt - 1, true}};
+                }
+                i = r.pos;
+            } else {
+                i = lower(cur, elem);
+            }
+            if (i == cur->cnt) {
+                i--;
+            }
+            cur = inner(cur)->children[i];
+            this->tick(counter::node_visits);
+        }
+        return {leaf(cur), search(cur, elem)};
+    }
+
+    // Move-construct n keys (or values) into uninitialized slots,
+    // destroying the originals
+    template<typename U>
+    static void move_keys(U* from, unsigned int n, U* to) {
+        for (unsigned int j = 0; j < n; j++) {
+            new (to + j) U(std::move(from[j]));
+            from[j].~U();
+        }
+    }
+
+    // Move k[0, cnt) to k[n, n + cnt), the first n slots become uninitialized
+    template<typename U>
+    static void shift_up(U* k, unsigned int cnt, unsigned int n) {
+        for (unsigned int j = cnt; j-- > 0;) {
+            new (k + j + n) U(std::move(k[j]));
+            k[j].~U();
+        }
+    }
+
+    // Move k[n, cnt) to k[0, cnt - n), the last n slots become uninitialized
+    template<typename U>
+    static void shift_down(U* k, unsigned int n, unsigned int cnt) {
+        for (unsigned int j = n; j < cnt; j++) {
+            new (k + j - n) U(std::move(k[j]));
+            k[j].~U();
+        }
+    }
+
+    // The values of a map follow their keys, moved like move_keys() from
+    // slot at of leaf from to slot dest of leaf to. Nothing for a set or
+    // for internal nodes.
+    static void move_values(Node* from, unsigned int at, unsigned int n, Node* to, unsigned int dest) {
+        if constexpr (has_values) {
+            if (from->leaf) {
+                move_keys(leaf(from)->values() + at, n, leaf(to)->values() + dest);
+            }
+        }
+    }
+
+    // Read-only root shared by all empty sets, so that default-constructed,
+    // cleared and moved-from sets own no nodes. Nothing ever writes to it.
+    static Leaf* empty_root() {
+        static Leaf root;
+        return &root;
+    }
+
+    Leaf* new_leaf() {
+        this->tick(counter::allocations);
+        Leaf* p = LeafTraits::allocate(leaf_alloc, 1);
+        LeafTraits::construct(leaf_alloc, p);
+        return p;
+    }
+
+    Inner* new_inner() {
+        this->tick(counter::allocations);
+        Inner* p = InnerTraits::allocate(inner_alloc, 1);
+        InnerTraits::construct(inner_alloc, p);
+        return p;
+    }
+
+    // Free a single node, children of an internal node are left alone
+    void free_node(Node* p) {
+        this->tick(counter::deallocations);
+        if (p->leaf) {
+            LeafTraits::destroy(leaf_alloc, leaf(p));
+            LeafTraits::deallocate(leaf_alloc, leaf(p), 1);
+        } else {
+            InnerTraits::destroy(inner_alloc, inner(p));
+            InnerTraits::deallocate(inner_alloc, inner(p), 1);
+        }
+    }
+
+    // Free the whole tree and leave it empty
+    void free_tree() {
+        if (head != empty_root()) {
+            destroy(head);
+        }
+        head = empty_root();
+        sz = 0;
+        recalc_iter();
+    }
+
+    // Copy a subtree node by node, without comparisons or rebalancing.
+    // New leaves are chained after last.
+    Node* clone(const Node* src, Leaf* &last) {
+        Node* p;
+        if (src->leaf) {
+            Leaf* l = new_leaf();
+            if (last != nullptr) {
+                last->link_after(l);
+            }
+            last = l;
+            p = l;
+        } else {
+            Inner* in = new_inner();
+            for (unsigned int i = 0; i < src->cnt; i++) {
+                in->children[i] = clone(static_cast<const Inner*>(src)->children[i], last);
+            }
+            p = in;
+        }
+        for (unsigned int i = 0; i < src->cnt; i++) {
+            new (p->keys() + i) T(src->keys()[i]);
+        }
+        if constexpr (has_values) {
+            if (p->leaf) {
+                for (unsigned int i = 0; i < src->cnt; i++) {
+                    new (leaf(p)->values() + i) Value(static_cast<const Leaf*>(src)->values()[i]);
+                }
+            }
+        }
+        p->cnt = src->cnt;
+        if (!p->leaf) {
+            inner(p)->adopt(0);
+        }
+        return p;
+    }
+
+    // Fill an empty tree with a copy of the nodes of set
+    void clone_from(const Set &set) {
+        if (set.head == empty_root()) {
+            return;
+        }
+        Leaf* last = nullptr;
+        head = clone(set.head, last);
+        sz = set.sz;
+        recalc_iter();
+    }
+
+    // Take the nodes of another set, leaving it empty
+    void steal(Set &set) {
+        head = set.head;
+        sz = set.sz;
+        begin_iter = set.begin_iter;
+        end_iter = set.end_iter;
+        set.head = empty_root();
+        set.sz = 0;
+        set.begin_iter = set.end_iter = empty_root();
+    }
+
+    // Free a subtree
+    void destroy(Node* p) {
+        if (!p->leaf) {
+            Inner* in = inner(p);
+            for (unsigned int i = 0; i < in->cnt; i++) {
+                destroy(in->children[i]);
+            }
+        }
+        free_node(p);
+    }
+
+    // Update separators above p after its maximum changed
+    void update_max(Node* p) {
+        while (p->parent != nullptr) {
+            Inner* par = inner(p->parent);
+            unsigned int i = p->pos;
+            par->keys()[i] = p->max();
+            if (i != par->cnt - 1) {
+                break;
+            }
+            p = par;
+        }
+    }
+
+    // Move all keys and children of right to the end of its left sibling
+    static void append(Node* left, Node* right) {
+        if (!left->leaf) {
+            Inner* l = inner(left);
+            Inner* r = inner(right);
+            std::copy(r->children, r->children + r->cnt, l->children + l->cnt);
+        }
+        unsigned int from = left->cnt;
+        move_keys(right->keys(), right->cnt, left->keys() + left->cnt);
+        move_values(right, 0, right->cnt, left, left->cnt);
+        left->cnt += right->cnt;
+        right->cnt = 0;
+        if (!left->leaf) {
+            inner(left)->adopt(from);
+        }
+    }
+
+    // Move the last n keys and children of left to the front of its right sibling
+    static void move_tail(Node* left, Node* right, unsigned int n) {
+        shift_up(right->keys(), right->cnt, n);
+        move_keys(left->keys() + left->cnt - n, n, right->keys());
+        if constexpr (has_values) {
+            if (left->leaf) {
+                shift_up(leaf(right)->values(), right->cnt, n);
+                move_values(left, left->cnt - n, n, right, 0);
+            }
+        }
+        if (!left->leaf) {
+            Inner* l = inner(left);
+            Inner* r = inner(right);
+            std::move_backward(r->children, r->children + r->cnt, r->children + r->cnt + n);
+            std::copy(l->children + l->cnt - n, l->children + l->cnt, r->children);
+        }
+        left->cnt -= n;
+        right->cnt += n;
+        if (!right->leaf) {
+            inner(right)->adopt(0);
+        }
+    }
+
+    // Move the first n keys and children of right to the end of its left sibling
+    static void move_head(Node* left, Node* right, unsigned int n) {
+        unsigned int from = left->cnt;
+        move_keys(right->keys(), n, left->keys() + left->cnt);
+        shift_down(right->keys(), n, right->cnt);
+        if constexpr (has_values) {
+            if (left->leaf) {
+                move_values(right, 0, n, left, left->cnt);
+                shift_down(leaf(right)->values(), n, right->cnt);
+            }
+        }
+        if (!left->leaf) {
+            Inner* l = inner(left);
+            Inner* r = inner(right);
+            std::copy(r->children, r->children + n, l->children + l->cnt);
+            std::move(r->children + n, r->children + r->cnt, r->children);
+        }
+        left->cnt += n;
+        right->cnt -= n;
+        if (!left->leaf) {
+            inner(left)->adopt(from);
+            inner(right)->adopt(0);
+        }
+    }
+
+    // Number of keys or children bulk_load() puts into a node
+    static unsigned int fill_count(double fill) {
+        unsigned int n = static_cast<unsigned int>(fill * (2 * B - 1) + 0.5);
+        return std::min(std::max(n, B), 2 * B - 1);
+    }
+
+    // Give the last node of a level built left to right at least B keys
+    // or children, by merging it into its left neighbour or taking the
+    // neighbour's tail
+    void fix_last(std::vector<Node*> &level) {
+        if (level.size() < 2 || level.back()->cnt >= B) {
+            return;
+        }
+        Node* last = level.back();
+        Node* prev = level[level.size() - 2];
+        if (prev->cnt + last->cnt < 2 * B) {
+            append(prev, last);
+            if (last->leaf) {
+                leaf(last)->unlink();
+            }
+            free_node(last);
+            level.pop_back();
+        } else {
+            move_tail(prev, last, B - last->cnt);
+        }
+    }
+
+    // Give every node of a level built from several parts at least B keys
+    // or children, a short node is merged with its right neighbour or takes
+    // the neighbour's head
+    void fix_short(std::vector<Node*> &level) {
+        size_t out = 0;
+        for (Node* p : level) {
+            if (out > 0 && level[out - 1]->cnt < B) {
+                Node* prev = level[out - 1];
+                if (prev->cnt + p->cnt < 2 * B) {
+                    append(prev, p);
+                    if (p->leaf) {
+                        leaf(p)->unlink();
+                    }
+                    free_node(p);
+                    continue;
+                }
+                move_head(prev, p, B - prev->cnt);
+            }
+            level[out++] = p;
+        }
+        level.resize(out);
+        fix_last(level);
+    }
+
+    // Put per_node nodes of level under each new parent, like bulk_load()
+    // does, with the parents filled on several threads. Parents are
+    // allocated here since the allocator need not be thread-safe.
+    std::vector<Node*> build_parents(const std::vector<Node*> &level, unsigned int per_node, unsigned int threads) {
+        std::vector<Node*> up((level.size() + per_node - 1) / per_node);
+        for (Node* &par : up) {
+            par = new_inner();
+        }
+        threads = btree_detail::thread_count(threads, level.size() / btree_detail::parallel_grain);
+        btree_detail::parallel_for(threads, [&](unsigned int t) {
+            for (size_t j = up.size() * t / threads; j < up.size() * (t + 1) / threads; j++) {
+                Inner* par = inner(up[j]);
+                size_t to = std::min(level.size(), (j + 1) * per_node);
+                for (size_t i = j * per_node; i < to; i++) {
+                    par->insert(par->cnt, level[i]);
+                }
+            }
+        });
+        fix_last(up);
+        return up;
+    }
+
+    // Up to parts ranges of consecutive leaves covering the whole tree, cut
+    // at the children of the root or of the first level with enough nodes.
+    // Each range is given by its first and last leaf.
+    std::vector<std::pair<Leaf*, Leaf*>> leaf_ranges(unsigned int parts) const {
+        std::vector<std::pair<Leaf*, Leaf*>> res;
+        if (sz == 0) {
+            return res;
+        }
+        std::vector<Node*> level{head};
+        while (level.size() < parts && !level[0]->leaf) {
+            std::vector<Node*> down;
+            for (Node* p : level) {
+                down.insert(down.end(), inner(p)->children, inner(p)->children + p->cnt);
+            }
+            level.swap(down);
+        }
+        parts = std::min<size_t>(parts, level.size());
+        for (unsigned int t = 0; t < parts; t++) {
+            res.emplace_back(first_leaf(level[level.size() * t / parts]),
+                             last_leaf(level[level.size() * (t + 1) / parts - 1]));
+        }
+        return res;
+    }
+
+    // Sorted input is bulk loaded as is, anything else is sorted first
+    template<typename Iter>
+    void assign_range(Iter begin, Iter end) {
+        auto comp = [this](const auto &a, const auto &b) {
+            return less(a, b);
+        };
+        using Category = typename std::iterator_traits<Iter>::iterator_category;
+        if constexpr (std::is_base_of<std::forward_iterator_tag, Category>::value) {
+            if (std::is_sorted(begin, end, comp)) {
+                bulk_load(begin, end);
+                return;
+            }
+        }
+        std::vector<T> keys(begin, end);
+        if (!std::is_sorted(keys.begin(), keys.end(), comp)) {
+            // Stable, so the first of equal elements is kept like with insert()
+            std::stable_sort(keys.begin(), keys.end(), comp);
+        }
+        bulk_load(std::make_move_iterator(keys.begin()), std::make_move_iterator(keys.end()));
+    }
+
+    // Leaves have height 0
+    static unsigned int height(Node* p) {
+        unsigned int h = 0;
+        while (!p->leaf) {
+            p = inner(p)->children[0];
+            h++;
+        }
+        return h;
+    }
+
+    static Leaf* first_leaf(Node* p) {
+        while (!p->leaf) {
+            p = inner(p)->children[0];
+        }
+        return leaf(p);
+    }
+
+    static Leaf* last_leaf(Node* p) {
+        while (!p->leaf) {
+            p = inner(p)->children[p->cnt - 1];
+        }
+        return leaf(p);
+    }
+
+    void recalc_iter() {
+        begin_iter = first_leaf(head);
+        end_iter = last_leaf(head);
+    }
+
+    // Split a vertex into two if it has too many keys or children.
+    // Maximums of the ancestors don't change. Returns the new right
+    // sibling of the vertex itself, if it was split.
+    Node* split(Node* cur) {
+        return split(cur, head);
+    }
+
+    // Same for a vertex of the tree with the given root
+    Node* split(Node* cur, Node* &root) {
+        Node* sibling = nullptr;
+        while (cur->cnt == 2 * B) {
+            // If root is full, create new root
+            if (cur->parent == nullptr) {
+                Inner* new_root = new_inner();
+                new_root->insert(0, root);
+                root = new_root;
+            }
+            // Create a sibling, move upper half of current node to it
+            this->tick(counter::splits);
+            Inner* par = inner(cur->parent);
+            unsigned int i = cur->pos;
+            Node* to;
+            if (cur->leaf) {
+                to = new_leaf();
+                leaf(cur)->link_after(leaf(to));
+                if (cur == end_iter) {
+                    end_iter = leaf(to);
+                }
+            } else {
+                Inner* dest = new_inner();
+                std::copy(inner(cur)->children + B, inner(cur)->children + 2 * B, dest->children);
+                to = dest;
+            }
+            move_keys(cur->keys() + B, B, to->keys());
+            move_values(cur, B, B, to, 0);
+            to->cnt = B;
+            cur->cnt = B;
+            if (!to->leaf) {
+                inner(to)->adopt(0);
+            }
+            par->keys()[i] = cur->max();
+            recount(cur);
+            par->insert(i + 1, to);
+            if (sibling == nullptr) {
+                sibling = to;
+            }
+            cur = par;
+        }
+        return sibling;
+    }
+
+    // Put the nodes of fresh into the parent of anchor right after it. An
+    // overfull parent is cut into as many nodes as needed at once, which
+    // then go into the grandparent the same way.
+    void insert_after(Node* anchor, std::vector<Node*> &fresh) {
+        std::vector<Node*> all;
+        std::vector<T> seps;
+        while (!fresh.empty()) {
+            if (anchor->parent == nullptr) {
+                Inner* new_root = new_inner();
+                new_root->insert(0, anchor);
+                head = new_root;
+            }
+            Inner* par = inner(anchor->parent);
+            unsigned int i = anchor->pos;
+            par->keys()[i] = anchor->max();
+            if (par->cnt + fresh.size() < 2 * B) {
+                for (size_t j = 0; j < fresh.size(); j++) {
+                    par->insert(static_cast<unsigned int>(i + 1 + j), fresh[j]);
+                }
+                recount(anchor);
+                fresh.clear();
+                anchor = par;
+                break;
+            }
+            // Lay out all children with their separators, the existing
+            // separators are moved, so the old children aren't touched
+            T* k = par->keys();
+            all.assign(par->children, par->children + i + 1);
+            seps.assign(std::make_move_iterator(k), std::make_move_iterator(k + i + 1));
+            for (Node* p : fresh) {
+                all.push_back(p);
+                seps.push_back(p->max());
+            }
+            all.insert(all.end(), par->children + i + 1, par->children + par->cnt);
+            seps.insert(seps.end(), std::make_move_iterator(k + i + 1), std::make_move_iterator(k + par->cnt));
+            fresh.clear();
+            for (unsigned int j = 0; j < par->cnt; j++) {
+                k[j].~T();
+            }
+            // Spread the children evenly, every node gets from B to 2 * B - 1 of them
+            size_t total = all.size();
+            size_t q = (total + 2 * B - 2) / (2 * B - 1);
+            this->tick(counter::splits, q - 1);
+            size_t at = 0;
+            for (size_t j = 0; j < q; j++) {
+                Inner* p = j == 0 ? par : new_inner();
+                unsigned int n = static_cast<unsigned int>(total / q + (j < total % q));
+                std::copy(all.begin() + at, all.begin() + at + n, p->children);
+                for (unsigned int c = 0; c < n; c++) {
+                    new (p->keys() + c) T(std::move(seps[at + c]));
+                }
+                p->cnt = n;
+                p->adopt(0);
+                at += n;
+                if (j != 0) {
+                    fresh.push_back(p);
+                }
+            }
+            anchor = par;
+        }
+        update_max(anchor);
+    }
+
+    // Move keys or children to a vertex, which has too few of them. A leaf
+    // may be short of any number of keys, even be empty. If track is
+    // given, it is kept pointing to the same element when keys move
+    // between leaves.
+    void merge(Node* cur, iterator* track = nullptr) {
+        while (cur->cnt < B) {
+            // If root has only one child, remove root
+            if (cur->parent == nullptr) {
+                if (!cur->leaf && cur->cnt == 1) {
+                    head = inner(cur)->children[0];
+                    head->parent = nullptr;
+                    free_node(cur);
+                }
+                return;
+            }
+            Inner* par = inner(cur->parent);
+            unsigned int i = cur->pos;
+            // If vertex isn't the leftmost child, interract with left sibling, else with the right
+            unsigned int li = i != 0 ? i - 1 : i;
+            Node* left = par->children[li];
+            Node* right = par->children[li + 1];
+            Node* neigh = i != 0 ? left : right;
+            // Attempt to "steal" the missing keys or children
+            // The separator of an emptied leaf is stale, it is fixed on the way
+            bool stale = cur->cnt == 0;
+            if (neigh->cnt + cur->cnt >= 2 * B) {
+                this->tick(counter::steals);
+                unsigned int n = B - cur->cnt;
+                bool moved = track != nullptr && track->ptr == right;
+                if (i != 0) {
+                    move_tail(left, right, n);
+                    if (moved) {
+                        track->slot += n;
+                    }
+                } else {
+                    unsigned int from = left->cnt;
+                    move_head(left, right, n);
+                    if (moved) {
+                        if (track->slot < n) {
+                            *track = iterator(leaf(left), from + track->slot);
+                        } else {
+                            track->slot -= n;
+                        }
+                    }
+                }
+                par->keys()[li] = left->max();
+                if (stale && cur == right) {
+                    update_max(right);
+                }
+                recount(left);
+                recount(right);
+                return;
+            }
+            // Merging vertices, the right one is moved into the left one
+            this->tick(counter::merges);
+            if (track != nullptr && track->ptr == right) {
+                *track = iterator(leaf(left), left->cnt + track->slot);
+            }
+            append(left, right);
+            if (cur->leaf) {
+                leaf(right)->unlink();
+            }
+            if (right == end_iter) {
+                end_iter = leaf(left);
+            }
+            free_node(right);
+            if (stale && cur == right) {
+                par->erase(li + 1);
+                update_max(left);
+            } else {
+                std::swap(par->keys()[li], par->keys()[li + 1]);
+                par->erase(li + 1);
+            }
+            recount(left);
+            cur = par;
+        }
+    }
+
+    // Join two detached trees of heights hl and hr, every key of l is less
+    // than every key of r and the last leaf of l is already chained to the
+    // first leaf of r. Either may be null, roots may hold fewer than B
+    // entries. The smaller tree is grafted onto the spine of the taller
+    // one at its own height, so this takes O(|hl - hr| + 1). Returns the
+    // new root and sets h to its height. The last leaf of l is never
+    // freed, if l is not null.
+    Node* join(Node* l, unsigned int hl, Node* r, unsigned int hr, unsigned int &h) {
+        if (l == nullptr) {
+            h = hr;
+            return r;
+        }
+        if (r == nullptr) {
+            h = hl;
+            return l;
+        }
+        if (hl == hr) {
+            h = hl;
+            if (l->cnt + r->cnt < 2 * B) {
+                merge_into(l, r);
+                return l;
+            }
+            // Both become children of a new root, so both need at least B entries
+            if (l->cnt < B) {
+                this->tick(counter::steals);
+                move_head(l, r, B - l->cnt);
+            } else if (r->cnt < B) {
+                this->tick(counter::steals);
+                move_tail(l, r, B - r->cnt);
+            }
+            Inner* root = new_inner();
+            root->insert(0, l);
+            root->insert(1, r);
+            h++;
+            return root;
+        }
+        Node* root;
+        Inner* par;
+        if (hl > hr) {
+            // r becomes the last child of the node at height hr + 1 on the right spine of l
+            root = l;
+            Node* cur = l;
+            for (unsigned int d = hl; d > hr + 1; d--) {
+                cur = inner(cur)->children[cur->cnt - 1];
+            }
+            par = inner(cur);
+            Node* s = par->children[par->cnt - 1];
+            if (r->cnt < B) {
+                if (s->cnt + r->cnt < 2 * B) {
+                    merge_into(s, r);
+                    update_max(s);
+                    recount_path(s);
+                    h = hl;
+                    return l;
+                }
+                this->tick(counter::steals);
+                move_tail(s, r, B - r->cnt);
+                par->keys()[s->pos] = s->max();
+            }
+            par->insert(par->cnt, r);
+            update_max(r);
+            recount(s);
+            recount_path(par);
+        } else {
+            // l becomes the first child of the node at height hl + 1 on the left spine of r
+            root = r;
+            Node* cur = r;
+            for (unsigned int d = hr; d > hl + 1; d--) {
+                cur = inner(cur)->children[0];
+            }
+            par = inner(cur);
+            Node* s = par->children[0];
+            if (l->cnt < B) {
+                if (l->cnt + s->cnt < 2 * B) {
+                    // l takes the place of s, so that it survives
+                    merge_into(l, s);
+                    par->children[0] = l;
+                    par->adopt(0);
+                    recount_path(par);
+                    h = hr;
+                    return r;
+                }
+                this->tick(counter::steals);
+                move_head(l, s, B - l->cnt);
+            }
+            par->insert(0, l);
+            recount_path(par);
+        }
+        unsigned int top = std::max(hl, hr);
+        Node* old_root = root;
+        split(par, root);
+        h = root == old_root ? top : top + 1;
+        return root;
+    }
+
+    // Move all of right into its left neighbour and free it
+    void merge_into(Node* left, Node* right) {
+        this->tick(counter::merges);
+        append(left, right);
+        if (left->leaf) {
+            leaf(right)->unlink();
+        }
+        free_node(right);
+    }
+
+    // Cut the tree containing p into the trees of the keys before slot
+    // of p and of the rest. Walks up from p, at every level the children
+    // left and right of the path form a piece, which is joined to the
+    // result of the level below. Heights of the results only grow, so
+    // the joins take O(log n) altogether. The leaf chain stays intact
+    // until the end, where it is broken between the two results.
+    void cut(Leaf* p, unsigned int slot, Node* &l, unsigned int &hl, Node* &r, unsigned int &hr) {
+        l = r = nullptr;
+        hl = hr = 0;
+        Inner* par = inner(p->parent);
+        unsigned int i = p->pos;
+        p->parent = nullptr;
+        if (slot == 0) {
+            r = p;
+        } else if (slot == p->cnt) {
+            l = p;
+        } else {
+            Leaf* q = new_leaf();
+            move_keys(p->keys() + slot, p->cnt - slot, q->keys());
+            move_values(p, slot, p->cnt - slot, q, 0);
+            q->cnt = p->cnt - slot;
+            p->cnt = slot;
+            p->link_after(q);
+            l = p;
+            r = q;
+        }
+        for (unsigned int ht = 1; par != nullptr; ht++) {
+            Inner* up = inner(par->parent);
+            unsigned int up_i = par->pos;
+            // Children after the path go to a new node, par keeps those before it
+            Node* rp = nullptr;
+            unsigned int n = par->cnt - i - 1;
+            if (n != 0) {
+                Inner* q = new_inner();
+                std::copy(par->children + i + 1, par->children + par->cnt, q->children);
+                move_keys(par->keys() + i + 1, n, q->keys());
+                q->cnt = n;
+                q->adopt(0);
+                rp = q;
+            }
+            par->keys()[i].~T();
+            par->cnt = i;
+            par->parent = nullptr;
+            Node* lp = par;
+            if (i == 0) {
+                free_node(par);
+                lp = nullptr;
+            }
+            unsigned int hlp = ht;
+            unsigned int hrp = ht;
+            lp = collapse(lp, hlp);
+            rp = collapse(rp, hrp);
+            l = join(lp, hlp, l, hl, hl);
+            r = join(r, hr, rp, hrp, hr);
+            par = up;
+            i = up_i;
+        }
+        if (l != nullptr) {
+            last_leaf(l)->next = nullptr;
+        }
+        if (r != nullptr) {
+            first_leaf(r)->prev = nullptr;
+        }
+    }
+
+    // Replace an internal root with a single child by that child
+    Node* collapse(Node* p, unsigned int &h) {
+        if (p != nullptr && !p->leaf && p->cnt == 1) {
+            Node* c = inner(p)->children[0];
+            free_node(p);
+            c->parent = nullptr;
+            h--;
+            return c;
+        }
+        return p;
+    }
+
+public:
+    Set()
+        : Set(Compare()) {}
+
+    explicit Set(const Compare &comp, const Allocator &alloc = Allocator())
+        : CompareHolder(comp)
+        , leaf_alloc(alloc)
+        , inner_alloc(alloc)
+        , head(empty_root())
+        , sz(0)
+        , begin_iter(empty_root())
+        , end_iter(empty_root()) {}
+
+    explicit Set(const Allocator &alloc)
+        : Set(Compare(), alloc) {}
+
+    // Builds the tree bottom-up in O(n) if the input is sorted, otherwise
+    // sorts a copy of it first
+    template<typename Iter>
+    Set(Iter begin, Iter end, const Compare &comp = Compare(), const Allocator &alloc = Allocator())
+        : Set(comp, alloc) {
+        assign_range(begin, end);
+    }
+
+    template<typename Iter>
+    Set(Iter begin, Iter end, const Allocator &alloc)
+        : Set(begin, end, Compare(), alloc) {}
+
+    Set(std::initializer_list<T> init, const Compare &comp = Compare(), const Allocator &alloc = Allocator())
+        : Set(init.begin(), init.end(), comp, alloc) {}
+
+    Set(std::initializer_list<T> init, const Allocator &alloc)
+        : Set(init.begin(), init.end(), Compare(), alloc) {}
+
+    // Input is known to be sorted, equal neighbours are collapsed unless
+    // the policy allows equal keys
+    template<typename Iter>
+    Set(sorted_unique_t, Iter begin, Iter end, const Compare &comp = Compare(), const Allocator &alloc = Allocator())
+        : Set(comp, alloc) {
+        bulk_load(begin, end);
+    }
+
+    Set(const Set &set)
+        : Set(set, std::allocator_traits<Allocator>::select_on_container_copy_construction(set.get_allocator())) {}
+
+    // Clones the structure of set, O(n) with no comparisons
+    Set(const Set &set, const Allocator &alloc)
+        : Set(set.key_comp(), alloc) {
+        clone_from(set);
+    }
+
+    // Takes the nodes of set and leaves it empty, nothing is allocated
+    Set(Set &&set) noexcept(std::is_nothrow_copy_constructible<Compare>::value)
+        : CompareHolder(set.comp())
+        , leaf_alloc(set.leaf_alloc)
+        , inner_alloc(set.inner_alloc)
+        , head(empty_root())
+        , sz(0)
+        , begin_iter(empty_root())
+        , end_iter(empty_root()) {
+        steal(set);
+    }
+
+    ~Set() {
+        free_tree();
+    }
+
+    Set &operator=(const Set &set) {
+        if (this == &set) {
+            return *this;
+        }
+        // Nodes of the copy have to come from our own allocator
+        Set tmp(set, get_allocator());
+        static_cast<CompareHolder&>(*this) = tmp;
+        free_tree();
+        steal(tmp);
+        return *this;
+    }
+
+    Set &operator=(Set &&set) noexcept(
+        (std::allocator_traits<Allocator>::propagate_on_container_move_assignment::value ||
+         std::allocator_traits<Allocator>::is_always_equal::value) &&
+        std::is_nothrow_copy_assignable<Compare>::value) {
+        if (this == &set) {
+            return *this;
+        }
+        static_cast<CompareHolder&>(*this) = set;
+        free_tree();
+        if constexpr (std::allocator_traits<Allocator>::propagate_on_container_move_assignment::value) {
+            leaf_alloc = set.leaf_alloc;
+            inner_alloc = set.inner_alloc;
+        } else if constexpr (!std::allocator_traits<Allocator>::is_always_equal::value) {
+            // Nodes from a different allocator can't be taken over
+            if (leaf_alloc != set.leaf_alloc) {
+                clone_from(set);
+                return *this;
+            }
+        }
+        steal(set);
+        return *this;
+    }
+
+    Allocator get_allocator() const {
+        return Allocator(leaf_alloc);
+    }
+
+    key_compare key_comp() const {
+        return this->comp();
+    }
+
+    value_compare value_comp() const {
+        return this->comp();
+    }
+
+    // Free all nodes
+    void clear() {
+        free_tree();
+    }
+
+    // Write the set to path in the format of btree_detail::disk_header,
+    // for MappedSet to map. Throws std::runtime_error if the file can't be
+    // written.
+    void save(const std::string &path) const {
+        static_assert(!has_values, "not available for maps");
+        static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable keys can be saved");
+        static_assert(alignof(T) <= 64, "keys are aligned within 64-byte pages");
+        using Header = btree_detail::disk_header;
+        using DiskLeaf = btree_detail::disk_leaf<T, B>;
+        using DiskInner = btree_detail::disk_inner<T, B>;
+        // Internal levels from the root down, then the leaves
+        std::vector<std::vector<const Node*>> levels;
+        if (sz > 0) {
+            levels.push_back({head});
+            while (!levels.back()[0]->leaf) {
+                std::vector<const Node*> down;
+                for (const Node* p : levels.back()) {
+                    const Inner* in = static_cast<const Inner*>(p);
+                    down.insert(down.end(), in->children, in->children + in->cnt);
+                }
+                levels.push_back(std::move(down));
+            }
+        }
+        Header hdr{};
+        std::memcpy(hdr.magic, btree_detail::disk_magic, sizeof(hdr.magic));
+        hdr.version = btree_detail::disk_version;
+        hdr.byte_order = btree_detail::disk_byte_order;
+        hdr.b = B;
+        hdr.key_size = sizeof(T);
+        hdr.key_align = alignof(T);
+        hdr.size = sz;
+        uint64_t offset = sizeof(Header);
+        // Offsets of the first page of every level
+        std::vector<uint64_t> starts;
+        for (const std::vector<const Node*> &level : levels) {
+            starts.push_back(offset);
+            offset += level.size() * (level[0]->leaf ? sizeof(DiskLeaf) : sizeof(DiskInner));
+        }
+        if (!levels.empty()) {
+            hdr.height = levels.size() - 1;
+            hdr.root = starts[0];
+            hdr.first_leaf = starts.back();
+            hdr.leaves = levels.back().size();
+        }
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+        for (size_t l = 0; l < levels.size(); l++) {
+            // Children of a level are the next level in order
+            uint64_t child = 0;
+            for (const Node* p : levels[l]) {
+                if (p->leaf) {
+                    DiskLeaf page{};
+                    page.cnt = p->cnt;
+                    std::memcpy(page.keys, p->keys(), p->cnt * sizeof(T));
+                    out.write(reinterpret_cast<const char*>(&page), sizeof(page));
+                    continue;
+                }
+                size_t child_size = levels[l + 1][0]->leaf ? sizeof(DiskLeaf) : sizeof(DiskInner);
+                DiskInner page{};
+                page.cnt = p->cnt;
+                for (unsigned int i = 0; i < p->cnt; i++) {
+                    page.children[i] = starts[l + 1] + child++ * child_size;
+                }
+                std::memcpy(page.keys, p->keys(), p->cnt * sizeof(T));
+                out.write(reinterpret_cast<const char*>(&page), sizeof(page));
+            }
+        }
+        out.close();
+        if (!out) {
+            throw std::runtime_error("cannot write " + path);
+        }
+    }
+
+    // Replace the contents with sorted keys in O(n), equal neighbours are
+    // collapsed unless the policy allows equal keys. Leaves and internal
+    // nodes are filled left to right to fill * (2 * B - 1) entries, but
+    // never below B. A full tree is the smallest and fastest to search, a
+    // lower fill leaves room for inserts without splitting.
+    template<typename Iter>
+    void bulk_load(Iter begin, Iter end, double fill = 1) {
+        static_assert(!has_values, "not available for maps");
+        free_tree();
+        unsigned int per_node = fill_count(fill);
+        std::vector<Node*> level;
+        Node* cur = nullptr;
+        for (; begin != end; ++begin) {
+            if (!multi && cur != nullptr && !less(cur->max(), *begin)) {
+                continue;
+            }
+            if (cur == nullptr || cur->cnt == per_node) {
+                Leaf* l = new_leaf();
+                if (cur != nullptr) {
+                    leaf(cur)->link_after(l);
+                }
+                cur = l;
+                level.push_back(cur);
+            }
+            cur->insert_key(cur->cnt, *begin);
+            sz++;
+        }
+        if (level.empty()) {
+            return;
+        }
+        fix_last(level);
+        // Build internal levels over the one below until a single root is left
+        while (level.size() > 1) {
+            std::vector<Node*> up;
+            Inner* par = nullptr;
+            for (Node* p : level) {
+                if (par == nullptr || par->cnt == per_node) {
+                    par = new_inner();
+                    up.push_back(par);
+                }
+                par->insert(par->cnt, p);
+            }
+            fix_last(up);
+            level.swap(up);
+        }
+        head = level[0];
+        head->parent = nullptr;
+        recalc_iter();
+    }
+
+    // Same as bulk_load() for random access input, the keys are split into
+    // one part per thread and each thread fills the leaves of its part.
+    // Parts are stitched together at the leaf level, then every level of
+    // internal nodes is filled in parallel too. threads = 0 uses all cores,
+    // small inputs use fewer threads. Nodes are still allocated by the
+    // calling thread, so any allocator works.
+    template<typename Iter>
+    void bulk_load_parallel(Iter begin, Iter end, unsigned int threads = 0, double fill = 1) {
+        static_assert(!has_values, "not available for maps");
+        using Category = typename std::iterator_traits<Iter>::iterator_category;
+        static_assert(std::is_base_of<std::random_access_iterator_tag, Category>::value,
+                      "parallel bulk load needs random access input");
+        size_t n = end - begin;
+        threads = btree_detail::thread_count(threads, n / btree_detail::parallel_grain);
+        if (threads == 1) {
+            bulk_load(begin, end, fill);
+            return;
+        }
+        free_tree();
+        unsigned int per_node = fill_count(fill);
+        std::vector<std::vector<Node*>> parts(threads);
+        for (unsigned int t = 0; t < threads; t++) {
+            size_t keys = n * (t + 1) / threads - n * t / threads;
+            parts[t].resize((keys + per_node - 1) / per_node);
+            for (Node* &p : parts[t]) {
+                p = new_leaf();
+            }
+        }
+        std::vector<size_t> counts(threads);
+        std::vector<size_t> used(threads);
+        btree_detail::parallel_for(threads, [&](unsigned int t) {
+            Iter from = begin + n * t / threads;
+            Iter to = begin + n * (t + 1) / threads;
+            // Keys equal to the last one of the previous part belong to it
+            if (!multi && t > 0) {
+                const auto &prev = *(from - 1);
+                while (from != to && !less(prev, *from)) {
+                    ++from;
+                }
+            }
+            std::vector<Node*> &part = parts[t];
+            // Counted locally, the neighbouring slots belong to other threads
+            size_t keys = 0;
+            size_t leaves = 0;
+            Node* cur = nullptr;
+            for (; from != to; ++from) {
+                if (!multi && cur != nullptr && !less(cur->max(), *from)) {
+                    continue;
+                }
+                if (cur == nullptr || cur->cnt == per_node) {
+                    Leaf* l = leaf(part[leaves++]);
+                    if (cur != nullptr) {
+                        leaf(cur)->link_after(l);
+                    }
+                    cur = l;
+                }
+                cur->insert_key(cur->cnt, *from);
+                keys++;
+            }
+            counts[t] = keys;
+            used[t] = leaves;
+        });
+        // Chain the parts, leaves not needed because of collapsed duplicates
+        // go back to the allocator
+        std::vector<Node*> level;
+        for (unsigned int t = 0; t < threads; t++) {
+            sz += counts[t];
+            for (size_t j = used[t]; j < parts[t].size(); j++) {
+                free_node(parts[t][j]);
+            }
+            parts[t].resize(used[t]);
+            if (parts[t].empty()) {
+                continue;
+            }
+            if (!level.empty()) {
+                leaf(level.back())->next = leaf(parts[t][0]);
+                leaf(parts[t][0])->prev = leaf(level.back());
+            }
+            level.insert(level.end(), parts[t].begin(), parts[t].end());
+        }
+        fix_short(level);
+        while (level.size() > 1) {
+            level = build_parents(level, per_node, threads);
+        }
+        head = level[0];
+        head->parent = nullptr;
+        recalc_iter();
+    }
+
+    bool empty() const {
+        return sz == 0;
+    }
+
+    size_t size() const {
+        return sz;
+    }
+    // Points to a (leaf, slot) pair, end() is one past the last slot of the last leaf
+    class iterator {
+        friend Set;
+
+        template<typename, typename, unsigned int, typename, typename, typename>
+        friend class Map;
+
+    private:
+        Leaf* ptr;
+        unsigned int slot;
+
+        iterator(Leaf* p, unsigned int s) : ptr(p), slot(s) {}
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        iterator() {}
+
+        iterator(const iterator &iter)
+            : ptr(iter.ptr)
+            , slot(iter.slot) {}
+
+        iterator& operator=(const iterator &iter) {
+            ptr = iter.ptr;
+            slot = iter.slot;
+            return *this;
+        }
+
+        bool operator==(iterator iter) const {
+            return ptr == iter.ptr && slot == iter.slot;
+        }
+
+        bool operator!=(iterator iter) const {
+            return !(*this == iter);
+        }
+
+        const T& operator*() const {
+            return ptr->keys()[slot];
+        }
+
+        const T* operator->() const {
+            return ptr->keys() + slot;
+        }
+
+        iterator operator++() {
+            slot++;
+            // Go to the next leaf, stay past the end if there is none
+            if (slot == ptr->cnt && ptr->next != nullptr) {
+                ptr = ptr->next;
+                slot = 0;
+            }
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator ret = *this;
+            ++(*this);
+            return ret;
+        }
+
+        iterator operator--() {
+            if (slot == 0) {
+                ptr = ptr->prev;
+                slot = ptr->cnt;
+            }
+            slot--;
+            return *this;
         }
 
+        iterator operator--(int) {
+            iterator ret = *this;
+            --(*this);
+            return ret;
+        }
     };
 
-    std::unique_ptr<Node> head;
-    size_t sz;
+    iterator begin() const {
+        return iterator(begin_iter, 0);
+    }
 
-    Node* begin_iter;
+    iterator end() const {
+        return iterator(end_iter, end_iter->cnt);
+    }
 
-    // Update maximum and pointer to parent
-    void recalc(Node* p) {
-        if (p->children.empty()) {
-            return;
+    // Call f on every key in some order, on up to threads threads (0 uses
+    // all cores). The keys are split into runs of whole subtrees at the
+    // root's children, f must be safe to call from several threads.
+    template<typename F>
+    void parallel_for_each(F f, unsigned int threads = 0) const {
+        auto ranges = leaf_ranges(btree_detail::thread_count(threads, sz / btree_detail::parallel_grain));
+        btree_detail::parallel_for(ranges.size(), [&](unsigned int t) {
+            for (Leaf* p = ranges[t].first;; p = p->next) {
+                for (unsigned int i = 0; i < p->cnt; i++) {
+                    f(p->keys()[i]);
+                }
+                if (p == ranges[t].second) {
+                    break;
+                }
+            }
+        });
+    }
+
+    // Fold the keys with op(R, const T&) on up to threads threads. Every
+    // thread starts from identity on its run of keys, the results are then
+    // folded in key order with combine(R, R).
+    template<typename R, typename Op, typename Combine>
+    R parallel_reduce(R identity, Op op, Combine combine, unsigned int threads = 0) const {
+        auto ranges = leaf_ranges(btree_detail::thread_count(threads, sz / btree_detail::parallel_grain));
+        std::vector<R> results(ranges.size(), identity);
+        btree_detail::parallel_for(ranges.size(), [&](unsigned int t) {
+            R acc = identity;
+            for (Leaf* p = ranges[t].first;; p = p->next) {
+                for (unsigned int i = 0; i < p->cnt; i++) {
+                    acc = op(std::move(acc), p->keys()[i]);
+                }
+                if (p == ranges[t].second) {
+                    break;
+                }
+            }
+            results[t] = std::move(acc);
+        });
+        R res = std::move(identity);
+        for (R &r : results) {
+            res = combine(std::move(res), std::move(r));
         }
-        p->mx = p->children.back()->mx;
-        for (auto &i : p->children) {
-            i->parent = p;
+        return res;
+    }
+
+    iterator find(const T &elem) const {
+        return find_impl(elem);
+    }
+
+    template<typename K, typename C = key_compare, typename = typename C::is_transparent>
+    iterator find(const K &elem) const {
+        return find_impl(elem);
+    }
+
+    // find() for every key of [first, last), the results are written to
+    // out in the same order. Lookups go down the tree in groups of
+    // btree_detail::batch_group, one level at a time, and the next node of
+    // every lookup is prefetched before the others are searched, so the
+    // cache misses of a group overlap instead of following each other.
+    // Pays off once the tree is much larger than the cache, the keys need
+    // not be sorted.
+    template<typename Iter, typename Out>
+    Out find_batch(Iter first, Iter last, Out out) const {
+        lookup_batch(first, last, [this, &out](Leaf* l, btree_detail::search_result r) {
+            *out++ = r.eq ? iterator(l, r.pos) : end();
+        });
+        return out;
+    }
+
+    // Same as find_batch(), writes whether each key is present
+    template<typename Iter, typename Out>
+    Out contains_batch(Iter first, Iter last, Out out) const {
+        lookup_batch(first, last, [&out](Leaf*, btree_detail::search_result r) {
+            *out++ = r.eq;
+        });
+        return out;
+    }
+
+    // Returns the position of the element and whether it was inserted.
+    // With equal keys allowed it is always inserted, after the equal keys
+    // already present. The leftmost leaf is never replaced and the
+    // rightmost one is tracked by split(), so no extra descent is needed.
+    std::pair<iterator, bool> insert(const T &elem) {
+        return insert_impl(elem);
+    }
+
+    std::pair<iterator, bool> insert(T &&elem) {
+        return insert_impl(std::move(elem));
+    }
+
+    // The element is built once and then moved into its slot
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        return insert_impl(T(std::forward<Args>(args)...));
+    }
+
+    // Insert a range sorted by the comparator, duplicates are skipped
+    // unless the policy allows equal keys.
+    // There is one descent per touched leaf: all keys going to a leaf
+    // are merged into it in one pass, and an overfull leaf is cut into
+    // as many leaves as needed at once, so every node on the way up is
+    // split at most once per leaf. Returns the number of inserted keys.
+    template<typename Iter>
+    size_t insert_batch(Iter first, Iter last) {
+        static_assert(!has_values, "not available for maps");
+        size_t before = sz;
+        std::vector<T> add;
+        std::vector<Node*> fresh;
+        Leaf* cur = nullptr;
+        while (first != last) {
+            // Dense batches go on to the next leaf, which is checked by its
+            // separator in the parent, otherwise descend
+            unsigned int i = 0;
+            if (head == empty_root()) {
+                cur = new_leaf();
+                head = begin_iter = end_iter = cur;
+            } else if (cur != nullptr && cur->parent != nullptr && cur->pos + 1 < cur->parent->cnt
+                && !less(cur->parent->keys()[cur->pos + 1], *first)) {
+                cur = leaf(inner(cur->parent)->children[cur->pos + 1]);
+            } else {
+                if constexpr (multi) {
+                    std::tie(cur, i) = descend_upper(*first);
+                } else {
+                    auto [l, r] = descend(*first);
+                    cur = l;
+                    i = r.pos;
+                }
+            }
+            // The leaf takes the keys up to its maximum, the last one takes all.
+            // Equal keys go to the last leaf holding them, so it takes the
+            // keys less than the first one of the next leaf.
+            T* k = cur->keys();
+            unsigned int pos = 0;
+            add.clear();
+            for (; first != last && (cur->next == nullptr
+                || (multi ? less(*first, cur->next->keys()[0]) : !less(cur->max(), *first))); ++first) {
+                if constexpr (multi) {
+                    // Equal keys go after those of the leaf
+                    while (i < cur->cnt && !less(*first, k[i])) {
+                        i++;
+                    }
+                } else {
+                    while (i < cur->cnt && less(k[i], *first)) {
+                        i++;
+                    }
+                    if (i < cur->cnt && !less(*first, k[i])) {
+                        continue;
+                    }
+                    if (!add.empty() && !less(add.back(), *first)) {
+                        continue;
+                    }
+                }
+                pos = i;
+                add.emplace_back(*first);
+            }
+            if (add.empty()) {
+                continue;
+            }
+            sz += add.size();
+            add_count(cur, static_cast<std::ptrdiff_t>(add.size()));
+            if (add.size() == 1) {
+                // A lone key goes the way of insert()
+                cur->insert_key(pos, std::move(add[0]));
+                if (pos == cur->cnt - 1) {
+                    update_max(cur);
+                }
+                Node* sibling = split(cur);
+                if (sibling != nullptr) {
+                    cur = leaf(sibling);
+                }
+                continue;
+            }
+            // Spread the keys evenly, every leaf gets from B to 2 * B - 1 of them
+            unsigned int cnt = cur->cnt;
+            size_t total = cnt + add.size();
+            size_t q = (total + 2 * B - 2) / (2 * B - 1);
+            this->tick(counter::splits, q - 1);
+            size_t base = total / q;
+            size_t rem = total % q;
+            Leaf* prev = cur;
+            for (size_t p = 1; p < q; p++) {
+                Leaf* l = new_leaf();
+                l->cnt = static_cast<unsigned int>(base + (p < rem));
+                prev->link_after(l);
+                fresh.push_back(l);
+                prev = l;
+            }
+            // Merge from the back straight into the final slots. Keys of cur
+            // are taken from the top, so a slot of cur is either free or
+            // already moved from when it is written.
+            size_t j = add.size();
+            i = cnt;
+            size_t part = q - 1;
+            size_t from = part * base + std::min(part, rem);
+            Leaf* dst = prev;
+            for (size_t w = total; w-- > 0;) {
+                if (j == 0 && part == 0) {
+                    break;
+                }
+                while (w < from) {
+                    part--;
+                    from = part * base + std::min(part, rem);
+                    dst = part == 0 ? cur : leaf(fresh[part - 1]);
+                }
+                T &src = i != 0 && (j == 0 || less(add[j - 1], k[i - 1])) ? k[--i] : add[--j];
+                if (part != 0 || w >= cnt) {
+                    new (dst->keys() + (w - from)) T(std::move(src));
+                } else {
+                    k[w] = std::move(src);
+                }
+            }
+            cur->cnt = static_cast<unsigned int>(base + (0 < rem));
+            for (unsigned int c = cur->cnt; c < cnt; c++) {
+                k[c].~T();
+            }
+            if (cur == end_iter) {
+                end_iter = prev;
+            }
+            if (fresh.empty()) {
+                update_max(cur);
+            }
+            insert_after(cur, fresh);
+            cur = prev;
         }
+        return sz - before;
     }
 
-    void recalc_iter() {
-        Node* cur = head.get();
-        while (!cur->children.empty()) {
-            cur = cur->children[0].get();
+    // Returns the number of erased elements. With equal keys allowed all
+    // of them are erased, erase(find(elem)) removes only one.
+    size_t erase(const T &elem) {
+        return erase_impl(elem);
+    }
+
+    template<typename K, typename C = key_compare, typename = typename C::is_transparent>
+    size_t erase(const K &elem) {
+        return erase_impl(elem);
+    }
+
+    // Returns the iterator following the erased element. There is no
+    // descent, only the leaf and the path above it are touched.
+    iterator erase(iterator pos) {
+        return erase_in_leaf(pos.ptr, pos.slot, pos.slot + 1);
+    }
+
+    // Erase [first, last) in O(log n + k). The range is cut out of the
+    // tree as whole subtrees, and only the nodes along its two ends are
+    // rebalanced when the remaining parts are joined.
+    iterator erase(iterator first, iterator last) {
+        if (first == last) {
+            return last;
         }
-        begin_iter = cur;
+        if (first.ptr == last.ptr) {
+            return erase_in_leaf(first.ptr, first.slot, last.slot);
+        }
+        return erase_range(first, last);
     }
 
-    // Split a vertex into two if it has too many children
-    void split(Node* cur) {
-        while (cur->children.size() == 2 * B) {
-            // If root has too many children, create new root
-            if (cur->parent == nullptr) {
-                std::unique_ptr<Node> new_root(new Node);
-                new_root->mx = head->mx;
-                new_root->children.emplace_back(std::move(head));
-                head = std::move(new_root);
-                cur->parent = head.get();
-            }
-            // Create a child, move current node's children to it
-            auto i = cur->parent->children.begin();
-            while (i->get() != cur) {
-                i++;
-            }
-            i++;
-            int ind = i - cur->parent->children.begin();
-            cur->parent->children.emplace(i, new Node);
-            Node* to = cur->parent->children[ind].get();
-            // Moving children
-            for (int j = B; j < 2 * B; j++) {
-                to->children.emplace_back(std::move(cur->children[j]));
-            }
-            for (int j = 0; j < B; j++) {
-                cur->children.pop_back();
-            }
-            recalc(to);
-            recalc(cur);
-            recalc(cur->parent);
-            cur = cur->parent;
-        }
-    }
-
-    // Move children to a vertex, which has too few children
-    void merge(Node* cur) {
-        while (cur->children.size() < B) {
-            // If root has only one child and it's not a leaf, remove root
-            if (cur->parent == nullptr) {
-                if (cur->children.size() == 1 && !cur->children[0]->children.empty()) {
-                    head = std::move(head->children[0]);
-                    head->parent = nullptr;
-                    recalc(head.get());
+    // Erase a range of keys sorted by the comparator. There is one descent
+    // per touched leaf, all keys of the range found in it are removed in
+    // one pass, and the leaf is rebalanced once however many it lost.
+    // With equal keys allowed every occurrence is erased. Returns the
+    // number of erased keys.
+    template<typename Iter>
+    size_t erase_batch(Iter first, Iter last) {
+        static_assert(!has_values, "not available for maps");
+        size_t before = sz;
+        while (first != last && sz != 0) {
+            Leaf* cur = descend(*first).first;
+            T* k = cur->keys();
+            unsigned int n = cur->cnt;
+            unsigned int i = 0;
+            unsigned int w = 0;
+            // Compact the kept keys to the front, up to the first key past the leaf
+            for (; first != last; ++first) {
+                while (i < n && less(k[i], *first)) {
+                    if (w != i) {
+                        k[w] = std::move(k[i]);
+                    }
+                    i++;
+                    w++;
+                }
+                if (i == n) {
+                    break;
+                }
+                if constexpr (multi) {
+                    while (i < n && !less(*first, k[i])) {
+                        i++;
+                    }
+                    // More of them may be in the next leaf
+                    if (i == n) {
+                        break;
+                    }
+                } else if (!less(*first, k[i])) {
+                    i++;
                 }
-                return;
             }
-            int i = 0;
-            while (cur->parent->children[i].get() != cur) {
-                i++;
-            }
-            Node* neigh;
-            // If vertex isn't the rightest child, interract with left sibling, else with the right
-            if (i != 0) {
-                neigh = cur->parent->children[i - 1].get();
-                // Attempt to "steal" a child
-                if (neigh->children.size() > B) {
-                    cur->children.insert(cur->children.begin(), std::move(neigh->children.back()));
-                    neigh->children.pop_back();
-                    recalc(neigh);
-                    recalc(cur);
-                    return;
-                }
-                // Merging vertices
-                for (int j = 0; j < cur->children.size(); j++) {
-                    neigh->children.push_back(std::move(cur->children[j]));
-                }
-                recalc(neigh);
-                cur = cur->parent;
-                cur->children.erase(cur->children.begin() + i);
-            } else {
-                neigh = cur->parent->children[i + 1].get();
-                // Attempt to "steal" a child
-                if (neigh->children.size() > B) {
-                    cur->children.push_back(std::move(neigh->children[0]));
-                    neigh->children.erase(neigh->children.begin());
-                    recalc(neigh);
-                    recalc(cur);
-                    return;
+            bool past_end = i == n && cur->next == nullptr;
+            if (w != i) {
+                for (; i < n; i++, w++) {
+                    k[w] = std::move(k[i]);
+                }
+                for (unsigned int j = w; j < n; j++) {
+                    k[j].~T();
                 }
-                // Merging vertices
-                for (int j = 0; j < neigh->children.size(); j++) {
-                    cur->children.push_back(std::move(neigh->children[j]));
+                cur->cnt = w;
+                sz -= n - w;
+                add_count(cur, -static_cast<std::ptrdiff_t>(n - w));
+                if (w != 0) {
+                    update_max(cur);
                 }
-                recalc(cur);
-                cur = cur->parent;
-                cur->children.erase(cur->children.begin() + i + 1);
+                merge(cur);
             }
+            // Keys past the last leaf aren't in the set
+            if (past_end) {
+                break;
+            }
+        }
+        if (sz == 0) {
+            free_tree();
         }
+        return before - sz;
     }
 
-public:
-    Set()
-        : head(new Node)
-        , sz(0) {
+    // Append right, all of whose keys are greater than those of this set
+    // (not less with equal keys allowed), and leave it empty. The lower
+    // tree is grafted onto the spine of the higher one, so this takes
+    // O(log n) and touches no keys. Nodes from a different allocator are
+    // copied first.
+    void join(Set &right) {
+        if (this == &right || right.empty()) {
+            return;
+        }
+        if constexpr (!std::allocator_traits<Allocator>::is_always_equal::value) {
+            if (leaf_alloc != right.leaf_alloc) {
+                Set tmp(right, get_allocator());
+                right.clear();
+                join(tmp);
+                return;
+            }
+        }
+        if (empty()) {
+            free_tree();
+            steal(right);
+            return;
+        }
+        end_iter->next = right.begin_iter;
+        right.begin_iter->prev = end_iter;
+        unsigned int h;
+        head = join(head, height(head), right.head, height(right.head), h);
+        sz += right.sz;
+        right.head = empty_root();
+        right.sz = 0;
+        right.recalc_iter();
         recalc_iter();
     }
 
-    template<typename Iter>
-    Set(Iter begin, Iter end)
-        : Set() {
-        while (begin != end) {
-            insert(*begin);
-            begin++;
+    void join(Set &&right) {
+        join(right);
+    }
+
+    // Move [pos, end()) into a new set, this one keeps the keys before
+    // pos. The tree is cut along the path to pos in O(log n). Sizes of the
+    // two parts come from the subtree counts with order statistics,
+    // otherwise the leaves of the smaller part are counted, O(min(k, n - k) / B).
+    Set split(iterator pos) {
+        Set res(key_comp(), get_allocator());
+        if (pos == end()) {
+            return res;
+        }
+        if (pos == begin()) {
+            res.steal(*this);
+            return res;
         }
+        size_t n = count_before(pos);
+        Node* l;
+        Node* r;
+        unsigned int hl, hr;
+        cut(pos.ptr, pos.slot, l, hl, r, hr);
+        head = l;
+        res.head = r;
+        res.sz = sz - n;
+        sz = n;
+        recalc_iter();
+        res.recalc_iter();
+        return res;
+    }
+
+    // Move the keys not less than key into a new set
+    Set split_at(const T &key) {
+        return split(lower_bound_impl(key));
     }
 
-    Set(std::initializer_list<T> init)
-        : Set(init.begin(), init.end()) {}
+    template<typename K, typename C = key_compare, typename = typename C::is_transparent>
+    Set split_at(const K &key) {
+        return split(lower_bound_impl(key));
+    }
 
-    Set(const Set &set)
-        : Set() {
-        for (const auto &i : set) {
-            insert(i);
+    // Move the keys of source to this set, like std::set::merge keys
+    // already present stay in source. Only the range where the two sets
+    // overlap is merged key by key and rebuilt with bulk_load(), the parts
+    // below and above it are split off and joined back as whole subtrees,
+    // so this takes O(log n + k) for k keys in the overlap. Disjoint sets
+    // are just joined. Iterators of both sets are invalidated.
+    void merge(Set &source) {
+        static_assert(!has_values, "not available for maps");
+        if (this == &source || source.empty()) {
+            return;
+        }
+        if constexpr (!std::allocator_traits<Allocator>::is_always_equal::value) {
+            if (leaf_alloc != source.leaf_alloc) {
+                Set tmp(source, get_allocator());
+                source.clear();
+                merge(tmp);
+                source = std::move(tmp);
+                return;
+            }
+        }
+        if (empty() || (multi ? !less(source.min_key(), max_key()) : less(max_key(), source.min_key()))) {
+            join(source);
+            return;
+        }
+        if (less(source.max_key(), min_key())) {
+            source.join(*this);
+            steal(source);
+            return;
+        }
+        // Keys above the smaller maximum are in one set only, and so are
+        // the keys below the larger minimum. Every cut is at a key of the
+        // other set, which isn't cut at the same time.
+        bool a_higher = less(source.max_key(), max_key());
+        bool b_higher = less(max_key(), source.max_key());
+        Set a_hi = split(a_higher ? equal_range_impl(source.max_key()).second : end());
+        Set b_hi = source.split(b_higher ? source.equal_range_impl(max_key()).second : source.end());
+        bool a_lower = less(min_key(), source.min_key());
+        bool b_lower = less(source.min_key(), min_key());
+        Set a_mid = split(a_lower ? lower_bound_impl(source.min_key()) : begin());
+        Set b_mid = source.split(b_lower ? source.lower_bound_impl(min_key()) : source.begin());
+        std::vector<T> a_keys = a_mid.take_keys();
+        std::vector<T> b_keys = b_mid.take_keys();
+        std::vector<T> out;
+        std::vector<T> dup;
+        out.reserve(a_keys.size() + b_keys.size());
+        auto i = a_keys.begin();
+        auto j = b_keys.begin();
+        while (i != a_keys.end() && j != b_keys.end()) {
+            // With equal keys allowed those of source go after ours
+            if (less(*j, *i)) {
+                out.push_back(std::move(*j++));
+            } else if (multi || less(*i, *j)) {
+                out.push_back(std::move(*i++));
+            } else {
+                out.push_back(std::move(*i++));
+                dup.push_back(std::move(*j++));
+            }
         }
+        std::move(i, a_keys.end(), std::back_inserter(out));
+        std::move(j, b_keys.end(), std::back_inserter(out));
+        a_mid.bulk_load(std::make_move_iterator(out.begin()), std::make_move_iterator(out.end()));
+        join(source);
+        join(a_mid);
+        join(a_hi);
+        join(b_hi);
+        source.bulk_load(std::make_move_iterator(dup.begin()), std::make_move_iterator(dup.end()));
     }
 
-    Set &operator=(const Set &set) {
-        Set tmp(set);
-        head.reset(tmp.head.release());
-        sz = tmp.sz;
-        recalc_iter();
-        return *this;
+    void merge(Set &&source) {
+        merge(source);
     }
 
-    bool empty() const {
-        return sz == 0;
+    iterator lower_bound(const T &elem) const {
+        return lower_bound_impl(elem);
     }
 
-    size_t size() const {
-        return sz;
+    template<typename K, typename C = key_compare, typename = typename C::is_transparent>
+    iterator lower_bound(const K &elem) const {
+        return lower_bound_impl(elem);
     }
 
-    class iterator {
-        friend Set;
+    iterator upper_bound(const T &elem) const {
+        return equal_range_impl(elem).second;
+    }
 
-    private:
-        Node* ptr;
+    template<typename K, typename C = key_compare, typename = typename C::is_transparent>
+    iterator upper_bound(const K &elem) const {
+        return equal_range_impl(elem).second;
+    }
 
-        iterator(Node* p) : ptr(p) {}
+    // A single descent, the range holds at most one element. With equal
+    // keys allowed there are two, one for each end.
+    std::pair<iterator, iterator> equal_range(const T &elem) const {
+        return equal_range_impl(elem);
+    }
 
-    public:
-        iterator() {}
+    template<typename K, typename C = key_compare, typename = typename C::is_transparent>
+    std::pair<iterator, iterator> equal_range(const K &elem) const {
+        return equal_range_impl(elem);
+    }
 
-        iterator(const iterator &iter)
-            : ptr(iter.ptr) {}
+    // O(log n) for a set, O(log n + k) for a multiset without order
+    // statistics
+    size_t count(const T &elem) const {
+        return count_impl(elem);
+    }
 
-        iterator& operator=(const iterator &iter) {
-            ptr = iter.ptr;
-            return *this;
+    template<typename K, typename C = key_compare, typename = typename C::is_transparent>
+    size_t count(const K &elem) const {
+        return count_impl(elem);
+    }
+
+    // Order statistics, available with a policy that enables them
+
+    // Number of elements less than elem
+    size_t rank(const T &elem) const {
+        return index(lower_bound_impl(elem));
+    }
+
+    template<typename K, typename C = key_compare, typename = typename C::is_transparent>
+    size_t rank(const K &elem) const {
+        return index(lower_bound_impl(elem));
+    }
+
+    // Number of elements before iter
+    size_t index(iterator iter) const {
+        static_assert(order_statistics, "index() needs a policy with order_statistics");
+        size_t n = iter.slot;
+        for (Node* p = iter.ptr; p->parent != nullptr; p = p->parent) {
+            const Inner* par = inner(p->parent);
+            for (unsigned int j = 0; j < p->pos; j++) {
+                n += par->counts[j];
+            }
         }
+        return n;
+    }
 
-        bool operator==(iterator iter) const {
-            return ptr == iter.ptr;
+    // The element with k smaller ones, end() if there is none
+    iterator select(size_t k) const {
+        static_assert(order_statistics, "select() needs a policy with order_statistics");
+        if (k >= sz) {
+            return end();
+        }
+        Node* cur = head;
+        this->tick(counter::node_visits);
+        while (!cur->leaf) {
+            const Inner* in = inner(cur);
+            unsigned int j = 0;
+            while (k >= in->counts[j]) {
+                k -= in->counts[j];
+                j++;
+            }
+            cur = in->children[j];
+            this->tick(counter::node_visits);
         }
+        return iterator(leaf(cur), static_cast<unsigned int>(k));
+    }
 
-        bool operator!=(iterator iter) const {
-            return !(*this == iter);
+    // Number of elements in [first, last) in O(log n)
+    std::ptrdiff_t distance(iterator first, iterator last) const {
+        return static_cast<std::ptrdiff_t>(index(last)) - static_cast<std::ptrdiff_t>(index(first));
+    }
+
+    // Counters of the work done since the set was created, available with
+    // a policy that enables instrumentation. Copies and moved-to sets
+    // start from zero.
+    operation_counters counters() const {
+        static_assert(instrumentation, "counters() needs a policy with instrumentation");
+        if constexpr (instrumentation) {
+            return CounterHolder::counters();
+        } else {
+            return {};
         }
+    }
 
-        const T& operator*() const {
-            return *(ptr->data);
+    void reset_counters() {
+        static_assert(instrumentation, "reset_counters() needs a policy with instrumentation");
+        if constexpr (instrumentation) {
+            CounterHolder::reset_counters();
         }
+    }
 
-        const std::unique_ptr<const T>& operator->() const {
-            return ptr->data;
+    // Walk the whole tree and throw std::logic_error if its structure is
+    // broken: node sizes out of [B, 2 * B - 1] below the root, leaves at
+    // different depths, unsorted keys, separators which aren't the
+    // maximum of their child, wrong parent links, positions or subtree
+    // sizes, a broken leaf chain, begin and end leaves or size(). O(n),
+    // for tests and debugging.
+    void check_invariants() const {
+        if (head->parent != nullptr) {
+            invariant_failed("the root has a parent");
         }
+        if (empty_root()->cnt != 0) {
+            invariant_failed("the shared empty root was written to");
+        }
+        // Erasing the last key leaves an empty leaf as the root
+        if (sz == 0) {
+            if (!head->leaf || head->cnt != 0 || begin_iter != head || end_iter != head) {
+                invariant_failed("an empty set has keys or nodes besides an empty root leaf");
+            }
+            return;
+        }
+        const Leaf* prev = nullptr;
+        size_t n = check_subtree(head, 0, height(head), prev);
+        if (prev != end_iter || prev->next != nullptr) {
+            invariant_failed("the last leaf isn't the end leaf");
+        }
+        if (n != sz) {
+            invariant_failed("size() doesn't match the number of keys");
+        }
+    }
 
-        iterator operator++() {
-            Node* cur = ptr->parent;
-            Node* prev = ptr;
-            while (cur != nullptr && cur->children.back().get() == prev) {
-                prev = cur;
-                cur = cur->parent;
-            }
-            if (cur == nullptr) {
-                ptr = prev;
-                return *this;
+    // Copy the keys into a FrozenSet in O(n), include frozen_tree.h to
+    // use it. The frozen set is independent of this one. Its array is
+    // allocated with std::allocator, Allocator may be a node pool.
+    template<unsigned int FrozenB = btree_detail::frozen_fanout>
+    FrozenSet<T, FrozenB, Compare, std::allocator<T>> freeze() const & {
+        static_assert(!has_values, "not available for maps");
+        return FrozenSet<T, FrozenB, Compare, std::allocator<T>>(sorted_unique, begin(), end(), key_comp());
+    }
+
+    // Same, the keys are moved and this set is left empty
+    template<unsigned int FrozenB = btree_detail::frozen_fanout>
+    FrozenSet<T, FrozenB, Compare, std::allocator<T>> freeze() && {
+        static_assert(!has_values, "not available for maps");
+        std::vector<T> keys = take_keys();
+        return FrozenSet<T, FrozenB, Compare, std::allocator<T>>(sorted_unique, std::make_move_iterator(keys.begin()),
+                                                                 std::make_move_iterator(keys.end()), key_comp());
+    }
+
+    // Shape of the tree, level by level in O(n / B). Needs no policy.
+    tree_stats stats() const {
+        tree_stats res;
+        if (empty()) {
+            return res;
+        }
+        std::vector<const Node*> level(1, head);
+        std::vector<const Node*> below;
+        size_t entries = 0;
+        while (true) {
+            res.level_nodes.push_back(level.size());
+            size_t n = 0;
+            for (const Node* p : level) {
+                n += p->cnt;
             }
-            int i = 0;
-            while (cur->children[i].get() != prev) {
-                i++;
+            entries += n;
+            if (level[0]->leaf) {
+                res.leaves = level.size();
+                res.leaf_fill = static_cast<double>(n) / (2.0 * B * level.size());
+                break;
             }
-            cur = cur->children[i + 1].get();
-            while (!cur->children.empty()) {
-                cur = cur->children[0].get();
+            res.inner_nodes += level.size();
+            below.clear();
+            for (const Node* p : level) {
+                const Inner* in = static_cast<const Inner*>(p);
+                below.insert(below.end(), in->children, in->children + in->cnt);
             }
-            ptr = cur;
-            return *this;
+            level.swap(below);
         }
+        res.height = static_cast<unsigned int>(res.level_nodes.size());
+        res.fill = static_cast<double>(entries) / (2.0 * B * (res.leaves + res.inner_nodes));
+        res.bytes = res.leaves * sizeof(Leaf) + res.inner_nodes * sizeof(Inner);
+        return res;
+    }
 
-        iterator operator++(int) {
-            iterator ret = *this;
-            ++(*this);
-            return ret;
-        }
+private:
+    [[noreturn]] static void invariant_failed(const char* what) {
+        throw std::logic_error(std::string("Set invariant violated: ") + what);
+    }
 
-        iterator operator--() {
-            // If iter == end(), descend to the maximum
-            if (!ptr->children.empty()) {
-                while (!ptr->children.empty()) {
-                    ptr = ptr->children.back().get();
+    // Check the subtree of p at the given depth, the leaves are at depth
+    // h. prev is the leaf before the subtree, on return its last leaf.
+    // Returns the number of keys.
+    size_t check_subtree(const Node* p, unsigned int depth, unsigned int h, const Leaf* &prev) const {
+        bool root = p == head;
+        if (p->cnt > 2 * B - 1) {
+            invariant_failed("a node is overfull");
+        }
+        if (!root && p->cnt < B) {
+            invariant_failed("a node is underfull");
+        }
+        if (p->leaf) {
+            const Leaf* l = static_cast<const Leaf*>(p);
+            const T* k = l->keys();
+            if (depth != h) {
+                invariant_failed("leaves are at different depths");
+            }
+            if (l->cnt == 0) {
+                invariant_failed("a leaf is empty");
+            }
+            for (unsigned int i = 1; i < l->cnt; i++) {
+                if (multi ? less(k[i], k[i - 1]) : !less(k[i - 1], k[i])) {
+                    invariant_failed("keys of a leaf are out of order");
                 }
-                return *this;
             }
-            Node* cur = ptr->parent;
-            Node* prev = ptr;
-            while (cur->children[0].get() == prev) {
-                prev = cur;
-                cur = cur->parent;
+            if (l->prev != prev || (prev == nullptr ? l != begin_iter : prev->next != l)) {
+                invariant_failed("the leaf chain is broken");
+            }
+            if (prev != nullptr && (multi ? less(k[0], prev->max()) : !less(prev->max(), k[0]))) {
+                invariant_failed("keys of neighbouring leaves are out of order");
+            }
+            prev = l;
+            return l->cnt;
+        }
+        if (depth == h) {
+            invariant_failed("leaves are at different depths");
+        }
+        if (root && p->cnt < 2) {
+            invariant_failed("an internal root has a single child");
+        }
+        const Inner* in = static_cast<const Inner*>(p);
+        size_t total = 0;
+        for (unsigned int i = 0; i < in->cnt; i++) {
+            const Node* c = in->children[i];
+            if (c->parent != p || c->pos != i) {
+                invariant_failed("a child has a wrong parent or position");
             }
-            int i = 0;
-            while (cur->children[i].get() != prev) {
-                i++;
+            size_t n = check_subtree(c, depth + 1, h, prev);
+            if constexpr (order_statistics) {
+                if (in->counts[i] != n) {
+                    invariant_failed("a subtree size is wrong");
+                }
             }
-            cur = cur->children[i - 1].get();
-            while (!cur->children.empty()) {
-                cur = cur->children.back().get();
+            if (less(in->keys()[i], c->max()) || less(c->max(), in->keys()[i])) {
+                invariant_failed("a separator isn't the maximum of its child");
             }
-            ptr = cur;
-            return *this;
+            total += n;
         }
+        return total;
+    }
 
-        iterator operator--(int) {
-            iterator ret = *this;
-            --(*this);
-            return ret;
+    // Descend with up to batch_group keys at once and call f with the
+    // leaf and search result of each, in input order
+    template<typename Iter, typename F>
+    void lookup_batch(Iter first, Iter last, F f) const {
+        constexpr unsigned int group = btree_detail::batch_group;
+        unsigned int levels = height(head);
+        Iter keys[group];
+        Node* cur[group];
+        while (first != last) {
+            unsigned int n = 0;
+            for (; n < group && first != last; ++first, n++) {
+                keys[n] = first;
+                cur[n] = head;
+            }
+            this->tick(counter::node_visits, n);
+            for (unsigned int d = 0; d < levels; d++) {
+                for (unsigned int g = 0; g < n; g++) {
+                    Inner* in = inner(cur[g]);
+                    unsigned int i = lower(in, *keys[g]);
+                    if (i == in->cnt) {
+                        i--;
+                    }
+                    cur[g] = in->children[i];
+                    this->tick(counter::node_visits);
+                    // An internal node is searched and then one of its
+                    // children read, of a leaf only the keys
+                    btree_detail::prefetch(cur[g], d + 1 < levels ? sizeof(Inner) : sizeof(Node));
+                }
+            }
+            for (unsigned int g = 0; g < n; g++) {
+                f(leaf(cur[g]), search(cur[g], *keys[g]));
+            }
         }
-    };
+    }
 
-    iterator begin() const {
-        return iterator(begin_iter);
+    template<typename K>
+    iterator find_impl(const K &elem) const {
+        auto [l, r] = descend(elem);
+        return r.eq ? iterator(l, r.pos) : end();
     }
 
-    iterator end() const {
-        return iterator(head.get());
+    template<typename K>
+    size_t count_impl(const K &elem) const {
+        if constexpr (multi) {
+            auto [first, last] = equal_range_impl(elem);
+            return count_range(first, last);
+        }
+        return descend(elem).second.eq;
     }
 
-    iterator find(T elem) const {
-        if (empty()) {
-            return end();
+    // For a map the value is built in place from args, only if the key
+    // is inserted
+    template<typename U, typename... Args>
+    std::pair<iterator, bool> insert_impl(U &&elem, Args&&... args) {
+        Leaf* cur;
+        unsigned int i;
+        if constexpr (multi) {
+            // After the equal keys already present
+            std::tie(cur, i) = descend_upper(elem);
+        } else {
+            // If the element is present, it is in the leaf found by descend()
+            auto [l, r] = descend(elem);
+            if (r.eq) {
+                return {iterator(l, r.pos), false};
+            }
+            cur = l;
+            i = r.pos;
         }
-        Node* cur = head.get();
-        while (!cur->children.empty()) {
-            int i = 0;
-            while (i < cur->children.size() && *(cur->children[i]->mx) < elem) {
-                i++;
+        if (cur == empty_root()) {
+            cur = new_leaf();
+            head = begin_iter = end_iter = cur;
+        }
+        if constexpr (has_values) {
+            // The value goes first, so that a throwing key leaves it to undo
+            Value* v = cur->values();
+            shift_up(v + i, cur->cnt - i, 1);
+            try {
+                new (v + i) Value(std::forward<Args>(args)...);
+            } catch (...) {
+                shift_down(v + i, 1, cur->cnt - i + 1);
+                throw;
             }
-            if (i == cur->children.size()) {
-                return end();
+            try {
+                cur->insert_key(i, std::forward<U>(elem));
+            } catch (...) {
+                v[i].~Value();
+                shift_down(v + i, 1, cur->cnt - i + 1);
+                throw;
             }
-            cur = cur->children[i].get();
+        } else {
+            static_assert(sizeof...(Args) == 0, "a set has no values");
+            cur->insert_key(i, std::forward<U>(elem));
+        }
+        sz++;
+        add_count(cur, 1);
+        if (i == cur->cnt - 1) {
+            update_max(cur);
         }
-        if (!(*(cur->data) < elem) && !(elem < *(cur->data))) {
-            return iterator(cur);
+        Node* sibling = split(cur);
+        if (sibling != nullptr && i >= B) {
+            return {iterator(leaf(sibling), i - B), true};
         }
-        return end();
+        return {iterator(cur, i), true};
     }
 
-    void insert(T elem) {
-        if (empty()) {
-            sz++;
-            head->children.emplace_back(new Node(elem, head.get()));
-            recalc(head.get());
-            recalc_iter();
-            return;
+    template<typename K>
+    size_t erase_impl(const K &elem) {
+        if constexpr (multi) {
+            auto [first, last] = equal_range_impl(elem);
+            size_t n = count_range(first, last);
+            erase(first, last);
+            return n;
         }
-        if (find(elem) != end()) {
-            return;
+        iterator iter = find_impl(elem);
+        if (iter == end()) {
+            return 0;
         }
-        sz++;
-        // Descend tree to find a place for the element
-        Node* cur = head.get();
-        while (!cur->children.empty()) {
-            int i = 0;
-            while (*(cur->children[i]->mx) < elem && i < cur->children.size() - 1) {
-                i++;
-            }
-            cur = cur->children[i].get();
-        }
-        cur = cur->parent;
-        auto i = cur->children.begin();
-        while (i != cur->children.end() && *(i->get()->data) < elem) {
-            i++;
-        }
-        cur->children.emplace(i, new Node(elem, cur));
-        // Update maximums in parents
-        Node* pos = cur;
-        while (pos != nullptr) {
-            recalc(pos);
-            pos = pos->parent;
-        }
-        split(cur);
-        recalc_iter();
+        erase(iter);
+        return 1;
     }
 
-    void erase(T elem) {
-        iterator iter = find(elem);
-        if (iter == end()) {
-            return;
-        }
-        sz--;
-        // Remove element
-        Node* cur = iter.ptr->parent;
-        auto i = cur->children.begin();
-        while (i->get() != iter.ptr) {
-            i++;
+    // Remove the keys in slots [from, to) of a leaf and rebalance it.
+    // Returns the iterator following them.
+    iterator erase_in_leaf(Leaf* p, unsigned int from, unsigned int to) {
+        unsigned int n = to - from;
+        T* k = p->keys();
+        std::move(k + to, k + p->cnt, k + from);
+        for (unsigned int j = p->cnt - n; j < p->cnt; j++) {
+            k[j].~T();
         }
-        cur->children.erase(i);
-        Node* pos = cur;
-        // Update maximums
-        while (pos != nullptr) {
-            recalc(pos);
-            pos = pos->parent;
+        if constexpr (has_values) {
+            Value* v = p->values();
+            std::move(v + to, v + p->cnt, v + from);
+            for (unsigned int j = p->cnt - n; j < p->cnt; j++) {
+                v[j].~Value();
+            }
         }
-        if (sz != 0) {
-            merge(cur);
+        p->cnt -= n;
+        sz -= n;
+        add_count(p, -static_cast<std::ptrdiff_t>(n));
+        iterator next(p, from);
+        if (from == p->cnt) {
+            if (p->cnt != 0) {
+                update_max(p);
+            }
+            if (p->next != nullptr) {
+                next = iterator(p->next, 0);
+            }
         }
-        recalc_iter();
+        merge(p, &next);
+        return next;
     }
 
-    iterator lower_bound(T elem) const {
-        if (empty()) {
+    // Cut the tree before first and before last, free the middle part and
+    // join the other two. The element at last is found again by counting
+    // keys leaf by leaf, as the first cut may move it.
+    iterator erase_range(iterator first, iterator last) {
+        size_t n = count_range(first, last);
+        Node* l;
+        Node* rest;
+        unsigned int hl, hrest;
+        cut(first.ptr, first.slot, l, hl, rest, hrest);
+        Leaf* p = first_leaf(rest);
+        size_t skip = n;
+        while (skip >= p->cnt && p->next != nullptr) {
+            skip -= p->cnt;
+            p = p->next;
+        }
+        Node* mid;
+        Node* r;
+        unsigned int hmid, hr;
+        cut(p, static_cast<unsigned int>(skip), mid, hmid, r, hr);
+        destroy(mid);
+        sz -= n;
+        if (l == nullptr && r == nullptr) {
+            head = empty_root();
+            recalc_iter();
+            return end();
+        }
+        Leaf* a = l != nullptr ? last_leaf(l) : nullptr;
+        Leaf* b = r != nullptr ? first_leaf(r) : nullptr;
+        unsigned int na = a != nullptr ? a->cnt : 0;
+        if (a != nullptr && b != nullptr) {
+            a->next = b;
+            b->prev = a;
+        }
+        unsigned int h;
+        head = join(l, hl, r, hr, h);
+        recalc_iter();
+        // join() keeps a, keys of a and b may have moved between them
+        if (b == nullptr) {
             return end();
         }
-        if (elem < *begin()) {
+        if (a == nullptr) {
             return begin();
         }
-        Node* cur = head.get();
-        while (!cur->children.empty()) {
-            int i = 0;
-            while (i < cur->children.size() && *(cur->children[i]->mx) < elem) {
-                i++;
-            }
-            if (i == cur->children.size()) {
-                return end();
+        if (a->cnt > na) {
+            return iterator(a, na);
+        }
+        return iterator(b, na - a->cnt);
+    }
+
+    // Number of elements in [first, last), by the counts of the subtrees
+    // if they are kept, otherwise leaf by leaf
+    size_t count_range(iterator first, iterator last) const {
+        if constexpr (Policy::order_statistics) {
+            return index(last) - index(first);
+        }
+        size_t n = 0;
+        for (Leaf* p = first.ptr;; p = p->next) {
+            n += (p == last.ptr ? last.slot : p->cnt) - (p == first.ptr ? first.slot : 0);
+            if (p == last.ptr) {
+                break;
             }
-            cur = cur->children[i].get();
         }
-        return iterator(cur);
+        return n;
+    }
+
+    // Number of elements before pos, by the counts of the subtrees if they
+    // are kept, otherwise by walking the leaves on both sides of pos at
+    // once until one side runs out
+    size_t count_before(iterator pos) const {
+        if constexpr (Policy::order_statistics) {
+            return index(pos);
+        }
+        size_t before = pos.slot;
+        size_t after = pos.ptr->cnt - pos.slot;
+        Leaf* a = pos.ptr->prev;
+        Leaf* b = pos.ptr->next;
+        while (a != nullptr && b != nullptr) {
+            before += a->cnt;
+            after += b->cnt;
+            a = a->prev;
+            b = b->next;
+        }
+        return a == nullptr ? before : sz - after;
+    }
+
+    // Smallest and largest keys of a set which isn't empty
+    const T &min_key() const {
+        return begin_iter->keys()[0];
+    }
+
+    const T &max_key() const {
+        return end_iter->keys()[end_iter->cnt - 1];
+    }
+
+    // Move all keys out in order and free the nodes. The buffer doesn't
+    // use Allocator, which may be a node pool.
+    std::vector<T> take_keys() {
+        std::vector<T> res;
+        res.reserve(sz);
+        for (Leaf* p = begin_iter; p != nullptr; p = p->next) {
+            std::move(p->keys(), p->keys() + p->cnt, std::back_inserter(res));
+        }
+        free_tree();
+        return res;
+    }
+
+    // Only the rightmost leaf is descended to with a key greater than all
+    // of its keys, so a position past the end of a leaf is end()
+    template<typename K>
+    iterator lower_bound_impl(const K &elem) const {
+        auto [l, r] = descend(elem);
+        return iterator(l, r.pos);
+    }
+
+    template<typename K>
+    std::pair<iterator, iterator> equal_range_impl(const K &elem) const {
+        if constexpr (multi) {
+            auto [l, i] = descend_upper(elem);
+            return {lower_bound_impl(elem), iterator(l, i)};
+        }
+        auto [l, r] = descend(elem);
+        iterator first(l, r.pos);
+        iterator last = first;
+        if (r.eq) {
+            ++last;
+        }
+        return {first, last};
     }
 };
+
+// Ordered set with equal keys allowed, like std::multiset. insert() always
+// inserts and still returns a pair, the flag is always true.
+template<typename T, unsigned int B = 2, typename Compare = std::less<T>, typename Allocator = std::allocator<T>, typename Policy = default_policy>
+using MultiSet = Set<T, B, Compare, Allocator, btree_detail::multi_policy<Policy>>;
+
+// Set algorithms on whole trees. The keys of the result are produced in
+// order and built bottom-up with bulk_load(), and only the range where the
+// inputs overlap is compared key by key: parts of the result which come
+// from one input alone are copied or joined as whole subtrees.
+
+// All keys of right are greater than those of left, O(log n)
+template<typename T, unsigned int B, typename Compare, typename Allocator, typename Policy>
+Set<T, B, Compare, Allocator, Policy> join(Set<T, B, Compare, Allocator, Policy> left, Set<T, B, Compare, Allocator, Policy> right) {
+    left.join(right);
+    return left;
+}
+
+// Keys of either set, O(n + m) for the copies, of which only the overlap
+// is merged
+template<typename T, unsigned int B, typename Compare, typename Allocator, typename Policy>
+Set<T, B, Compare, Allocator, Policy> set_union(const Set<T, B, Compare, Allocator, Policy> &a, const Set<T, B, Compare, Allocator, Policy> &b) {
+    static_assert(!Policy::multi, "not available with equal keys");
+    Set<T, B, Compare, Allocator, Policy> res(a);
+    Set<T, B, Compare, Allocator, Policy> rest(b, a.get_allocator());
+    res.merge(rest);
+    return res;
+}
+
+// Keys of both sets, O(log n + log m + k) for k keys of the two sets
+// within the range they share
+template<typename T, unsigned int B, typename Compare, typename Allocator, typename Policy>
+Set<T, B, Compare, Allocator, Policy> set_intersection(const Set<T, B, Compare, Allocator, Policy> &a, const Set<T, B, Compare, Allocator, Policy> &b) {
+    static_assert(!Policy::multi, "not available with equal keys");
+    auto less = [&a](const T &x, const T &y) {
+        return btree_detail::key_order<Compare, T, T>::less(a.key_comp(), x, y);
+    };
+    Set<T, B, Compare, Allocator, Policy> res(a.key_comp(), a.get_allocator());
+    if (a.empty() || b.empty()) {
+        return res;
+    }
+    std::vector<T> keys;
+    std::set_intersection(a.lower_bound(*b.begin()), a.upper_bound(*std::prev(b.end())),
+                          b.lower_bound(*a.begin()), b.upper_bound(*std::prev(a.end())),
+                          std::back_inserter(keys), less);
+    res.bulk_load(std::make_move_iterator(keys.begin()), std::make_move_iterator(keys.end()));
+    return res;
+}
+
+// Keys of a which aren't in b. The parts of a copy of a outside the range
+// of b are split off and joined back around the difference of the rest,
+// O(n) for the copy plus O(log n + log m + k) for k keys within the
+// shared range.
+template<typename T, unsigned int B, typename Compare, typename Allocator, typename Policy>
+Set<T, B, Compare, Allocator, Policy> set_difference(const Set<T, B, Compare, Allocator, Policy> &a, const Set<T, B, Compare, Allocator, Policy> &b) {
+    static_assert(!Policy::multi, "not available with equal keys");
+    auto less = [&a](const T &x, const T &y) {
+        return btree_detail::key_order<Compare, T, T>::less(a.key_comp(), x, y);
+    };
+    Set<T, B, Compare, Allocator, Policy> res(a);
+    if (a.empty() || b.empty()) {
+        return res;
+    }
+    Set<T, B, Compare, Allocator, Policy> hi = res.split(res.upper_bound(*std::prev(b.end())));
+    Set<T, B, Compare, Allocator, Policy> mid = res.split(res.lower_bound(*b.begin()));
+    if (!mid.empty()) {
+        std::vector<T> keys;
+        std::set_difference(mid.begin(), mid.end(), b.lower_bound(*mid.begin()), b.upper_bound(*std::prev(mid.end())),
+                            std::back_inserter(keys), less);
+        mid.bulk_load(std::make_move_iterator(keys.begin()), std::make_move_iterator(keys.end()));
+        res.join(mid);
+    }
+    res.join(hi);
+    return res;
+}